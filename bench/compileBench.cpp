@@ -0,0 +1,104 @@
+/**
+ * Compile-time scaling with cores: a program of independent top-level
+ * functions, compiled with 1, 2, 4, ... threads (XPCompiler::compileThreads).
+ *
+ *   g++ -std=c++17 -O2 -pthread ./bench/compileBench.cpp -o ./compile-bench
+ *   ./compile-bench [functions] [max threads]
+ *
+ * By default, 20000 functions and up to one thread per core. The time
+ * includes parsing, which stays on the calling thread; it's reported
+ * separately.
+ */
+#include <algorithm>
+#include <chrono>
+#include <iostream>
+#include <sstream>
+#include <string>
+#include <thread>
+
+#include "../src/vm/xp.h"
+
+static std::string generateProgram(int functions)
+{
+    std::stringstream ss;
+
+    for (auto i = 0; i < functions; i++)
+    {
+        ss << "(def f" << i << " (a b)\n"
+           << "  (begin\n"
+           << "    (var t (+ a b))\n"
+           << "    (var s \"\")\n"
+           << "    (while (< t " << i << ")\n"
+           << "      (begin\n"
+           << "        (if (> (* t 2) 10) (set s (+ s \"x\")) (set s (+ s \"y\")))\n"
+           << "        (set t (+ t 1))))\n"
+           << "    (if (== s \"\") (- t " << i << ") s)))\n";
+    }
+
+    ss << "(f" << functions - 1 << " 1 2)\n";
+
+    return ss.str();
+}
+
+/**
+ * Best time of `runs` calls of `f`, in seconds.
+ */
+template <typename F>
+static double best(int runs, F f)
+{
+    auto best = 1e9;
+
+    for (auto i = 0; i < runs; i++)
+    {
+        auto start = std::chrono::steady_clock::now();
+        f();
+        std::chrono::duration<double> elapsed = std::chrono::steady_clock::now() - start;
+        best = std::min(best, elapsed.count());
+    }
+
+    return best;
+}
+
+int main(int argc, char const *argv[])
+{
+    auto functions = argc > 1 ? std::stoi(argv[1]) : 20000;
+    size_t maxThreads = argc > 2 ? std::stoul(argv[2]) : std::max(std::thread::hardware_concurrency(), 1u);
+
+    auto program = generateProgram(functions);
+    const auto runs = 3;
+
+    auto parsing = best(runs, [&]()
+                        {
+        XPParser parser;
+        parser.parse("(begin " + program + ")"); });
+
+    std::cout << functions << " functions, " << program.size() / 1e6 << " MB, "
+              << std::thread::hardware_concurrency() << " cores\n"
+              << "parsing   : " << parsing * 1e3 << " ms\n";
+
+    double single = 0;
+
+    for (size_t threads = 1; threads <= maxThreads; threads *= 2)
+    {
+        auto time = best(runs, [&]()
+                         {
+            XPVM vm;
+            vm.getCompiler().compileThreads = threads;
+            vm.compile(program); });
+
+        if (threads == 1)
+        {
+            single = time;
+        }
+
+        std::cout << threads << " thread(s): " << time * 1e3 << " ms, speedup "
+                  << single / time << "x\n";
+
+        if (threads < maxThreads && threads * 2 > maxThreads)
+        {
+            threads = maxThreads / 2;
+        }
+    }
+
+    return 0;
+}
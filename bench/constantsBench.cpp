@@ -0,0 +1,86 @@
+/**
+ * Compile time of scripts with many literals (the constant pools, see
+ * CodeObject::numericConstIdx and stringConstIdx).
+ *
+ *   g++ -std=c++17 -O2 -pthread ./bench/constantsBench.cpp -o ./constants-bench
+ *   ./constants-bench                  # compile times for 2k..32k literals
+ *   ./constants-bench --script 10000   # print the script for 10000 literals
+ *
+ * The script is one function with a numeric and a string literal per
+ * rule, each used twice, so the pools both grow and are searched. With
+ * indexed pools the compile time grows linearly with the literals.
+ */
+#include <algorithm>
+#include <chrono>
+#include <cstring>
+#include <iostream>
+#include <sstream>
+#include <string>
+
+#include "../src/vm/xp.h"
+
+static std::string generateScript(int literals)
+{
+    std::stringstream ss;
+
+    ss << "(def rules (x)\n"
+       << "  (begin\n"
+       << "    (var n 0)\n"
+       << "    (var s \"\")\n";
+
+    for (auto i = 0; i < literals; i++)
+    {
+        ss << "    (if (== x " << i << ") (begin (set n " << i << ") (set s \"rule-" << i
+           << "\")) (if (== s \"rule-" << i << "\") (set n 0) (set n n)))\n";
+    }
+
+    ss << "    s))\n"
+       << "(rules " << literals - 1 << ")\n";
+
+    return ss.str();
+}
+
+/**
+ * Best time of `runs` calls of `f`, in seconds.
+ */
+template <typename F>
+static double best(int runs, F f)
+{
+    auto best = 1e9;
+
+    for (auto i = 0; i < runs; i++)
+    {
+        auto start = std::chrono::steady_clock::now();
+        f();
+        std::chrono::duration<double> elapsed = std::chrono::steady_clock::now() - start;
+        best = std::min(best, elapsed.count());
+    }
+
+    return best;
+}
+
+int main(int argc, char const *argv[])
+{
+    if (argc > 2 && std::strcmp(argv[1], "--script") == 0)
+    {
+        std::cout << generateScript(std::stoi(argv[2]));
+        return 0;
+    }
+
+    const auto runs = 3;
+
+    for (auto literals = 2000; literals <= 32000; literals *= 2)
+    {
+        auto script = generateScript(literals);
+
+        auto time = best(runs, [&]()
+                         {
+            XPVM vm;
+            vm.compile(script); });
+
+        std::cout << literals << " literals: " << time * 1e3 << " ms ("
+                  << time / literals * 1e9 << " ns per literal)\n";
+    }
+
+    return 0;
+}
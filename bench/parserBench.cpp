@@ -0,0 +1,101 @@
+/**
+ * Parser throughput, separately from lexing.
+ *
+ *   g++ -std=c++17 -O2 ./bench/parserBench.cpp -o ./parser-bench
+ *   ./parser-bench [file.xp]
+ *
+ * Times tokenizing the source alone, then parsing it (which tokenizes it
+ * again), and reports the difference as the parser's own time. Without a
+ * file, parses a generated program of independent functions.
+ */
+#include <algorithm>
+#include <chrono>
+#include <fstream>
+#include <iostream>
+#include <sstream>
+#include <string>
+
+#include "../src/parser/XPParser.h"
+
+using namespace syntax;
+
+static std::string generateProgram(int functions)
+{
+    std::stringstream ss;
+
+    ss << "(begin\n";
+
+    for (auto i = 0; i < functions; i++)
+    {
+        ss << "  (def f" << i << " (a b)\n"
+           << "    (begin (var t (+ a b)) (if (> t " << i << ") (* t 2) (- t \"x\"))))\n";
+    }
+
+    ss << ")\n";
+
+    return ss.str();
+}
+
+/**
+ * Best time of `runs` calls of `f`, in seconds.
+ */
+template <typename F>
+static double best(int runs, F f)
+{
+    auto best = 1e9;
+
+    for (auto i = 0; i < runs; i++)
+    {
+        auto start = std::chrono::steady_clock::now();
+        f();
+        std::chrono::duration<double> elapsed = std::chrono::steady_clock::now() - start;
+        best = std::min(best, elapsed.count());
+    }
+
+    return best;
+}
+
+int main(int argc, char const *argv[])
+{
+    std::string source;
+
+    if (argc > 1)
+    {
+        std::ifstream file(argv[1]);
+        std::stringstream ss;
+        ss << file.rdbuf();
+        source = "(begin " + ss.str() + ")";
+    }
+    else
+    {
+        source = generateProgram(50000);
+    }
+
+    const auto runs = 5;
+    size_t tokens = 0;
+
+    Tokenizer tokenizer;
+    auto lexing = best(runs, [&]()
+                       {
+        tokenizer.initString(source);
+        tokens = 0;
+
+        while (tokenizer.getNextToken().type != TokenType::__EOF)
+        {
+            tokens++;
+        } });
+
+    XPParser parser;
+    auto parsing = best(runs, [&]()
+                        { parser.parse(source); });
+
+    auto mb = source.size() / 1e6;
+    auto parserOnly = std::max(parsing - lexing, 1e-9);
+
+    std::cout << "Source   : " << mb << " MB, " << tokens << " tokens\n"
+              << "Lexing   : " << lexing * 1e3 << " ms (" << mb / lexing << " MB/s)\n"
+              << "Parsing  : " << parsing * 1e3 << " ms (" << mb / parsing << " MB/s), lexing included\n"
+              << "Parser   : " << parserOnly * 1e3 << " ms (" << tokens / parserOnly / 1e6 << " M tokens/s)\n";
+
+    return 0;
+}
@@ -0,0 +1,113 @@
+/**
+ * Tokenizer throughput in MB/s: the hand-written scanner against the
+ * regex rules (Tokenizer::regexRules).
+ *
+ *   g++ -std=c++17 -O2 ./bench/tokenizerBench.cpp -o ./tokenizer-bench
+ *   ./tokenizer-bench [file.xp]
+ *
+ * Without a file, tokenizes generated programs of growing size. The regex
+ * rules copy and search the rest of the input for every token, which is
+ * quadratic, so they're only run on the smallest one (and a file should
+ * be small).
+ */
+#include <algorithm>
+#include <chrono>
+#include <fstream>
+#include <iostream>
+#include <sstream>
+#include <string>
+
+#include "../src/parser/XPParser.h"
+
+using namespace syntax;
+
+static std::string generateProgram(int functions)
+{
+    std::stringstream ss;
+
+    for (auto i = 0; i < functions; i++)
+    {
+        ss << "// f" << i << ": a comment, and a string\n"
+           << "(def f" << i << " (a b)\n"
+           << "    (begin (var t (+ a b)) (if (> t " << i << ") (* t 2) (- t \"x\"))))\n";
+    }
+
+    return ss.str();
+}
+
+/**
+ * Best time of `runs` calls of `f`, in seconds.
+ */
+template <typename F>
+static double best(int runs, F f)
+{
+    auto best = 1e9;
+
+    for (auto i = 0; i < runs; i++)
+    {
+        auto start = std::chrono::steady_clock::now();
+        f();
+        std::chrono::duration<double> elapsed = std::chrono::steady_clock::now() - start;
+        best = std::min(best, elapsed.count());
+    }
+
+    return best;
+}
+
+/**
+ * Tokenizes `source`, and prints the throughput.
+ */
+static void measure(const std::string &source, bool regexRules)
+{
+    const auto runs = 3;
+    size_t tokens = 0;
+
+    Tokenizer tokenizer;
+    tokenizer.regexRules = regexRules;
+
+    auto time = best(runs, [&]()
+                     {
+        tokenizer.initString(source);
+        tokens = 0;
+
+        while (tokenizer.getNextToken().type != TokenType::__EOF)
+        {
+            tokens++;
+        } });
+
+    auto mb = source.size() / 1e6;
+
+    std::cout << (regexRules ? "  regex rules: " : "  scanner    : ")
+              << time * 1e3 << " ms, " << mb / time << " MB/s (" << tokens << " tokens)\n";
+}
+
+int main(int argc, char const *argv[])
+{
+    if (argc > 1)
+    {
+        std::ifstream file(argv[1]);
+        std::stringstream ss;
+        ss << file.rdbuf();
+
+        std::cout << argv[1] << ": " << ss.str().size() / 1e6 << " MB\n";
+        measure(ss.str(), false);
+        measure(ss.str(), true);
+
+        return 0;
+    }
+
+    for (auto functions = 10; functions <= 100000; functions *= 10)
+    {
+        auto source = generateProgram(functions);
+
+        std::cout << source.size() / 1e6 << " MB\n";
+        measure(source, false);
+
+        if (functions <= 10)
+        {
+            measure(source, true);
+        }
+    }
+
+    return 0;
+}
@@ -0,0 +1,104 @@
+/**
+ * Value representation: NaN-boxed against the tagged union.
+ *
+ *   g++ -std=c++17 -O2 -pthread ./bench/valueBench.cpp -o ./value-bench
+ *   g++ -std=c++17 -O2 -pthread -DXP_NO_NAN_BOXING ./bench/valueBench.cpp -o ./value-bench-tagged
+ *   ./value-bench && ./value-bench-tagged
+ *
+ * Runs the same programs in both builds: a numeric loop (stack and local
+ * traffic), recursive calls (frames), and a loop allocating strings and
+ * closures (boxing and unboxing pointers, and GC marking).
+ */
+#include <algorithm>
+#include <chrono>
+#include <iostream>
+#include <string>
+
+#include "../src/vm/xp.h"
+
+struct Program
+{
+    const char *name;
+    const char *source;
+};
+
+static const Program programs[] = {
+    {"numeric loop",
+     R"(
+        (def loop (n)
+            (begin
+                (var i 0)
+                (var s 0)
+                (while (< i n)
+                    (begin
+                        (set s (+ s (* i 2)))
+                        (set i (+ i 1))))
+                s))
+        (loop 5000000)
+     )"},
+    {"calls",
+     R"(
+        (def fib (n) (if (< n 2) n (+ (fib (- n 1)) (fib (- n 2)))))
+        (fib 27)
+     )"},
+    {"allocation",
+     R"(
+        (def make (n)
+            (begin
+                (var i 0)
+                (var s "")
+                (var f 0)
+                (while (< i n)
+                    (begin
+                        (set s (+ "ab" "c"))
+                        (set f (lambda (x) (+ x i)))
+                        (set i (+ i 1))))
+                (f 1)))
+        (make 1000000)
+     )"},
+};
+
+/**
+ * Best time of `runs` calls of `f`, in seconds.
+ */
+template <typename F>
+static double best(int runs, F f)
+{
+    auto best = 1e9;
+
+    for (auto i = 0; i < runs; i++)
+    {
+        auto start = std::chrono::steady_clock::now();
+        f();
+        std::chrono::duration<double> elapsed = std::chrono::steady_clock::now() - start;
+        best = std::min(best, elapsed.count());
+    }
+
+    return best;
+}
+
+int main()
+{
+#ifdef XP_NAN_BOXING
+    std::cout << "XPValue: NaN-boxed, ";
+#else
+    std::cout << "XPValue: tagged union, ";
+#endif
+    std::cout << sizeof(XPValue) << " bytes\n";
+
+    const auto runs = 5;
+
+    for (auto &program : programs)
+    {
+        XPVM vm;
+        auto main = vm.compile(program.source);
+        XPValue result;
+
+        auto time = best(runs, [&]()
+                         { result = vm.run(main); });
+
+        std::cout << program.name << ": " << time * 1e3 << " ms (= " << result << ")\n";
+    }
+
+    return 0;
+}
@@ -2,6 +2,9 @@
 #ifndef __Logger_h
 #define __Logger_h
 
+#include <cstdio>
+#include <cstdlib>
+#include <mutex>
 #include <sstream>
 
 class ErrorLogMessage : public std::basic_ostringstream<char>
@@ -9,11 +12,31 @@ class ErrorLogMessage : public std::basic_ostringstream<char>
 public:
     ~ErrorLogMessage()
     {
+        // Compiler threads may fail at once: the first one reports and
+        // exits, the others wait for the exit.
+        static std::mutex dying;
+        dying.lock();
+
         fprintf(stderr, "Fatal error: %s\n", str().c_str());
+
+        // The other threads still use the statics exit() would destroy.
+        if (threadsRunning)
+        {
+            fflush(nullptr);
+            _Exit(EXIT_FAILURE);
+        }
+
         exit(EXIT_FAILURE);
     }
+
+    /**
+     * Set while compiler threads run (see XPCompiler::compileDeferred).
+     */
+    static bool threadsRunning;
 };
 
+bool ErrorLogMessage::threadsRunning{false};
+
 #define DIE ErrorLogMessage()
 
 #define log(value) std::cout << #value << " = " << (value) << "\n";
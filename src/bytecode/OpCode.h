@@ -1,6 +1,8 @@
 #ifndef __OpCode_h
 #define __OpCode_h
 
+#include <cstdint>
+#include <cstddef>
 #include "../Logger.h"
 
 #define OP_HALT 0x00
@@ -39,38 +41,393 @@
 
 #define OP_MAKE_FUNCTION 0x20
 
+// Superinstructions, fusing the most frequent sequences
+// (see XP_PROFILE_OPCODES):
+
+// GET_LOCAL a; GET_LOCAL b; ADD
+#define OP_ADD_LOCAL_LOCAL 0x21
+
+// GET_LOCAL a; CONST k; ADD
+#define OP_ADD_LOCAL_CONST 0x22
+
+// GET_LOCAL x; CONST k; COMPARE op; JMP_IF_FALSE addr
+#define OP_COMPARE_LOCAL_CONST_JMP_IF_FALSE 0x23
+
+// SET_CELL i; POP
+#define OP_SET_CELL_POP 0x24
+
+// Call reusing the current frame
+#define OP_TAIL_CALL 0x25
+
+// Prefix: the operands of the next instruction are 32-bit. Emitted only
+// when an index or jump address doesn't fit the normal encoding.
+#define OP_WIDE 0x26
+
+// Quickened forms, never emitted by the compiler: the VM rewrites ADD and
+// COMPARE in place into these once it has seen their operand types. Each
+// keeps the length of the generic instruction, checks its operands, and
+// falls back to the generic path if they don't match.
+
+#define OP_ADD_NUM 0x27
+#define OP_ADD_STR 0x28
+
+// COMPARE op with number operands; in operand order (see compareValues),
+// so OP_LT_NUM + op is the quickened form of COMPARE op. The operand is
+// kept for the fallback.
+#define OP_LT_NUM 0x29
+#define OP_GT_NUM 0x2A
+#define OP_EQ_NUM 0x2B
+#define OP_GE_NUM 0x2C
+#define OP_LE_NUM 0x2D
+#define OP_NE_NUM 0x2E
+
+// Unchecked forms, emitted by the compiler where type inference proves
+// both operands are numbers (see TypeInference). OP_NUM_LT + op is
+// COMPARE op.
+#define OP_NUM_ADD 0x2F
+
+#define OP_NUM_LT 0x30
+#define OP_NUM_GT 0x31
+#define OP_NUM_EQ 0x32
+#define OP_NUM_GE 0x33
+#define OP_NUM_LE 0x34
+#define OP_NUM_NE 0x35
+
+// Compare the two topmost values and jump if the comparison is false,
+// without pushing the result: the `if`/`while` form of COMPARE op;
+// JMP_IF_FALSE. OP_JMP_IF_NOT_LT + op is COMPARE op.
+#define OP_JMP_IF_NOT_LT 0x36
+#define OP_JMP_IF_NOT_GT 0x37
+#define OP_JMP_IF_NOT_EQ 0x38
+#define OP_JMP_IF_NOT_GE 0x39
+#define OP_JMP_IF_NOT_LE 0x3A
+#define OP_JMP_IF_NOT_NE 0x3B
+
+// Loop back-edge: jumps back by its operand, counted from the end of the
+// instruction.
+#define OP_LOOP 0x3C
+
+// Local slot of the caller's frame. Only emitted in functions which never
+// escape their parent, so the caller is the frame declaring the local (see
+// EscapeAnalysis).
+#define OP_GET_PARENT_LOCAL 0x3D
+#define OP_SET_PARENT_LOCAL 0x3E
+
+/**
+ * All opcodes, in encoding order. Used to build the opcode name table and
+ * the VM's threaded dispatch table.
+ */
+#define OPCODE_LIST(V)                  \
+    V(HALT)                             \
+    V(CONST)                            \
+    V(ADD)                              \
+    V(SUB)                              \
+    V(MUL)                              \
+    V(DIV)                              \
+    V(COMPARE)                          \
+    V(JMP_IF_FALSE)                     \
+    V(JMP)                              \
+    V(GET_GLOBAL)                       \
+    V(SET_GLOBAL)                       \
+    V(POP)                              \
+    V(GET_LOCAL)                        \
+    V(SET_LOCAL)                        \
+    V(SCOPE_EXIT)                       \
+    V(CALL)                             \
+    V(RETURN)                           \
+    V(GET_CELL)                         \
+    V(SET_CELL)                         \
+    V(LOAD_CELL)                        \
+    V(MAKE_FUNCTION)                    \
+    V(ADD_LOCAL_LOCAL)                  \
+    V(ADD_LOCAL_CONST)                  \
+    V(COMPARE_LOCAL_CONST_JMP_IF_FALSE) \
+    V(SET_CELL_POP)                     \
+    V(TAIL_CALL)                        \
+    V(WIDE)                             \
+    V(ADD_NUM)                          \
+    V(ADD_STR)                          \
+    V(LT_NUM)                           \
+    V(GT_NUM)                           \
+    V(EQ_NUM)                           \
+    V(GE_NUM)                           \
+    V(LE_NUM)                           \
+    V(NE_NUM)                           \
+    V(NUM_ADD)                          \
+    V(NUM_LT)                           \
+    V(NUM_GT)                           \
+    V(NUM_EQ)                           \
+    V(NUM_GE)                           \
+    V(NUM_LE)                           \
+    V(NUM_NE)                           \
+    V(JMP_IF_NOT_LT)                    \
+    V(JMP_IF_NOT_GT)                    \
+    V(JMP_IF_NOT_EQ)                    \
+    V(JMP_IF_NOT_GE)                    \
+    V(JMP_IF_NOT_LE)                    \
+    V(JMP_IF_NOT_NE)                    \
+    V(LOOP)                             \
+    V(GET_PARENT_LOCAL)                 \
+    V(SET_PARENT_LOCAL)
+
 #define OP_STR(opcode) \
     case OP_##opcode:  \
-        return #opcode
+        return #opcode;
 
 std::string opcodeToString(uint8_t opcode)
 {
     switch (opcode)
     {
-        OP_STR(HALT);
-        OP_STR(CONST);
-        OP_STR(ADD);
-        OP_STR(SUB);
-        OP_STR(MUL);
-        OP_STR(COMPARE);
-        OP_STR(JMP_IF_FALSE);
-        OP_STR(JMP);
-        OP_STR(GET_GLOBAL);
-        OP_STR(SET_GLOBAL);
-        OP_STR(POP);
-        OP_STR(GET_LOCAL);
-        OP_STR(SET_LOCAL);
-        OP_STR(SCOPE_EXIT);
-        OP_STR(CALL);
-        OP_STR(RETURN);
-        OP_STR(GET_CELL);
-        OP_STR(SET_CELL);
-        OP_STR(LOAD_CELL);
-        OP_STR(MAKE_FUNCTION);
+        OPCODE_LIST(OP_STR)
     default:
         DIE << "opcodeToString: unknown opcode" << std::hex << (int)opcode;
     }
 
     return "Unknown";
 }
+
+/**
+ * Operand of OP_COMPARE: 0 `<`, 1 `>`, 2 `==`, 3 `>=`, 4 `<=`, 5 `!=`.
+ */
+template <typename T>
+inline bool compareValues(uint8_t op, const T &op1, const T &op2)
+{
+    switch (op)
+    {
+    case 0:
+        return op1 < op2;
+    case 1:
+        return op1 > op2;
+    case 2:
+        return op1 == op2;
+    case 3:
+        return op1 >= op2;
+    case 4:
+        return op1 <= op2;
+    case 5:
+        return op1 != op2;
+    }
+    DIE << "Unknown compare op: " << (int)op;
+    return false;
+}
+
+/**
+ * Number of operands of an instruction. Operands are one byte, except
+ * jump addresses (the last operand of a jump), which are two. After an
+ * OP_WIDE prefix every operand is four bytes.
+ */
+size_t operandCount(uint8_t opcode)
+{
+    switch (opcode)
+    {
+    case OP_HALT:
+    case OP_ADD:
+    case OP_SUB:
+    case OP_MUL:
+    case OP_DIV:
+    case OP_POP:
+    case OP_RETURN:
+    case OP_ADD_NUM:
+    case OP_ADD_STR:
+    case OP_NUM_ADD:
+    case OP_NUM_LT:
+    case OP_NUM_GT:
+    case OP_NUM_EQ:
+    case OP_NUM_GE:
+    case OP_NUM_LE:
+    case OP_NUM_NE:
+        return 0;
+    case OP_CONST:
+    case OP_COMPARE:
+    case OP_LT_NUM:
+    case OP_GT_NUM:
+    case OP_EQ_NUM:
+    case OP_GE_NUM:
+    case OP_LE_NUM:
+    case OP_NE_NUM:
+    case OP_JMP_IF_FALSE:
+    case OP_JMP:
+    case OP_JMP_IF_NOT_LT:
+    case OP_JMP_IF_NOT_GT:
+    case OP_JMP_IF_NOT_EQ:
+    case OP_JMP_IF_NOT_GE:
+    case OP_JMP_IF_NOT_LE:
+    case OP_JMP_IF_NOT_NE:
+    case OP_LOOP:
+    case OP_GET_GLOBAL:
+    case OP_SET_GLOBAL:
+    case OP_GET_LOCAL:
+    case OP_SET_LOCAL:
+    case OP_GET_PARENT_LOCAL:
+    case OP_SET_PARENT_LOCAL:
+    case OP_SCOPE_EXIT:
+    case OP_CALL:
+    case OP_TAIL_CALL:
+    case OP_GET_CELL:
+    case OP_SET_CELL:
+    case OP_SET_CELL_POP:
+    case OP_LOAD_CELL:
+    case OP_MAKE_FUNCTION:
+        return 1;
+    case OP_ADD_LOCAL_LOCAL:
+    case OP_ADD_LOCAL_CONST:
+        return 2;
+    case OP_COMPARE_LOCAL_CONST_JMP_IF_FALSE:
+        return 4;
+    default:
+        DIE << "operandCount: unknown opcode " << std::hex << (int)opcode;
+    }
+
+    return 0;
+}
+
+bool isCompareJump(uint8_t opcode)
+{
+    return opcode >= OP_JMP_IF_NOT_LT && opcode <= OP_JMP_IF_NOT_NE;
+}
+
+/**
+ * Jump instructions carry their target in the last operand: an absolute
+ * address, or for OP_LOOP the distance back from the next instruction.
+ */
+bool isJump(uint8_t opcode)
+{
+    return opcode == OP_JMP || opcode == OP_JMP_IF_FALSE ||
+           opcode == OP_COMPARE_LOCAL_CONST_JMP_IF_FALSE ||
+           isCompareJump(opcode) || opcode == OP_LOOP;
+}
+
+/**
+ * Instructions after which control never reaches the next one.
+ */
+bool isTerminator(uint8_t opcode)
+{
+    return opcode == OP_JMP || opcode == OP_LOOP ||
+           opcode == OP_RETURN || opcode == OP_HALT;
+}
+
+bool isWide(const uint8_t *ip)
+{
+    return ip[0] == OP_WIDE;
+}
+
+/**
+ * Opcode of the instruction at `ip`, past a WIDE prefix.
+ */
+uint8_t decodeOpcode(const uint8_t *ip)
+{
+    return isWide(ip) ? ip[1] : ip[0];
+}
+
+/**
+ * Size in bytes of the instruction at `ip`, including its operands.
+ */
+size_t instructionLength(const uint8_t *ip)
+{
+    auto opcode = decodeOpcode(ip);
+    auto count = operandCount(opcode);
+
+    if (isWide(ip))
+    {
+        return 2 + 4 * count;
+    }
+
+    return 1 + count + (isJump(opcode) ? 1 : 0);
+}
+
+/**
+ * Operand `index` of the instruction at `ip`.
+ */
+size_t readOperand(const uint8_t *ip, size_t index)
+{
+    if (isWide(ip))
+    {
+        auto operand = ip + 2 + 4 * index;
+        return ((size_t)operand[0] << 24) | (operand[1] << 16) | (operand[2] << 8) | operand[3];
+    }
+
+    auto operand = ip + 1 + index;
+
+    if (isJump(ip[0]) && index == operandCount(ip[0]) - 1)
+    {
+        return (operand[0] << 8) | operand[1];
+    }
+
+    return operand[0];
+}
+
+/**
+ * Absolute target of the jump at `offset` in `code`.
+ */
+size_t jumpTarget(const uint8_t *code, size_t offset)
+{
+    auto ip = code + offset;
+    auto opcode = decodeOpcode(ip);
+    auto address = readOperand(ip, operandCount(opcode) - 1);
+
+    if (opcode == OP_LOOP)
+    {
+        return offset + instructionLength(ip) - address;
+    }
+
+    return address;
+}
+
+/**
+ * Net change of the stack height after executing the instruction at `ip`.
+ */
+int stackEffect(const uint8_t *ip)
+{
+    switch (decodeOpcode(ip))
+    {
+    case OP_CONST:
+    case OP_GET_GLOBAL:
+    case OP_GET_LOCAL:
+    case OP_GET_PARENT_LOCAL:
+    case OP_GET_CELL:
+    case OP_LOAD_CELL:
+    case OP_ADD_LOCAL_LOCAL:
+    case OP_ADD_LOCAL_CONST:
+        return 1;
+    case OP_ADD:
+    case OP_SUB:
+    case OP_MUL:
+    case OP_DIV:
+    case OP_COMPARE:
+    case OP_ADD_NUM:
+    case OP_ADD_STR:
+    case OP_LT_NUM:
+    case OP_GT_NUM:
+    case OP_EQ_NUM:
+    case OP_GE_NUM:
+    case OP_LE_NUM:
+    case OP_NE_NUM:
+    case OP_NUM_ADD:
+    case OP_NUM_LT:
+    case OP_NUM_GT:
+    case OP_NUM_EQ:
+    case OP_NUM_GE:
+    case OP_NUM_LE:
+    case OP_NUM_NE:
+    case OP_JMP_IF_FALSE:
+    case OP_POP:
+    case OP_SET_CELL_POP:
+    case OP_HALT:
+        return -1;
+    case OP_JMP_IF_NOT_LT:
+    case OP_JMP_IF_NOT_GT:
+    case OP_JMP_IF_NOT_EQ:
+    case OP_JMP_IF_NOT_GE:
+    case OP_JMP_IF_NOT_LE:
+    case OP_JMP_IF_NOT_NE:
+        return -2;
+    case OP_SCOPE_EXIT:
+    case OP_CALL:
+    case OP_TAIL_CALL:
+    case OP_MAKE_FUNCTION:
+        return -(int)readOperand(ip, 0);
+    default:
+        return 0;
+    }
+}
 #endif
\ No newline at end of file
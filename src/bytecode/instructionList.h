@@ -0,0 +1,228 @@
+#ifndef __instructionList_h
+#define __instructionList_h
+
+#include <cstdint>
+#include <map>
+#include <vector>
+#include "OpCode.h"
+
+/**
+ * Decoded instruction. Jump addresses are stored as the index of the
+ * target instruction, so instructions can be removed or resized without
+ * patching offsets by hand.
+ */
+struct Instruction
+{
+    uint8_t opcode;
+
+    std::vector<size_t> operands{};
+
+    bool removed = false;
+};
+
+/**
+ * Index of the first instruction at or after `index` which isn't removed.
+ */
+size_t liveInstruction(const std::vector<Instruction> &instructions, size_t index)
+{
+    while (index < instructions.size() && instructions[index].removed)
+    {
+        index++;
+    }
+
+    if (index == instructions.size())
+    {
+        DIE << "liveInstruction: jump past the end of the code.";
+    }
+
+    return index;
+}
+
+/**
+ * Decodes a code buffer. `farAddresses` holds the full value of jump
+ * operands which didn't fit 16 bits, by operand offset.
+ */
+std::vector<Instruction> decodeInstructions(const std::vector<uint8_t> &code,
+                                            const std::map<size_t, size_t> &farAddresses = {})
+{
+    std::vector<Instruction> instructions;
+    std::vector<size_t> indices(code.size() + 1, SIZE_MAX);
+
+    for (size_t offset = 0; offset < code.size(); offset += instructionLength(&code[offset]))
+    {
+        auto ip = &code[offset];
+
+        Instruction instruction{decodeOpcode(ip)};
+
+        for (size_t i = 0; i < operandCount(instruction.opcode); i++)
+        {
+            instruction.operands.push_back(readOperand(ip, i));
+        }
+
+        if (isJump(instruction.opcode))
+        {
+            auto &address = instruction.operands.back();
+            auto addressOffset = offset + instructionLength(ip) - 2;
+
+            if (!isWide(ip) && farAddresses.count(addressOffset) != 0)
+            {
+                address = farAddresses.at(addressOffset);
+            }
+
+            if (instruction.opcode == OP_LOOP)
+            {
+                address = offset + instructionLength(ip) - address;
+            }
+        }
+
+        indices[offset] = instructions.size();
+        instructions.push_back(instruction);
+    }
+
+    for (auto &instruction : instructions)
+    {
+        if (isJump(instruction.opcode))
+        {
+            auto &address = instruction.operands.back();
+
+            if (address >= code.size() || indices[address] == SIZE_MAX)
+            {
+                DIE << "decodeInstructions: jump to " << address << " is not an instruction.";
+            }
+
+            address = indices[address];
+        }
+    }
+
+    return instructions;
+}
+
+/**
+ * Encodes the instructions which aren't removed. Operands use the
+ * 1-byte form (16-bit for jump addresses) when they fit, and the WIDE
+ * form otherwise; once the code grows past 64 KiB every jump is wide.
+ */
+std::vector<uint8_t> encodeInstructions(const std::vector<Instruction> &instructions)
+{
+    auto isWideInstruction = [](const Instruction &instruction, bool wideJumps)
+    {
+        auto jump = isJump(instruction.opcode);
+
+        if (jump && wideJumps)
+        {
+            return true;
+        }
+
+        for (size_t i = 0; i < instruction.operands.size(); i++)
+        {
+            auto address = jump && i == instruction.operands.size() - 1;
+
+            if (!address && instruction.operands[i] > 0xFF)
+            {
+                return true;
+            }
+        }
+
+        return false;
+    };
+
+    auto length = [&](const Instruction &instruction, bool wideJumps) -> size_t
+    {
+        auto count = instruction.operands.size();
+
+        if (isWideInstruction(instruction, wideJumps))
+        {
+            return 2 + 4 * count;
+        }
+
+        return 1 + count + (isJump(instruction.opcode) ? 1 : 0);
+    };
+
+    std::vector<size_t> offsets(instructions.size());
+
+    auto layout = [&](bool wideJumps)
+    {
+        size_t size = 0;
+
+        for (size_t i = 0; i < instructions.size(); i++)
+        {
+            offsets[i] = size;
+
+            if (!instructions[i].removed)
+            {
+                size += length(instructions[i], wideJumps);
+            }
+        }
+
+        return size;
+    };
+
+    auto wideJumps = false;
+    auto size = layout(wideJumps);
+
+    if (size > 0xFFFF)
+    {
+        wideJumps = true;
+        size = layout(wideJumps);
+    }
+
+    std::vector<uint8_t> code;
+    code.reserve(size);
+
+    for (size_t index = 0; index < instructions.size(); index++)
+    {
+        const auto &instruction = instructions[index];
+
+        if (instruction.removed)
+        {
+            continue;
+        }
+
+        auto wide = isWideInstruction(instruction, wideJumps);
+        auto jump = isJump(instruction.opcode);
+
+        if (wide)
+        {
+            code.push_back(OP_WIDE);
+        }
+
+        code.push_back(instruction.opcode);
+
+        for (size_t i = 0; i < instruction.operands.size(); i++)
+        {
+            auto operand = instruction.operands[i];
+            auto address = jump && i == instruction.operands.size() - 1;
+
+            if (address)
+            {
+                operand = offsets[liveInstruction(instructions, operand)];
+
+                if (instruction.opcode == OP_LOOP)
+                {
+                    operand = offsets[index] + length(instruction, wideJumps) - operand;
+                }
+            }
+
+            if (wide)
+            {
+                code.push_back((operand >> 24) & 0xff);
+                code.push_back((operand >> 16) & 0xff);
+                code.push_back((operand >> 8) & 0xff);
+                code.push_back(operand & 0xff);
+            }
+            else if (address)
+            {
+                code.push_back((operand >> 8) & 0xff);
+                code.push_back(operand & 0xff);
+            }
+            else
+            {
+                code.push_back(operand);
+            }
+        }
+    }
+
+    return code;
+}
+
+#endif
@@ -1,146 +1,324 @@
 #ifndef __XP_Compiler_h
 #define __XP_Compiler_h
 
+#include <algorithm>
+#include <atomic>
 #include <string>
 #include <map>
+#include <thread>
+#include <unordered_map>
+#include <unordered_set>
+#include <cstring>
 #include "../vm/XPValue.h"
 #include "../bytecode/OpCode.h"
 #include "../vm/globalVar.h"
 #include "../disassembler/disassembler.h"
 #include "../scope/scope.h"
+#include "../bytecode/instructionList.h"
+#include "peephole.h"
+#include "typeInference.h"
+#include "escapeAnalysis.h"
+#include "inliner.h"
 
-#define ALLOC_CONST(tester, convertor, allocator, value) \
-    do                                                   \
-    {                                                    \
-        for (auto i = 0; i < co->constants.size(); i++)  \
-        {                                                \
-            if (!tester(co->constants[i]))               \
-            {                                            \
-                continue;                                \
-            }                                            \
-            if (convertor(co->constants[i]) == value)    \
-            {                                            \
-                return i;                                \
-            }                                            \
-        }                                                \
-        co->addConstant(allocator(value));               \
-    } while (false)
+/**
+ * Fewest function bodies worth starting a compiler thread for.
+ */
+#define MIN_FUNCTIONS_PER_THREAD 32
 
 #define GEN_BINARY_OP(op) \
     do                    \
     {                     \
         gen(exp.list[1]); \
+        height_++;        \
         gen(exp.list[2]); \
+        height_--;        \
         emit(op);         \
     } while (false)
 
-#define FUNCTION_CALL(exp)                         \
-    do                                             \
-    {                                              \
-        gen(exp.list[0]);                          \
-        for (auto i = 1; i < exp.list.size(); i++) \
-        {                                          \
-            gen(exp.list[i]);                      \
-        }                                          \
-        emit(OP_CALL);                             \
-        emit(exp.list.size() - 1);                 \
+#define FUNCTION_CALL(exp)                           \
+    do                                               \
+    {                                                \
+        gen(exp.list[0]);                            \
+        for (size_t i = 1; i < exp.list.size(); i++) \
+        {                                            \
+            height_++;                               \
+            gen(exp.list[i]);                        \
+        }                                            \
+        height_ -= exp.list.size() - 1;              \
+        emitIndexed(isTailCall(exp)                  \
+                        ? OP_TAIL_CALL               \
+                        : OP_CALL,                   \
+                    exp.list.size() - 1);            \
     } while (false)
 
+enum class ConstantType
+{
+    NUMBER,
+    BOOLEAN,
+    STRING
+};
+
+/**
+ * Compile-time value of a constant expression (see evalConstant).
+ */
+struct Constant
+{
+    ConstantType type;
+    double number = 0;
+    bool boolean = false;
+    std::string string{};
+};
+
 class XPCompiler
 {
 public:
     XPCompiler(std::shared_ptr<Global> global) : global(global),
                                                  disassembler(std::make_unique<Disassembler>(global)) {}
 
-    void compile(const Exp &exp)
+    /**
+     * Run the peephole optimizer over every code object. On by default;
+     * builds with XP_NO_PEEPHOLE defined turn it off.
+     */
+#ifdef XP_NO_PEEPHOLE
+    bool optimize = false;
+#else
+    bool optimize = true;
+#endif
+
+    /**
+     * Emit unchecked NUM_* instructions for operations type inference
+     * proves numeric. Builds with XP_NO_TYPE_INFERENCE defined turn it
+     * off.
+     */
+#ifdef XP_NO_TYPE_INFERENCE
+    bool inferTypes = false;
+#else
+    bool inferTypes = true;
+#endif
+
+    /**
+     * Let functions which never escape their parent read its locals from
+     * its frame, instead of promoting them to cells. Builds with
+     * XP_NO_ESCAPE_ANALYSIS defined turn it off.
+     */
+#ifdef XP_NO_ESCAPE_ANALYSIS
+    bool analyzeEscapes = false;
+#else
+    bool analyzeEscapes = true;
+#endif
+
+    /**
+     * Inline calls of small functions (see Inliner), with bodies of at
+     * most `inlineBudget` expressions. Builds with XP_NO_INLINING defined
+     * turn it off.
+     */
+#ifdef XP_NO_INLINING
+    bool inlineCalls = false;
+#else
+    bool inlineCalls = true;
+#endif
+
+    size_t inlineBudget = 24;
+
+    /**
+     * Threads compiling the bodies of top-level functions (see
+     * compileDeferred), the calling one included. Builds with
+     * XP_NO_PARALLEL_COMPILE defined compile everything on the calling
+     * thread.
+     */
+#ifdef XP_NO_PARALLEL_COMPILE
+    size_t compileThreads = 1;
+#else
+    size_t compileThreads = std::max(std::thread::hardware_concurrency(), 1u);
+#endif
+
+    /**
+     * Compiles a whole program into a new main function.
+     */
+    void compile(const Exp &program)
+    {
+        compileMain(program, true);
+    }
+
+    /**
+     * Compiles top-level forms into a new main function, against the
+     * globals defined by the earlier compilations. Only the new forms are
+     * analyzed and compiled. Forms compiled later may redefine the
+     * globals, so calls of global functions aren't inlined.
+     */
+    void compileIncremental(const Exp &forms)
+    {
+        compileMain(forms, false);
+    }
+
+    void compileMain(const Exp &program, bool inlineGlobals)
     {
+        firstCodeObject_ = codeObjects_.size();
+
         co = AS_CODE(createCodeObjectValue("main"));
         main = AS_FUNCTION(ALLOC_FUNCTION(co));
         constantObjects_.insert((Traceable *)main);
 
-        analyze(exp, nullptr);
+        arena_.clear();
+
+        Inliner inliner(arena_, inlineBudget, inlineGlobals);
+
+        if (inlineCalls)
+        {
+            program_ = inliner.inlineCalls(program);
+        }
+
+        const auto &exp = inlineCalls ? program_ : program;
+
+        escapes_ = EscapeAnalysis();
+
+        if (analyzeEscapes)
+        {
+            escapes_.analyze(exp);
+        }
+
+        analyzeScopes(exp);
+
+        tailCalls_.clear();
+        numeric_.clear();
+
+        deferBodies_ = compileThreads > 1;
+
+        if (inferTypes)
+        {
+            numeric_ = TypeInference(global, scopeInfo_, !deferBodies_).numericExpressions(exp);
+        }
+
+        height_ = 0;
 
         gen(exp);
         emit(OP_HALT);
+
+        finishCode();
+
+        co->maxStack = computeMaxStack(co, 0);
+
+        compileDeferred();
+
+        inlinedGlobals_.insert(inliner.inlinedGlobals.begin(), inliner.inlinedGlobals.end());
     }
 
-    void analyze(const Exp &exp, std::shared_ptr<Scope> scope)
+    /**
+     * Runs the scope analysis until the parent locals read by functions
+     * which don't escape are all on the stack: a function reading one
+     * which another closure turns into a cell is treated as escaping, and
+     * the analysis starts over.
+     */
+    void analyzeScopes(const Exp &exp)
     {
+        auto changed = true;
 
-        if (exp.type == ExpType::SYMBOL)
+        while (changed)
         {
+            changed = false;
 
-            if (exp.string == "true" || exp.string == "false")
+            scopeInfo_.clear();
+            analyze(exp, nullptr);
+
+            for (const auto &[fnExp, scope] : scopeInfo_)
             {
+                if (scope->type != ScopeType::FUNCTION || scope->escapes)
+                {
+                    continue;
+                }
+
+                for (auto symbol : scope->borrowed)
+                {
+                    if (scope->parent->declaredAllocType(symbol) != AllocType::LOCAL)
+                    {
+                        escapes_.functions.erase(fnExp);
+                        changed = true;
+                        break;
+                    }
+                }
             }
-            else
+        }
+    }
+
+    void analyze(const Exp &exp, std::shared_ptr<Scope> scope)
+    {
+
+        if (exp.type == ExpType::SYMBOL)
+        {
+
+            if (!isBooleanSymbol(exp.symbol))
             {
-                scope->maybePromote(exp.string);
+                scope->maybePromote(exp.symbol);
             }
         }
         else if (exp.type == ExpType::LIST)
         {
-            auto tag = exp.list[0];
+            const auto &tag = exp.list[0];
 
             if (tag.type == ExpType::SYMBOL)
             {
-                auto op = tag.string;
-
-                if (op == "begin")
+                switch (tag.symbol)
+                {
+                case SYM_BEGIN:
                 {
                     auto newScope = std::make_shared<Scope>(
                         scope == nullptr ? ScopeType::GLOBAL : ScopeType::BLOCK, scope);
 
                     scopeInfo_[&exp] = newScope;
 
-                    for (auto i = 1; i < exp.list.size(); i++)
+                    for (size_t i = 1; i < exp.list.size(); i++)
                     {
                         analyze(exp.list[i], newScope);
                     }
+                    break;
                 }
 
-                else if (op == "var")
-                {
-                    scope->addLocal(exp.list[1].string);
+                case SYM_VAR:
+                    scope->addLocal(exp.list[1].symbol);
                     analyze(exp.list[2], scope);
-                }
-                else if (op == "def")
-                {
-                    auto fnName = exp.list[1].string;
+                    break;
 
-                    scope->addLocal(fnName);
+                case SYM_DEF:
+                {
+                    scope->addLocal(exp.list[1].symbol);
 
                     auto newScope = std::make_shared<Scope>(ScopeType::FUNCTION, scope);
+                    newScope->escapes = escapes_.functions.count(&exp) == 0;
 
                     scopeInfo_[&exp] = newScope;
 
                     auto arity = exp.list[2].list.size();
 
-                    for (auto i = 0; i < arity; i++)
+                    for (size_t i = 0; i < arity; i++)
                     {
-                        newScope->addLocal(exp.list[2].list[i].string);
+                        newScope->addLocal(exp.list[2].list[i].symbol);
                     }
 
                     analyze(exp.list[3], newScope);
+                    break;
                 }
-                else if (op == "lambda")
+
+                case SYM_LAMBDA:
                 {
                     auto newScope = std::make_shared<Scope>(ScopeType::FUNCTION, scope);
+                    newScope->escapes = escapes_.functions.count(&exp) == 0;
 
                     scopeInfo_[&exp] = newScope;
 
                     auto arity = exp.list[1].list.size();
 
-                    for (auto i = 0; i < arity; i++)
+                    for (size_t i = 0; i < arity; i++)
                     {
-                        newScope->addLocal(exp.list[1].list[i].string);
+                        newScope->addLocal(exp.list[1].list[i].symbol);
                     }
 
                     analyze(exp.list[2], newScope);
+                    break;
                 }
-                else
-                {
-                    for (auto i = 1; i < exp.list.size(); i++)
+
+                default:
+                    // The callee of a call is a name too.
+                    for (size_t i = isSpecialForm(tag.symbol) ? 1 : 0; i < exp.list.size(); i++)
                     {
                         analyze(exp.list[i], scope);
                     }
@@ -148,7 +326,7 @@ public:
             }
             else
             {
-                for (auto i = 0; i < exp.list.size(); i++)
+                for (size_t i = 0; i < exp.list.size(); i++)
                 {
                     analyze(exp.list[i], scope);
                 }
@@ -161,96 +339,137 @@ public:
         switch (exp.type)
         {
         case ExpType::NUMBER:
-            emit(OP_CONST);
-            emit(numericConstIdx(exp.number));
+            emitIndexed(OP_CONST, numericConstIdx(exp.number));
             break;
         case ExpType::STRING:
-            emit(OP_CONST);
-            emit(stringConstIdx(exp.string));
+            emitIndexed(OP_CONST, stringConstIdx(exp.string()));
             break;
 
         case ExpType::SYMBOL:
-            if (exp.string == "true" || exp.string == "false")
+            if (isBooleanSymbol(exp.symbol))
             {
-                emit(OP_CONST);
-                emit(booleanConstIdx(exp.string == "true" ? true : false));
+                emitIndexed(OP_CONST, booleanConstIdx(exp.symbol == SYM_TRUE));
             }
             else
             {
-                auto varName = exp.string;
+                const auto &varName = exp.string();
+                auto symbol = exp.symbol;
 
-                auto opCodeGetter = scopeStack_.top()->getNameGetter(varName);
-                emit(opCodeGetter);
+                auto opCodeGetter = scopeStack_.top()->getNameGetter(symbol);
 
+                if (opCodeGetter == OP_GET_GLOBAL && global->isConstant(symbol))
+                {
+                    emitIndexed(OP_CONST, numericConstIdx(AS_NUMBER(global->get(global->getGlobalIndex(symbol)).value)));
+                    break;
+                }
                 if (opCodeGetter == OP_GET_LOCAL)
                 {
-                    emit(co->getlocalIndex(varName));
+                    emitIndexed(opCodeGetter, co->getlocalIndex(symbol));
                 }
                 else if (opCodeGetter == OP_GET_CELL)
                 {
-                    emit(co->getCellIndex(varName));
+                    emitIndexed(opCodeGetter, co->getCellIndex(symbol));
+                }
+                else if (opCodeGetter == OP_GET_PARENT_LOCAL)
+                {
+                    emitIndexed(opCodeGetter, parentCodeObjects_.top()->getlocalIndex(symbol));
                 }
                 else
                 {
+                    auto globalIndex = this->globalIndex(symbol);
 
-                    if (!global->exists(varName))
+                    if (globalIndex == -1)
                     {
                         DIE << "[Compiler]: Refrence error: " << varName;
                     }
 
-                    emit(global->getGlobalIndex(varName));
+                    emitIndexed(opCodeGetter, globalIndex);
                 }
             }
             break;
         case ExpType::LIST:
         {
-            auto tag = exp.list[0];
+            const auto &tag = exp.list[0];
 
-            if (tag.type == ExpType::SYMBOL)
+            Constant constant;
+
+            if (evalConstant(exp, constant))
             {
-                auto op = tag.string;
+                emitConstant(constant);
+                break;
+            }
 
-                if (op == "+")
+            if (tag.type == ExpType::SYMBOL)
+            {
+                switch (tag.symbol)
                 {
-                    GEN_BINARY_OP(OP_ADD);
-                }
-                else if (op == "-")
+                case SYM_ADD:
                 {
-                    GEN_BINARY_OP(OP_SUB);
+                    if (!genAddLocal(exp))
+                    {
+                        GEN_BINARY_OP(isNumericOperation(exp) ? OP_NUM_ADD : OP_ADD);
+                    }
+                    break;
                 }
-                else if (op == "/")
-                {
+
+                case SYM_SUB:
+                    GEN_BINARY_OP(OP_SUB);
+                    break;
+
+                case SYM_DIV:
                     GEN_BINARY_OP(OP_DIV);
-                }
-                else if (op == "*")
-                {
+                    break;
+
+                case SYM_MUL:
                     GEN_BINARY_OP(OP_MUL);
-                }
-                else if (compareOps.count(op) != 0)
+                    break;
+
+                case SYM_LT:
+                case SYM_GT:
+                case SYM_EQ:
+                case SYM_GE:
+                case SYM_LE:
+                case SYM_NE:
                 {
                     gen(exp.list[1]);
+                    height_++;
                     gen(exp.list[2]);
-                    emit(OP_COMPARE);
-                    emit(compareOps[op]);
+                    height_--;
+
+                    if (isNumericOperation(exp))
+                    {
+                        emit(OP_NUM_LT + compareOp(tag.symbol));
+                    }
+                    else
+                    {
+                        emitIndexed(OP_COMPARE, compareOp(tag.symbol));
+                    }
+                    break;
                 }
-                else if (op == "if")
-                {
-                    gen(exp.list[1]);
 
-                    emit(OP_JMP_IF_FALSE);
+                case SYM_IF:
+                {
+                    bool condition;
 
-                    emit(0);
-                    emit(0);
+                    // Known condition: only the branch taken is compiled.
+                    if (evalCondition(exp.list[1], condition))
+                    {
+                        if (condition)
+                        {
+                            gen(exp.list[2]);
+                        }
+                        else if (exp.list.size() == 4)
+                        {
+                            gen(exp.list[3]);
+                        }
+                        break;
+                    }
 
-                    auto elseJmpAddress = getOffset() - 2;
+                    auto elseJmpAddress = genJmpIfFalse(exp.list[1]);
 
                     gen(exp.list[2]);
-                    emit(OP_JMP);
 
-                    emit(0);
-                    emit(0);
-
-                    auto endAddress = getOffset() - 2;
+                    auto endAddress = emitJump(OP_JMP);
 
                     auto elseBranchAddress = getOffset();
                     patchJmpAddress(elseJmpAddress, elseBranchAddress);
@@ -262,42 +481,61 @@ public:
 
                     auto endBranchAddress = getOffset();
                     patchJmpAddress(endAddress, endBranchAddress);
+                    break;
                 }
 
-                else if (op == "while")
+                case SYM_WHILE:
                 {
-                    auto loopStartAddress = getOffset();
+                    bool condition;
 
-                    gen(exp.list[1]);
+                    if (evalCondition(exp.list[1], condition))
+                    {
+                        if (condition)
+                        {
+                            auto loopStartAddress = getOffset();
 
-                    emit(OP_JMP_IF_FALSE);
+                            gen(exp.list[2]);
+                            emit(OP_POP);
 
-                    emit(0);
-                    emit(0);
+                            emitLoop(loopStartAddress);
+                        }
 
-                    auto loopEndJmpAddress = getOffset() - 2;
+                        emitIndexed(OP_CONST, booleanConstIdx(false));
+                        break;
+                    }
 
-                    gen(exp.list[2]);
-                    emit(OP_JMP);
+                    auto loopStartAddress = getOffset();
 
-                    emit(0);
-                    emit(0);
+                    auto loopEndJmpAddress = genJmpIfFalse(exp.list[1]);
 
-                    auto endAddress = getOffset() - 2;
+                    gen(exp.list[2]);
+                    emit(OP_POP);
 
-                    patchJmpAddress(endAddress, loopStartAddress);
+                    emitLoop(loopStartAddress);
 
-                    auto loopEndAddress = getOffset() + 1;
+                    auto loopEndAddress = getOffset();
                     patchJmpAddress(loopEndJmpAddress, loopEndAddress);
+
+                    // The loop evaluates to its final (false) test.
+                    emitIndexed(OP_CONST, booleanConstIdx(false));
+                    break;
                 }
 
-                else if (op == "var")
+                case SYM_VAR:
                 {
-                    auto varName = exp.list[1].string;
+                    const auto &varName = exp.list[1].string();
+                    auto symbol = exp.list[1].symbol;
 
-                    auto opCodeSetter = scopeStack_.top()->getNameSetter(varName);
+                    auto opCodeSetter = scopeStack_.top()->getNameSetter(symbol);
 
-                    if (isLambda(exp.list[2]))
+                    auto isFunction = isLambda(exp.list[2]);
+
+                    if (isFunction && opCodeSetter == OP_SET_CELL)
+                    {
+                        allocateCell(varName);
+                    }
+
+                    if (isFunction)
                     {
                         compileFunction(
                             exp.list[2],
@@ -312,63 +550,71 @@ public:
 
                     if (opCodeSetter == OP_SET_GLOBAL)
                     {
+                        checkAssignable(symbol);
 
                         global->define(varName);
-                        emit(OP_SET_GLOBAL);
-                        emit(global->getGlobalIndex(varName));
+                        emitIndexed(OP_SET_GLOBAL, global->getGlobalIndex(symbol));
+                        emit(OP_POP);
                     }
                     else if (opCodeSetter == OP_SET_CELL)
                     {
-                        co->cellNames.push_back(varName);
-                        emit(OP_SET_CELL);
-                        emit(co->cellNames.size() - 1);
-                        emit(OP_POP);
+                        if (!isFunction)
+                        {
+                            co->addCell(varName);
+                        }
+
+                        emitIndexed(OP_SET_CELL_POP, co->cellNames.size() - 1);
                     }
                     else
                     {
-                        co->addLocal(varName);
-                        // emit(OP_SET_LOCAL);
-                        // emit(co->getlocalIndex(varName));
+                        co->addLocal(varName, height_++);
                     }
+                    break;
                 }
 
-                else if (op == "set")
+                case SYM_SET:
                 {
-                    auto varName = exp.list[1].string;
+                    const auto &varName = exp.list[1].string();
+                    auto symbol = exp.list[1].symbol;
 
-                    auto opCodeSetter = scopeStack_.top()->getNameSetter(varName);
+                    auto opCodeSetter = scopeStack_.top()->getNameSetter(symbol);
 
                     gen(exp.list[2]);
 
                     if (opCodeSetter == OP_SET_LOCAL)
                     {
-                        emit(OP_SET_LOCAL);
-                        emit(co->getlocalIndex(varName));
+                        emitIndexed(OP_SET_LOCAL, co->getlocalIndex(symbol));
                     }
                     else if (opCodeSetter == OP_SET_CELL)
                     {
-                        emit(OP_SET_CELL);
-                        emit(co->getCellIndex(varName));
+                        emitIndexed(OP_SET_CELL, co->getCellIndex(symbol));
+                    }
+                    else if (opCodeSetter == OP_SET_PARENT_LOCAL)
+                    {
+                        emitIndexed(OP_SET_PARENT_LOCAL, parentCodeObjects_.top()->getlocalIndex(symbol));
                     }
                     else
                     {
-                        auto globalIndex = global->getGlobalIndex(varName);
+                        auto globalIndex = this->globalIndex(symbol);
 
                         if (globalIndex == -1)
                         {
                             DIE << "Refrence error: " << varName << " is not defined!";
                         }
-                        emit(OP_SET_GLOBAL);
-                        emit(globalIndex);
+
+                        checkAssignable(symbol);
+                        emitIndexed(OP_SET_GLOBAL, globalIndex);
                     }
+                    break;
                 }
-                else if (op == "begin")
+
+                case SYM_BEGIN:
                 {
-                    scopeStack_.push(scopeInfo_.at(&exp));
+                    scopeStack_.push(owner_->scopeInfo_.at(&exp));
 
                     blockEnter();
 
-                    for (auto i = 1; i < exp.list.size(); i++)
+                    for (size_t i = 1; i < exp.list.size(); i++)
                     {
                         bool isLast = i == exp.list.size() - 1;
 
@@ -382,14 +628,39 @@ public:
                         {
                             emit(OP_POP);
                         }
+
+                        // A program ending with a declaration evaluates to
+                        // the declared value.
+                        if (isLast && isDecl && isGlobalScope())
+                        {
+                            emitIndexed(OP_GET_GLOBAL, global->getGlobalIndex(exp.list[i].list[1].symbol));
+                        }
                     }
 
                     blockExit();
                     scopeStack_.pop();
+                    break;
                 }
-                else if (op == "def")
+
+                case SYM_DEF:
                 {
-                    auto fnName = exp.list[1].string;
+                    const auto &fnName = exp.list[1].string();
+                    auto symbol = exp.list[1].symbol;
+
+                    // Defined upfront, so the body can call itself.
+                    if (isGlobalScope())
+                    {
+                        checkAssignable(symbol);
+                        global->define(fnName);
+                    }
+
+                    auto isCell = !isGlobalScope() &&
+                                  scopeStack_.top()->getNameSetter(symbol) == OP_SET_CELL;
+
+                    if (isCell)
+                    {
+                        allocateCell(fnName);
+                    }
 
                     compileFunction(
                         exp,
@@ -399,28 +670,29 @@ public:
 
                     if (isGlobalScope())
                     {
-
-                        global->define(fnName);
-                        emit(OP_SET_GLOBAL);
-                        emit(global->getGlobalIndex(fnName));
+                        emitIndexed(OP_SET_GLOBAL, global->getGlobalIndex(symbol));
+                        emit(OP_POP);
+                    }
+                    else if (isCell)
+                    {
+                        emitIndexed(OP_SET_CELL_POP, co->cellNames.size() - 1);
                     }
                     else
                     {
-                        co->addLocal(fnName);
-                        // emit(OP_SET_LOCAL);
-                        // emit(co->getlocalIndex(fnName));
+                        co->addLocal(fnName, height_++);
                     }
+                    break;
                 }
-                else if (op == "lambda")
-                {
+
+                case SYM_LAMBDA:
                     compileFunction(
                         exp,
                         "lambda",
                         exp.list[1],
                         exp.list[2]);
-                }
-                else
-                {
+                    break;
+
+                default:
                     FUNCTION_CALL(exp);
                 }
             }
@@ -439,81 +711,140 @@ public:
     void compileFunction(const Exp &exp, const std::string &fnName,
                          const Exp &params, const Exp &body)
     {
-        auto scopeInfo = scopeInfo_.at(&exp);
-        scopeStack_.push(scopeInfo);
-
-        auto arity = params.list.size();
+        auto scopeInfo = owner_->scopeInfo_.at(&exp);
 
         auto prevCo = co;
 
-        auto coValue = createCodeObjectValue(fnName, arity);
-        co = AS_CODE(coValue);
-
-        co->freeCount = scopeInfo->free.size();
+        auto coValue = createCodeObjectValue(fnName, params.list.size());
+        prevCo->addConstant(coValue);
 
-        co->cellNames.reserve(scopeInfo->free.size() + scopeInfo->cells.size());
+        // Top-level functions don't capture anything, and main doesn't
+        // depend on their code: their bodies are compiled after main.
+        if (deferBodies_ && scopeInfo->parent->type == ScopeType::GLOBAL && scopeInfo->free.size() == 0)
+        {
+            deferred_.push_back({&exp, &params, &body, AS_CODE(coValue), global->globals.size()});
+            emitFunctionConstant(AS_CODE(coValue));
+            return;
+        }
 
-        co->cellNames.insert(co->cellNames.end(), scopeInfo->free.begin(), scopeInfo->free.end());
+        scopeStack_.push(scopeInfo);
+        parentCodeObjects_.push(prevCo);
+        co = AS_CODE(coValue);
 
-        co->cellNames.insert(co->cellNames.end(), scopeInfo->cells.begin(), scopeInfo->cells.end());
+        compileBody(params, body, *scopeInfo);
 
-        prevCo->addConstant(coValue);
-        co->addLocal(fnName);
+        parentCodeObjects_.pop();
+        co = prevCo;
 
-        for (auto i = 0; i < arity; i++)
+        if (scopeInfo->free.size() == 0)
         {
-            auto argName = params.list[i].string;
-            co->addLocal(argName);
-
-            auto cellIndex = co->getCellIndex(argName);
-            if (cellIndex != -1)
+            emitFunctionConstant(AS_CODE(coValue));
+        }
+        else
+        {
+            for (auto freeVar : scopeInfo->free)
             {
-                emit(OP_SET_CELL);
-                emit(cellIndex);
+                emitIndexed(OP_LOAD_CELL, co->getCellIndex(freeVar));
             }
+
+            emitIndexed(OP_CONST, co->constants.size() - 1);
+            emitIndexed(OP_MAKE_FUNCTION, scopeInfo->free.size());
         }
 
-        gen(body);
+        scopeStack_.pop();
+    }
+
+    /**
+     * Maximum stack height of the code object, found by following every
+     * control-flow path from the entry. `entryHeight` is the height on
+     * entry: the callee and its arguments for functions.
+     */
+    size_t computeMaxStack(CodeObject *co, size_t entryHeight)
+    {
+        const auto &code = co->code;
 
-        if (!isBlock(body))
-        {
-            emit(OP_SCOPE_EXIT);
-            emit(arity + 1);
-        }
+        std::vector<int> heights(code.size(), -1);
+        std::vector<size_t> worklist{0};
 
-        emit(OP_RETURN);
+        heights[0] = entryHeight;
+        auto maxHeight = entryHeight;
 
-        if (scopeInfo->free.size() == 0)
+        auto reach = [&](size_t offset, int height)
+        {
+            if (offset < code.size() && heights[offset] == -1)
+            {
+                heights[offset] = height;
+                worklist.push_back(offset);
+            }
+        };
+
+        while (!worklist.empty())
         {
+            auto offset = worklist.back();
+            worklist.pop_back();
 
-            auto fn = ALLOC_FUNCTION(co);
-            constantObjects_.insert((Traceable *)AS_OBJECT(fn));
+            auto opcode = decodeOpcode(&code[offset]);
+            auto height = heights[offset] + stackEffect(&code[offset]);
 
-            co = prevCo;
+            maxHeight = std::max(maxHeight, (size_t)std::max(height, heights[offset]));
 
-            co->addConstant(fn);
+            if (isJump(opcode))
+            {
+                reach(jumpTarget(code.data(), offset), height);
+            }
 
-            emit(OP_CONST);
-            emit(co->constants.size() - 1);
+            if (!isTerminator(opcode))
+            {
+                reach(offset + instructionLength(&code[offset]), height);
+            }
         }
-        else
+
+        return maxHeight;
+    }
+
+    /**
+     * Records the function calls in tail position of a function body;
+     * they are compiled to OP_TAIL_CALL, which reuses the caller's frame.
+     */
+    void markTailCalls(const Exp &exp)
+    {
+        if (exp.type != ExpType::LIST || exp.list.size() == 0)
+        {
+            return;
+        }
+
+        const auto &tag = exp.list[0];
+
+        if (tag.type != ExpType::SYMBOL)
         {
-            co = prevCo;
+            tailCalls_.insert(&exp);
+            return;
+        }
 
-            for (const auto &freeVar : scopeInfo->free)
+        switch (tag.symbol)
+        {
+        case SYM_BEGIN:
+            if (exp.list.size() > 1)
             {
-                emit(OP_LOAD_CELL);
-                emit(prevCo->getCellIndex(freeVar));
+                markTailCalls(exp.list[exp.list.size() - 1]);
             }
+            break;
 
-            emit(OP_CONST);
-            emit(co->constants.size() - 1);
-            emit(OP_MAKE_FUNCTION);
+        case SYM_IF:
+            markTailCalls(exp.list[2]);
 
-            emit(scopeInfo->free.size());
-        }
+            if (exp.list.size() == 4)
+            {
+                markTailCalls(exp.list[3]);
+            }
+            break;
 
-        scopeStack_.pop();
+        default:
+            if (!isSpecialForm(tag.symbol))
+            {
+                tailCalls_.insert(&exp);
+            }
+        }
     }
 
     FunctionObject *getMainFunction()
@@ -521,6 +852,38 @@ public:
         return main;
     }
 
+    /**
+     * Drops the roots of the last compilation once its main function has
+     * run, so the collector can free its code: the functions it defined
+     * stay reachable from the globals and closures holding them. A session
+     * of many top-level forms then keeps the live functions, not the code
+     * of every form.
+     */
+    void releaseMain()
+    {
+        std::unordered_set<CodeObject *> released(codeObjects_.begin() + firstCodeObject_,
+                                                  codeObjects_.end());
+
+        constantObjects_.erase((Traceable *)main);
+
+        for (auto co : released)
+        {
+            constantObjects_.erase((Traceable *)co);
+
+            for (const auto &constant : co->constants)
+            {
+                if (IS_FUNCTION(constant) && released.count(AS_FUNCTION(constant)->co) != 0)
+                {
+                    constantObjects_.erase((Traceable *)AS_OBJECT(constant));
+                }
+            }
+        }
+
+        codeObjects_.resize(firstCodeObject_);
+
+        main = nullptr;
+    }
+
     XPValue createCodeObjectValue(const std::string &name, size_t arity = 0)
     {
         auto coValue = ALLOC_CODE(name, arity);
@@ -530,79 +893,649 @@ public:
         return coValue;
     }
 
+    std::set<Traceable *> &getConstantObjects()
+    {
+        return constantObjects_;
+    }
+
+    /**
+     * Disassembles the code objects of the last compilation.
+     */
     void disassembleByteCode()
     {
-        for (auto &co_ : codeObjects_)
+        for (auto i = firstCodeObject_; i < codeObjects_.size(); i++)
         {
-            disassembler->disassemble(co_);
+            disassembler->disassemble(codeObjects_[i]);
         }
     }
 
 private:
-    size_t getOffset()
-    {
-        return co->code.size();
-    }
-
-    bool isDeclaration(const Exp &exp)
+    /**
+     * Compiler of the function bodies deferred by `owner` (see
+     * compileDeferred).
+     */
+    XPCompiler(const XPCompiler *owner) : optimize(owner->optimize),
+                                          inferTypes(owner->inferTypes),
+                                          analyzeEscapes(owner->analyzeEscapes),
+                                          owner_(owner),
+                                          global(owner->global) {}
+
+    /**
+     * Top-level function whose body is compiled after main.
+     */
+    struct DeferredFunction
     {
-        return isVarDeclaration(exp);
-    }
+        const Exp *exp;
 
-    bool isVarDeclaration(const Exp &exp)
-    {
-        return isTaggedList(exp, "var");
-    }
+        const Exp *params;
 
-    bool isTaggedList(const Exp &exp, const std::string &tag)
-    {
-        return exp.type == ExpType::LIST && exp.list[0].type == ExpType::SYMBOL && exp.list[0].string == tag;
-    }
+        const Exp *body;
 
-    bool isBlock(const Exp &exp)
-    {
-        return isTaggedList(exp, "begin");
-    }
+        CodeObject *co;
 
-    bool isLambda(const Exp &exp)
-    {
-        return isTaggedList(exp, "lambda");
-    }
+        /**
+         * Globals defined when the function was reached: the ones its
+         * body can refer to.
+         */
+        size_t visibleGlobals;
 
-    bool isGlobalScope()
-    {
-        return co->name == "main" && co->scopeLevel == 1;
-    }
+        /**
+         * Code objects of the functions nested in the body.
+         */
+        std::vector<CodeObject *> codeObjects{};
+    };
 
-    bool isFunctionBody()
+    /**
+     * Compiles a function body into `co`, the function's code object, on
+     * top of its scope.
+     */
+    void compileBody(const Exp &params, const Exp &body, const Scope &scopeInfo)
     {
-        return co->name != "main" && co->scopeLevel == 1;
-    }
+        auto arity = params.list.size();
 
-    std::set<Traceable *> &getConstantObjects()
-    {
-        return constantObjects_;
-    }
+        co->freeCount = scopeInfo.free.size();
 
-    void blockEnter()
-    {
-        co->scopeLevel++;
-    }
+        co->cellNames.reserve(scopeInfo.free.size() + scopeInfo.cells.size());
+
+        for (auto symbol : scopeInfo.free)
+        {
+            co->addCell(symbols().name(symbol));
+        }
+
+        for (auto symbol : scopeInfo.cells)
+        {
+            co->addCell(symbols().name(symbol));
+        }
+
+        co->addLocal(co->name, 0);
+
+        for (size_t i = 0; i < arity; i++)
+        {
+            co->addLocal(params.list[i].string(), i + 1);
+        }
+
+        auto prevHeight = height_;
+        height_ = arity + 1;
+
+        // Captured parameters are copied into their cells, in cell order:
+        // cells are allocated by their first SET_CELL.
+        for (auto cellIndex = co->freeCount; cellIndex < co->cellNames.size(); cellIndex++)
+        {
+            auto localIndex = co->getlocalIndex(internSymbol(co->cellNames[cellIndex]));
+
+            if (localIndex != -1)
+            {
+                emitIndexed(OP_GET_LOCAL, localIndex);
+                emitIndexed(OP_SET_CELL_POP, cellIndex);
+            }
+        }
+
+        markTailCalls(body);
+
+        if (isBlock(body))
+        {
+            gen(body);
+        }
+        else
+        {
+            // Blocks nested in the body aren't the function's own block.
+            co->scopeLevel++;
+            gen(body);
+            co->scopeLevel--;
+
+            emitIndexed(OP_SCOPE_EXIT, arity + 1);
+        }
+
+        emit(OP_RETURN);
+
+        height_ = prevHeight;
+
+        finishCode();
+
+        co->maxStack = computeMaxStack(co, arity + 1);
+    }
+
+    /**
+     * Emits a function without free variables as a constant.
+     */
+    void emitFunctionConstant(CodeObject *fnCo)
+    {
+        auto fn = ALLOC_FUNCTION(fnCo);
+        constantObjects_.insert((Traceable *)AS_OBJECT(fn));
+
+        co->addConstant(fn);
+
+        emitIndexed(OP_CONST, co->constants.size() - 1);
+    }
+
+    /**
+     * Compiles the bodies of the top-level functions, split among
+     * compileThreads threads. Each thread has its own compiler, which
+     * only reads the analyses of this one, and its own heap; the global
+     * table isn't changed while they run. The code objects they create
+     * are then registered in program order, so the result doesn't depend
+     * on the threads.
+     */
+    void compileDeferred()
+    {
+        if (deferred_.empty())
+        {
+            return;
+        }
+
+        auto threadCount = std::min(compileThreads, deferred_.size() / MIN_FUNCTIONS_PER_THREAD);
+        threadCount = std::max(threadCount, (size_t)1);
+
+        std::vector<std::unique_ptr<XPCompiler>> compilers;
+        std::vector<std::unique_ptr<XPHeap>> heaps;
+
+        for (size_t i = 0; i < threadCount; i++)
+        {
+            compilers.push_back(std::unique_ptr<XPCompiler>(new XPCompiler(this)));
+        }
+
+        std::atomic<size_t> nextFunction{0};
+
+        auto compileFunctions = [&](XPCompiler &compiler)
+        {
+            size_t i;
+
+            while ((i = nextFunction++) < deferred_.size())
+            {
+                compiler.compileDeferredBody(deferred_[i], co);
+            }
+        };
+
+        std::vector<std::thread> threads;
+
+        ErrorLogMessage::threadsRunning = threadCount > 1;
+
+        for (size_t i = 1; i < threadCount; i++)
+        {
+            heaps.push_back(std::make_unique<XPHeap>());
+            heaps.back()->detached = true;
+
+            threads.emplace_back([&, i, heap = heaps.back().get()]()
+                                 {
+                                     Traceable::heap = heap;
+                                     compileFunctions(*compilers[i]); });
+        }
+
+        compileFunctions(*compilers[0]);
+
+        for (auto &thread : threads)
+        {
+            thread.join();
+        }
+
+        ErrorLogMessage::threadsRunning = false;
+
+        for (auto &heap : heaps)
+        {
+            Traceable::heap->adopt(*heap);
+        }
+
+        for (auto &compiler : compilers)
+        {
+            constantObjects_.insert(compiler->constantObjects_.begin(), compiler->constantObjects_.end());
+        }
+
+        // The functions nested in a body follow it, as if it had been
+        // compiled in place.
+        std::vector<CodeObject *> codeObjects(codeObjects_.begin(), codeObjects_.begin() + firstCodeObject_);
+        auto fn = deferred_.begin();
+
+        for (auto i = firstCodeObject_; i < codeObjects_.size(); i++)
+        {
+            codeObjects.push_back(codeObjects_[i]);
+
+            if (fn != deferred_.end() && fn->co == codeObjects_[i])
+            {
+                codeObjects.insert(codeObjects.end(), fn->codeObjects.begin(), fn->codeObjects.end());
+                fn++;
+            }
+        }
+
+        codeObjects_ = std::move(codeObjects);
+        deferred_.clear();
+    }
+
+    /**
+     * Compiles a body deferred by the owner, whose main is `mainCo`.
+     */
+    void compileDeferredBody(DeferredFunction &fn, CodeObject *mainCo)
+    {
+        auto scopeInfo = owner_->scopeInfo_.at(fn.exp);
+
+        visibleGlobals_ = fn.visibleGlobals;
+
+        if (inferTypes)
+        {
+            numeric_ = TypeInference(global, owner_->scopeInfo_).numericExpressions(*fn.exp, *fn.params, *fn.body);
+        }
+
+        scopeStack_.push(scopeInfo);
+        parentCodeObjects_.push(mainCo);
+        co = fn.co;
+
+        compileBody(*fn.params, *fn.body, *scopeInfo);
+
+        parentCodeObjects_.pop();
+        scopeStack_.pop();
+
+        fn.codeObjects = std::move(codeObjects_);
+        codeObjects_.clear();
+    }
+
+    /**
+     * Slot of a global the code being compiled can refer to, or -1.
+     */
+    int globalIndex(SymbolId symbol)
+    {
+        auto index = global->getGlobalIndex(symbol);
+        return index != -1 && (size_t)index < visibleGlobals_ ? index : -1;
+    }
+
+    size_t getOffset()
+    {
+        return co->code.size();
+    }
+
+    /**
+     * Evaluates arithmetic, comparisons, string concatenation and `if`
+     * over literals and global constants. Returns false if the value is
+     * only known at run time, or if evaluating it would fail there.
+     */
+    bool evalConstant(const Exp &exp, Constant &value)
+    {
+        switch (exp.type)
+        {
+        case ExpType::NUMBER:
+            value = {ConstantType::NUMBER, (double)exp.number};
+            return true;
+
+        case ExpType::STRING:
+            value = {ConstantType::STRING, 0, false, exp.string()};
+            return true;
+
+        case ExpType::SYMBOL:
+        {
+            if (isBooleanSymbol(exp.symbol))
+            {
+                value = {ConstantType::BOOLEAN, 0, exp.symbol == SYM_TRUE};
+                return true;
+            }
+
+            auto symbol = exp.symbol;
+
+            if (scopeStack_.top()->getNameGetter(symbol) == OP_GET_GLOBAL &&
+                global->isConstant(symbol))
+            {
+                auto constant = global->get(global->getGlobalIndex(symbol)).value;
+                value = {ConstantType::NUMBER, AS_NUMBER(constant)};
+                return true;
+            }
+
+            return false;
+        }
+
+        case ExpType::LIST:
+            break;
+        }
+
+        if (exp.list.size() == 0 || exp.list[0].type != ExpType::SYMBOL)
+        {
+            return false;
+        }
+
+        auto op = exp.list[0].symbol;
+
+        if (op == SYM_IF && (exp.list.size() == 3 || exp.list.size() == 4))
+        {
+            bool condition;
+
+            if (!evalCondition(exp.list[1], condition))
+            {
+                return false;
+            }
+
+            if (condition)
+            {
+                return evalConstant(exp.list[2], value);
+            }
+
+            return exp.list.size() == 4 && evalConstant(exp.list[3], value);
+        }
+
+        // The arithmetic and comparison symbols come first.
+        auto isBinary = op <= SYM_NE;
+
+        if (!isBinary || exp.list.size() != 3)
+        {
+            return false;
+        }
+
+        Constant op1, op2;
+
+        if (!evalConstant(exp.list[1], op1) || !evalConstant(exp.list[2], op2) ||
+            op1.type != op2.type)
+        {
+            return false;
+        }
+
+        if (isCompareOp(op))
+        {
+            if (op1.type == ConstantType::NUMBER)
+            {
+                value = {ConstantType::BOOLEAN, 0, compareValues(compareOp(op), op1.number, op2.number)};
+                return true;
+            }
+
+            if (op1.type == ConstantType::STRING)
+            {
+                value = {ConstantType::BOOLEAN, 0, compareValues(compareOp(op), op1.string, op2.string)};
+                return true;
+            }
+
+            return false;
+        }
+
+        if (op == SYM_ADD && op1.type == ConstantType::STRING)
+        {
+            value = {ConstantType::STRING, 0, false, op1.string + op2.string};
+            return true;
+        }
+
+        if (op1.type != ConstantType::NUMBER)
+        {
+            return false;
+        }
+
+        auto result = op == SYM_ADD   ? op1.number + op2.number
+                      : op == SYM_SUB ? op1.number - op2.number
+                      : op == SYM_MUL ? op1.number * op2.number
+                                      : op1.number / op2.number;
+
+        value = {ConstantType::NUMBER, result};
+        return true;
+    }
+
+    /**
+     * Condition of an `if`/`while` known at compile time. Only boolean
+     * constants count; jumps on other values are left to the VM.
+     */
+    bool evalCondition(const Exp &test, bool &condition)
+    {
+        Constant value;
+
+        if (!evalConstant(test, value) || value.type != ConstantType::BOOLEAN)
+        {
+            return false;
+        }
+
+        condition = value.boolean;
+        return true;
+    }
+
+    void emitConstant(const Constant &constant)
+    {
+        switch (constant.type)
+        {
+        case ConstantType::NUMBER:
+            emitIndexed(OP_CONST, numericConstIdx(constant.number));
+            break;
+        case ConstantType::BOOLEAN:
+            emitIndexed(OP_CONST, booleanConstIdx(constant.boolean));
+            break;
+        case ConstantType::STRING:
+            emitIndexed(OP_CONST, stringConstIdx(constant.string));
+            break;
+        }
+    }
+
+    /**
+     * Globals registered with Global::addConst are inlined, so they can't
+     * be assigned.
+     */
+    void checkAssignable(SymbolId symbol)
+    {
+        if (global->isConstant(symbol))
+        {
+            DIE << "[Compiler]: can't assign to constant " << symbols().name(symbol);
+        }
+
+        if (owner_->inlinedGlobals_.count(symbol) != 0)
+        {
+            DIE << "[Compiler]: can't redefine " << symbols().name(symbol)
+                << ", an earlier program inlined its calls";
+        }
+    }
+
+    /**
+     * Emits `ADD_LOCAL_LOCAL` / `ADD_LOCAL_CONST` for `(+ local local)`
+     * and `(+ local number)`. Returns false if the operands don't match.
+     */
+    bool genAddLocal(const Exp &exp)
+    {
+        auto localIndex = getLocalOperandIndex(exp.list[1]);
+
+        if (localIndex == -1 || !fitsOperand(localIndex))
+        {
+            return false;
+        }
+
+        auto otherLocalIndex = getLocalOperandIndex(exp.list[2]);
+
+        if (otherLocalIndex != -1 && fitsOperand(otherLocalIndex))
+        {
+            emit(OP_ADD_LOCAL_LOCAL);
+            emit(localIndex);
+            emit(otherLocalIndex);
+            return true;
+        }
+
+        if (exp.list[2].type == ExpType::NUMBER)
+        {
+            auto constIdx = numericConstIdx(exp.list[2].number);
+
+            if (!fitsOperand(constIdx))
+            {
+                return false;
+            }
+
+            emit(OP_ADD_LOCAL_CONST);
+            emit(localIndex);
+            emit(constIdx);
+            return true;
+        }
+
+        return false;
+    }
+
+    /**
+     * Emits the test of an `if`/`while` followed by a conditional jump,
+     * fusing `(<op> local number)` tests into one instruction, and other
+     * comparisons into JMP_IF_NOT_<op>. Returns the offset of the jump
+     * address to patch.
+     */
+    size_t genJmpIfFalse(const Exp &test)
+    {
+        auto isLocalConstCompare =
+            test.type == ExpType::LIST &&
+            test.list.size() == 3 &&
+            test.list[0].type == ExpType::SYMBOL &&
+            isCompareOp(test.list[0].symbol) &&
+            getLocalOperandIndex(test.list[1]) != -1 &&
+            fitsOperand(getLocalOperandIndex(test.list[1])) &&
+            test.list[2].type == ExpType::NUMBER &&
+            fitsOperand(numericConstIdx(test.list[2].number));
+
+        if (isLocalConstCompare)
+        {
+            emit(OP_COMPARE_LOCAL_CONST_JMP_IF_FALSE);
+            emit(getLocalOperandIndex(test.list[1]));
+            emit(numericConstIdx(test.list[2].number));
+            emit(compareOp(test.list[0].symbol));
+
+            emit(0);
+            emit(0);
+
+            return getOffset() - 2;
+        }
+
+        auto isCompare =
+            test.type == ExpType::LIST &&
+            test.list.size() == 3 &&
+            test.list[0].type == ExpType::SYMBOL &&
+            isCompareOp(test.list[0].symbol);
+
+        if (isCompare)
+        {
+            gen(test.list[1]);
+            height_++;
+            gen(test.list[2]);
+            height_--;
+
+            return emitJump(OP_JMP_IF_NOT_LT + compareOp(test.list[0].symbol));
+        }
+
+        gen(test);
+
+        return emitJump(OP_JMP_IF_FALSE);
+    }
+
+    /**
+     * Adds the cell of a local function captured by a closure, and
+     * allocates it before the function is created, so the function can
+     * capture itself.
+     */
+    void allocateCell(const std::string &name)
+    {
+        co->addCell(name);
+        emitIndexed(OP_CONST, booleanConstIdx(false));
+        emitIndexed(OP_SET_CELL_POP, co->cellNames.size() - 1);
+    }
+
+    /**
+     * Calls in tail position, except of functions which don't escape:
+     * they read their caller's frame, which a tail call would replace.
+     */
+    bool isTailCall(const Exp &exp)
+    {
+        const auto &escapes = owner_->escapes_;
+        auto call = escapes.calls.find(&exp);
+
+        return tailCalls_.count(&exp) != 0 &&
+               (call == escapes.calls.end() || escapes.functions.count(call->second) == 0);
+    }
+
+    /**
+     * Both operands of a binary operation are proven numbers.
+     */
+    bool isNumericOperation(const Exp &exp)
+    {
+        return numeric_.count(&exp.list[1]) != 0 && numeric_.count(&exp.list[2]) != 0;
+    }
+
+    /**
+     * Stack slot of a symbol operand resolving to a local, or -1.
+     */
+    int getLocalOperandIndex(const Exp &exp)
+    {
+        if (exp.type != ExpType::SYMBOL || isBooleanSymbol(exp.symbol))
+        {
+            return -1;
+        }
+
+        auto symbol = exp.symbol;
+
+        if (scopeStack_.top()->getNameGetter(symbol) != OP_GET_LOCAL)
+        {
+            return -1;
+        }
+
+        return co->getlocalIndex(symbol);
+    }
+
+    bool isDeclaration(const Exp &exp)
+    {
+        return isVarDeclaration(exp) || isFunctionDeclaration(exp);
+    }
+
+    bool isVarDeclaration(const Exp &exp)
+    {
+        return isTaggedList(exp, SYM_VAR);
+    }
+
+    bool isFunctionDeclaration(const Exp &exp)
+    {
+        return isTaggedList(exp, SYM_DEF);
+    }
+
+    bool isTaggedList(const Exp &exp, SymbolId tag)
+    {
+        return exp.type == ExpType::LIST && exp.list[0].type == ExpType::SYMBOL && exp.list[0].symbol == tag;
+    }
+
+    bool isBlock(const Exp &exp)
+    {
+        return isTaggedList(exp, SYM_BEGIN);
+    }
+
+    bool isLambda(const Exp &exp)
+    {
+        return isTaggedList(exp, SYM_LAMBDA);
+    }
+
+    bool isGlobalScope()
+    {
+        return co->name == "main" && co->scopeLevel == 1;
+    }
+
+    bool isFunctionBody()
+    {
+        return co->name != "main" && co->scopeLevel == 1;
+    }
+
+    void blockEnter()
+    {
+        co->scopeLevel++;
+    }
 
     void blockExit()
     {
         auto varCounts = getVarCountOnScopeExit();
 
+        height_ -= varCounts;
+
         if (varCounts > 0 || co->arity > 0)
         {
-            emit(OP_SCOPE_EXIT);
-
             if (isFunctionBody())
             {
                 varCounts += co->arity + 1;
             }
 
-            emit(varCounts);
+            emitIndexed(OP_SCOPE_EXIT, varCounts);
         }
         co->scopeLevel--;
     }
@@ -613,9 +1546,9 @@ private:
 
         if (co->locals.size() > 0)
         {
-            while (co->locals.back().scoleLevel == co->scopeLevel)
+            while (!co->locals.empty() && co->locals.back().scoleLevel == co->scopeLevel)
             {
-                co->locals.pop_back();
+                co->popLocal();
                 varCount++;
             }
         }
@@ -627,28 +1560,63 @@ private:
         co->code[offset] = value;
     }
 
-    void patchJmpAddress(size_t offset, uint16_t value)
+    /**
+     * Addresses past 0xFFFF are recorded in farJumps_ and encoded once
+     * the code object is complete (see finishCode).
+     */
+    void patchJmpAddress(size_t offset, size_t value)
     {
+        if (value > 0xFFFF)
+        {
+            farJumps_[co][offset] = value;
+        }
+
         writeByteAtOffset(offset, (value >> 8) & 0xff);
         writeByteAtOffset(offset + 1, value & 0xff);
     }
 
     size_t numericConstIdx(double value)
     {
-        ALLOC_CONST(IS_NUMBER, AS_NUMBER, NUMBER, value);
-        return co->constants.size() - 1;
+        uint64_t bits;
+        memcpy(&bits, &value, sizeof(double));
+
+        auto &numbers = constantIndex_[co].numbers;
+        auto constant = numbers.find(bits);
+
+        if (constant != numbers.end())
+        {
+            return constant->second;
+        }
+
+        co->addConstant(NUMBER(value));
+        return numbers[bits] = co->constants.size() - 1;
     }
 
     size_t stringConstIdx(const std::string &value)
     {
-        ALLOC_CONST(IS_STRING, AS_CPPSTRING, ALLOC_STRING, value);
-        return co->constants.size() - 1;
+        auto &strings = constantIndex_[co].strings;
+        auto constant = strings.find(value);
+
+        if (constant != strings.end())
+        {
+            return constant->second;
+        }
+
+        co->addConstant(ALLOC_STRING(value));
+        return strings[value] = co->constants.size() - 1;
     }
 
     size_t booleanConstIdx(bool value)
     {
-        ALLOC_CONST(IS_BOOLEAN, AS_BOOLEAN, BOOLEAN, value);
-        return co->constants.size() - 1;
+        auto &index = constantIndex_[co].booleans[value];
+
+        if (index == SIZE_MAX)
+        {
+            co->addConstant(BOOLEAN(value));
+            index = co->constants.size() - 1;
+        }
+
+        return index;
     }
 
     void emit(uint8_t code)
@@ -656,32 +1624,174 @@ private:
         co->code.push_back(code);
     }
 
+    bool fitsOperand(size_t operand)
+    {
+        return operand <= 0xFF;
+    }
+
+    /**
+     * Emits a one-operand instruction, with the WIDE prefix and a 32-bit
+     * operand if it doesn't fit into a byte.
+     */
+    void emitIndexed(uint8_t opcode, size_t operand)
+    {
+        if (fitsOperand(operand))
+        {
+            emit(opcode);
+            emit(operand);
+            return;
+        }
+
+        if (operand > UINT32_MAX)
+        {
+            DIE << "[Compiler]: operand out of range: " << operand;
+        }
+
+        emit(OP_WIDE);
+        emit(opcode);
+        emitWord(operand);
+    }
+
+    void emitWord(uint32_t word)
+    {
+        emit((word >> 24) & 0xff);
+        emit((word >> 16) & 0xff);
+        emit((word >> 8) & 0xff);
+        emit(word & 0xff);
+    }
+
+    /**
+     * Emits a jump with a placeholder address. Returns the offset of the
+     * address to patch.
+     */
+    size_t emitJump(uint8_t opcode)
+    {
+        emit(opcode);
+        emit(0);
+        emit(0);
+
+        return getOffset() - 2;
+    }
+
+    /**
+     * Emits the back-edge of a loop starting at `loopStart`.
+     */
+    void emitLoop(size_t loopStart)
+    {
+        auto addressOffset = emitJump(OP_LOOP);
+        patchJmpAddress(addressOffset, getOffset() - loopStart);
+    }
+
+    /**
+     * Called once the code object is complete: runs the peephole
+     * optimizer and re-encodes the code. Jump addresses were emitted as
+     * 16-bit; the encoder switches to WIDE jumps past 64 KiB of code.
+     */
+    void finishCode()
+    {
+        auto instructions = decodeInstructions(co->code, farJumps_[co]);
+        farJumps_.erase(co);
+        constantIndex_.erase(co);
+
+        if (optimize)
+        {
+            PeepholeOptimizer().optimize(instructions);
+        }
+
+        co->code = encodeInstructions(instructions);
+        co->entry = co->code.data();
+    }
+
+    /**
+     * The program being compiled, after inlining, and its lists.
+     */
+    Exp program_ = Exp(0);
+
+    ExpArena arena_;
+
     std::map<const Exp *, std::shared_ptr<Scope>> scopeInfo_;
 
+    /**
+     * Expressions proven to evaluate to numbers (see TypeInference).
+     */
+    std::unordered_set<const Exp *> numeric_;
+
     std::stack<std::shared_ptr<Scope>> scopeStack_;
 
+    /**
+     * Values on the stack of the current frame below the expression being
+     * compiled: locals and the operands already pushed. New locals take
+     * the next slot.
+     */
+    size_t height_;
+
+    /**
+     * Functions which don't escape their parent (see EscapeAnalysis).
+     */
+    EscapeAnalysis escapes_;
+
+    /**
+     * Code objects of the functions enclosing the one being compiled.
+     */
+    std::stack<CodeObject *> parentCodeObjects_;
+
+    std::set<const Exp *> tailCalls_;
+
+    /**
+     * Jump addresses which don't fit 16 bits, by code object and offset
+     * of the address.
+     */
+    std::map<CodeObject *, std::map<size_t, size_t>> farJumps_;
+
+    /**
+     * Literals already in a code object's constant pool, by type and
+     * value. Only kept while the code object is being compiled.
+     */
+    struct ConstantIndex
+    {
+        std::unordered_map<uint64_t, size_t> numbers;
+
+        std::unordered_map<std::string, size_t> strings;
+
+        size_t booleans[2] = {SIZE_MAX, SIZE_MAX};
+    };
+
+    std::unordered_map<CodeObject *, ConstantIndex> constantIndex_;
+
+    /**
+     * Compiler whose analyses (scopes, escapes, types) the code is
+     * generated from: this one, or the one which deferred the bodies.
+     */
+    const XPCompiler *owner_ = this;
+
+    std::vector<DeferredFunction> deferred_;
+
+    bool deferBodies_ = false;
+
+    size_t visibleGlobals_ = SIZE_MAX;
+
     CodeObject *co;
 
     FunctionObject *main;
 
     std::vector<CodeObject *> codeObjects_;
 
+    /**
+     * Index in codeObjects_ of the last compilation's main.
+     */
+    size_t firstCodeObject_ = 0;
+
+    /**
+     * Globals whose calls earlier compilations inlined: they can't be
+     * redefined.
+     */
+    std::unordered_set<SymbolId> inlinedGlobals_;
+
     std::set<Traceable *> constantObjects_;
 
     std::shared_ptr<Global> global;
 
     std::unique_ptr<Disassembler> disassembler;
-
-    static std::map<std::string, uint8_t> compareOps;
-};
-
-std::map<std::string, uint8_t> XPCompiler::compareOps = {
-    {"<", 0},
-    {">", 1},
-    {"==", 2},
-    {">=", 3},
-    {"<=", 4},
-    {"!=", 5},
 };
 
 #endif
\ No newline at end of file
@@ -0,0 +1,251 @@
+#ifndef __escapeAnalysis_h
+#define __escapeAnalysis_h
+
+#include <unordered_map>
+#include <unordered_set>
+#include <vector>
+#include "../vm/symbolTable.h"
+
+/**
+ * Finds the functions which can only be called from the frame of the
+ * function declaring them. Their free variables are read from that frame
+ * (OP_GET_PARENT_LOCAL) instead of heap cells.
+ *
+ * Candidates are local `def`s, local `var`s initialized with a `lambda`,
+ * and lambdas called in place: `((lambda (x) ...) 1)`. A candidate
+ * escapes if its name is used other than as the callee of a call in the
+ * declaring function itself: as a value (passed, returned, stored), in a
+ * nested function (including its own body, so recursive functions
+ * escape), or as the target of `set`. Functions declared at the top level
+ * are globals, and never candidates.
+ */
+class EscapeAnalysis
+{
+public:
+    /**
+     * Declarations (`def`, or the `lambda` of a `var` or a call) of the
+     * functions which don't escape.
+     */
+    std::unordered_set<const Exp *> functions;
+
+    /**
+     * Calls of the functions which don't escape, mapped to the callee's
+     * declaration.
+     */
+    std::unordered_map<const Exp *, const Exp *> calls;
+
+    void analyze(const Exp &program)
+    {
+        functions.clear();
+        calls.clear();
+        bindings.clear();
+        functionDepth = 0;
+
+        visit(program);
+
+        for (auto call = calls.begin(); call != calls.end();)
+        {
+            call = functions.count(call->second) != 0 ? std::next(call) : calls.erase(call);
+        }
+    }
+
+private:
+    struct Binding
+    {
+        /**
+         * Function declaration the name is bound to, or nullptr.
+         */
+        const Exp *function;
+
+        size_t functionDepth;
+    };
+
+    void visit(const Exp &exp)
+    {
+        if (exp.type == ExpType::SYMBOL)
+        {
+            escape(exp.symbol);
+            return;
+        }
+
+        if (exp.type != ExpType::LIST || exp.list.size() == 0)
+        {
+            return;
+        }
+
+        auto &tag = exp.list[0];
+
+        if (tag.type != ExpType::SYMBOL)
+        {
+            if (isTaggedList(tag, SYM_LAMBDA))
+            {
+                functions.insert(&tag);
+                calls[&exp] = &tag;
+                visitFunction(tag.list[1], tag.list[2]);
+            }
+            else
+            {
+                visit(tag);
+            }
+
+            visitFrom(exp, 1);
+            return;
+        }
+
+        switch (tag.symbol)
+        {
+        case SYM_BEGIN:
+            bindings.emplace_back();
+            visitFrom(exp, 1);
+            bindings.pop_back();
+            break;
+
+        case SYM_VAR:
+        {
+            auto &value = exp.list[2];
+            auto isFunction = isTaggedList(value, SYM_LAMBDA) && isLocalScope();
+
+            declare(exp.list[1].symbol, isFunction ? &value : nullptr);
+
+            if (isFunction)
+            {
+                functions.insert(&value);
+                visitFunction(value.list[1], value.list[2]);
+            }
+            else
+            {
+                visit(value);
+            }
+            break;
+        }
+
+        case SYM_DEF:
+        {
+            auto isFunction = isLocalScope();
+
+            declare(exp.list[1].symbol, isFunction ? &exp : nullptr);
+
+            if (isFunction)
+            {
+                functions.insert(&exp);
+            }
+
+            visitFunction(exp.list[2], exp.list[3]);
+            break;
+        }
+
+        case SYM_LAMBDA:
+            visitFunction(exp.list[1], exp.list[2]);
+            break;
+
+        case SYM_SET:
+            escape(exp.list[1].symbol);
+            visit(exp.list[2]);
+            break;
+
+        default:
+            if (isSpecialForm(tag.symbol))
+            {
+                visitFrom(exp, 1);
+                break;
+            }
+
+            auto binding = lookup(tag.symbol);
+
+            if (binding != nullptr && binding->function != nullptr &&
+                binding->functionDepth == functionDepth)
+            {
+                calls[&exp] = binding->function;
+            }
+            else
+            {
+                escape(tag.symbol);
+            }
+
+            visitFrom(exp, 1);
+        }
+    }
+
+    void visitFrom(const Exp &exp, size_t from)
+    {
+        for (auto i = from; i < exp.list.size(); i++)
+        {
+            visit(exp.list[i]);
+        }
+    }
+
+    void visitFunction(const Exp &params, const Exp &body)
+    {
+        functionDepth++;
+        bindings.emplace_back();
+
+        for (const auto &param : params.list)
+        {
+            declare(param.symbol, nullptr);
+        }
+
+        visit(body);
+
+        bindings.pop_back();
+        functionDepth--;
+    }
+
+    /**
+     * The function bound to `name`, if any, escapes.
+     */
+    void escape(SymbolId name)
+    {
+        auto binding = lookup(name);
+
+        if (binding != nullptr && binding->function != nullptr)
+        {
+            functions.erase(binding->function);
+        }
+    }
+
+    void declare(SymbolId symbol, const Exp *function)
+    {
+        bindings.back()[symbol] = Binding{function, functionDepth};
+    }
+
+    Binding *lookup(SymbolId symbol)
+    {
+        for (auto frame = bindings.rbegin(); frame != bindings.rend(); frame++)
+        {
+            auto binding = frame->find(symbol);
+
+            if (binding != frame->end())
+            {
+                return &binding->second;
+            }
+        }
+
+        return nullptr;
+    }
+
+    /**
+     * Declarations outside the global scope are locals.
+     */
+    bool isLocalScope()
+    {
+        return bindings.size() > 1;
+    }
+
+    bool isTaggedList(const Exp &exp, SymbolId tag)
+    {
+        return exp.type == ExpType::LIST && exp.list.size() > 0 &&
+               exp.list[0].type == ExpType::SYMBOL && exp.list[0].symbol == tag;
+    }
+
+    /**
+     * Names in scope, innermost block last.
+     */
+    std::vector<std::unordered_map<SymbolId, Binding>> bindings;
+
+    /**
+     * Functions the visited expression is nested in.
+     */
+    size_t functionDepth;
+};
+
+#endif
@@ -0,0 +1,682 @@
+#ifndef __inliner_h
+#define __inliner_h
+
+#include <memory>
+#include <string>
+#include <unordered_map>
+#include <unordered_set>
+#include <vector>
+#include "../vm/symbolTable.h"
+
+/**
+ * Inlines calls of small functions into the program before it's
+ * compiled. A call `(f a b)` of `(def f (x y) body)` becomes
+ *
+ *   (begin (var inline.0.0 a) (var inline.0.1 b) body')
+ *
+ * where body' is the body with its parameters and locals renamed to
+ * temporaries, which the lexer can't produce. The block's SCOPE_EXIT
+ * drops the arguments like the callee's frame would.
+ *
+ * Temporaries are numbered by inlining depth (calls inlined into an
+ * inlined body are one deeper) and by position in the body, so every
+ * call reuses the same few names: a block's temporaries only shadow those
+ * of the blocks around it. Symbols are never freed (see symbols()), and a
+ * fresh name per call would grow the table with every call inlined.
+ *
+ * A `def` is inlined if:
+ *
+ *   - it's a global declared once, or a local;
+ *   - its name is never the target of `set`;
+ *   - its body is at most `budget` expressions, doesn't define functions,
+ *     and doesn't refer to the function's own name (so it isn't
+ *     recursive);
+ *   - neither the body nor a block in it ends with a declaration: a
+ *     block's SCOPE_EXIT drops the declared value with its other locals,
+ *     so the value is only kept as a whole function body's;
+ *   - the call has the right number of arguments, and every other name
+ *     the body uses refers at the call site to the same declaration as
+ *     at the definition.
+ *
+ * Calls in inlined bodies are inlined too, except of the functions being
+ * inlined, so mutual recursion stops.
+ *
+ * Globals are only inlined if `inlineGlobals` is set: forms compiled
+ * later may redefine them.
+ */
+class Inliner
+{
+public:
+    /**
+     * The rewritten program's lists are allocated in `arena`.
+     */
+    Inliner(ExpArena &arena, size_t budget, bool inlineGlobals = true)
+        : arena(arena), budget(budget), inlineGlobals(inlineGlobals) {}
+
+    /**
+     * Globals whose calls were inlined.
+     */
+    std::unordered_set<SymbolId> inlinedGlobals;
+
+    Exp inlineCalls(const Exp &program)
+    {
+        collectAssigned(program);
+
+        frames.emplace_back();
+        declareGlobals(program);
+
+        auto result = visitFrom(program, 1);
+
+        frames.pop_back();
+
+        return result;
+    }
+
+private:
+    /**
+     * A function which may be inlined.
+     */
+    struct Function
+    {
+        const Exp *def;
+
+        /**
+         * Declarations the body's free names refer to (nullptr for
+         * undeclared globals, like natives).
+         */
+        std::vector<std::pair<SymbolId, const Exp *>> freeNames{};
+    };
+
+    struct Binding
+    {
+        const Exp *declaration;
+
+        /**
+         * Set if the name is bound to a function which may be inlined.
+         */
+        const Function *function;
+    };
+
+    Exp visit(const Exp &exp)
+    {
+        if (exp.type != ExpType::LIST || exp.list.size() == 0)
+        {
+            return exp;
+        }
+
+        auto &tag = exp.list[0];
+
+        if (tag.type != ExpType::SYMBOL)
+        {
+            return visitFrom(exp, 0);
+        }
+
+        switch (tag.symbol)
+        {
+        case SYM_BEGIN:
+        {
+            frames.emplace_back();
+            auto result = visitFrom(exp, 1);
+            frames.pop_back();
+
+            return result;
+        }
+
+        case SYM_VAR:
+            declare(exp.list[1].symbol, &exp);
+            return visitFrom(exp, 2);
+
+        case SYM_DEF:
+            return visitDef(exp);
+
+        case SYM_LAMBDA:
+            return visitFunction(exp, 1);
+
+        default:
+            break;
+        }
+
+        if (isSpecialForm(tag.symbol))
+        {
+            return visitFrom(exp, 1);
+        }
+
+        auto call = visitFrom(exp, 1);
+        auto binding = lookup(tag.symbol);
+
+        if (binding == nullptr || binding->function == nullptr ||
+            !canInline(*binding->function, exp))
+        {
+            return call;
+        }
+
+        return inlineCall(*binding->function, call);
+    }
+
+    /**
+     * Copy of `exp` with its elements from `from` on visited.
+     */
+    Exp visitFrom(const Exp &exp, size_t from)
+    {
+        std::vector<Exp> list(exp.list.begin(), exp.list.begin() + from);
+
+        for (auto i = from; i < exp.list.size(); i++)
+        {
+            list.push_back(visit(exp.list[i]));
+        }
+
+        return Exp(arena.list(list));
+    }
+
+    Exp visitDef(const Exp &exp)
+    {
+        auto name = exp.list[1].symbol;
+
+        // Globals are declared upfront (see declareGlobals).
+        if (frames.size() == 1)
+        {
+            definedGlobals.insert(&exp);
+        }
+        else
+        {
+            declare(name, &exp);
+
+            if (isInlinable(exp))
+            {
+                functions.push_back(std::make_unique<Function>(makeFunction(exp)));
+                frames.back()[name].function = functions.back().get();
+            }
+        }
+
+        return visitFunction(exp, 2);
+    }
+
+    /**
+     * Copy of a def or lambda with its body visited.
+     */
+    Exp visitFunction(const Exp &exp, size_t paramsIndex)
+    {
+        auto &params = exp.list[paramsIndex];
+
+        frames.emplace_back();
+        functionDepth++;
+
+        for (const auto &param : params.list)
+        {
+            declare(param.symbol, &param);
+        }
+
+        auto result = visitFrom(exp, paramsIndex + 1);
+
+        functionDepth--;
+        frames.pop_back();
+
+        return result;
+    }
+
+    bool canInline(const Function &function, const Exp &call)
+    {
+        auto &def = *function.def;
+
+        if (call.list.size() - 1 != def.list[2].list.size())
+        {
+            return false;
+        }
+
+        // At the top level, a global is only defined once its def ran.
+        if (functionDepth == 0 && isGlobal(def) && definedGlobals.count(&def) == 0)
+        {
+            return false;
+        }
+
+        for (auto inlined : inlining)
+        {
+            if (inlined == &def)
+            {
+                return false;
+            }
+        }
+
+        for (const auto &[symbol, declaration] : function.freeNames)
+        {
+            auto binding = lookup(symbol);
+
+            if ((binding == nullptr ? nullptr : binding->declaration) != declaration)
+            {
+                return false;
+            }
+        }
+
+        return true;
+    }
+
+    Exp inlineCall(const Function &function, const Exp &call)
+    {
+        auto &def = *function.def;
+        auto &params = def.list[2].list;
+
+        auto depth = inlining.size();
+        size_t temporaries = 0;
+
+        if (isGlobal(def))
+        {
+            inlinedGlobals.insert(def.list[1].symbol);
+        }
+
+        std::vector<Exp> block{Exp(std::string("begin"))};
+
+        renames.emplace_back();
+
+        for (size_t i = 0; i < params.size(); i++)
+        {
+            auto fresh = temporary(depth, temporaries++);
+            renames.back()[params[i].string()] = fresh;
+
+            std::vector<Exp> param{Exp(std::string("var")), Exp(fresh), call.list[i + 1]};
+            block.push_back(Exp(arena.list(param)));
+        }
+
+        auto body = rename(def.list[3], depth, temporaries);
+
+        renames.pop_back();
+
+        // The arguments are locals of the block, under their temporaries.
+        frames.emplace_back();
+
+        for (size_t i = 1; i < block.size(); i++)
+        {
+            declare(block[i].list[1].symbol, &def);
+        }
+
+        inlining.push_back(&def);
+        block.push_back(visit(body));
+        inlining.pop_back();
+
+        frames.pop_back();
+
+        return Exp(arena.list(block));
+    }
+
+    /**
+     * Copy of an inlined body with the names in `renames` replaced, and
+     * its locals given the next temporaries of `depth`.
+     */
+    Exp rename(const Exp &exp, size_t depth, size_t &temporaries)
+    {
+        if (exp.type == ExpType::SYMBOL)
+        {
+            auto fresh = renamed(exp.string());
+
+            if (fresh == nullptr)
+            {
+                return exp;
+            }
+
+            return Exp(*fresh);
+        }
+
+        if (exp.type != ExpType::LIST)
+        {
+            return exp;
+        }
+
+        auto isBlock = isTaggedList(exp, SYM_BEGIN);
+
+        if (isBlock)
+        {
+            renames.emplace_back();
+        }
+
+        std::vector<Exp> list;
+
+        for (size_t i = 0; i < exp.list.size(); i++)
+        {
+            if (i == 1 && isTaggedList(exp, SYM_VAR))
+            {
+                renames.back()[exp.list[1].string()] = temporary(depth, temporaries++);
+            }
+
+            list.push_back(i == 0 && exp.list[0].type == ExpType::SYMBOL && isSpecialForm(exp.list[0].symbol)
+                               ? exp.list[0]
+                               : rename(exp.list[i], depth, temporaries));
+        }
+
+        if (isBlock)
+        {
+            renames.pop_back();
+        }
+
+        return Exp(arena.list(list));
+    }
+
+    std::string temporary(size_t depth, size_t index)
+    {
+        return "inline." + std::to_string(depth) + "." + std::to_string(index);
+    }
+
+    const std::string *renamed(const std::string &name)
+    {
+        for (auto frame = renames.rbegin(); frame != renames.rend(); frame++)
+        {
+            auto fresh = frame->find(name);
+
+            if (fresh != frame->end())
+            {
+                return &fresh->second;
+            }
+        }
+
+        return nullptr;
+    }
+
+    bool isInlinable(const Exp &def)
+    {
+        auto name = def.list[1].symbol;
+        auto &body = def.list[3];
+
+        return assigned.count(name) == 0 &&
+               size(body) <= budget &&
+               !definesFunctions(body) &&
+               !refersTo(body, name) &&
+               !endsWithDeclaration(body);
+    }
+
+    /**
+     * Snapshot of what the free names of the def's body refer to.
+     */
+    Function makeFunction(const Exp &def)
+    {
+        std::unordered_set<SymbolId> bound;
+
+        for (const auto &param : def.list[2].list)
+        {
+            bound.insert(param.symbol);
+        }
+
+        std::unordered_set<SymbolId> free;
+        collectFree(def.list[3], bound, free);
+
+        Function function{&def};
+
+        for (auto symbol : free)
+        {
+            auto binding = lookup(symbol);
+            function.freeNames.emplace_back(symbol, binding == nullptr ? nullptr : binding->declaration);
+        }
+
+        return function;
+    }
+
+    /**
+     * Names used in `exp` and not declared in it or in `bound`. Locals
+     * declared by the body are counted as bound for all of it, which only
+     * matters if the body reads them before declaring them.
+     */
+    void collectFree(const Exp &exp, std::unordered_set<SymbolId> &bound,
+                     std::unordered_set<SymbolId> &free)
+    {
+        if (exp.type == ExpType::SYMBOL)
+        {
+            if (!isBooleanSymbol(exp.symbol))
+            {
+                free.insert(exp.symbol);
+            }
+
+            return;
+        }
+
+        if (exp.type != ExpType::LIST || exp.list.size() == 0)
+        {
+            return;
+        }
+
+        size_t from = 0;
+
+        if (exp.list[0].type == ExpType::SYMBOL && isSpecialForm(exp.list[0].symbol))
+        {
+            from = 1;
+
+            if (exp.list[0].symbol == SYM_VAR)
+            {
+                bound.insert(exp.list[1].symbol);
+                from = 2;
+            }
+        }
+
+        for (auto i = from; i < exp.list.size(); i++)
+        {
+            collectFree(exp.list[i], bound, free);
+        }
+
+        for (auto symbol = free.begin(); symbol != free.end();)
+        {
+            symbol = bound.count(*symbol) != 0 ? free.erase(symbol) : std::next(symbol);
+        }
+    }
+
+    /**
+     * Declares the program's globals and finds the inlinable ones, so
+     * functions can inline globals defined after them.
+     */
+    void declareGlobals(const Exp &program)
+    {
+        std::unordered_map<SymbolId, size_t> declarations;
+
+        for (size_t i = 1; i < program.list.size(); i++)
+        {
+            auto &exp = program.list[i];
+
+            if (isTaggedList(exp, SYM_VAR) || isTaggedList(exp, SYM_DEF))
+            {
+                declare(exp.list[1].symbol, &exp);
+                declarations[exp.list[1].symbol]++;
+            }
+        }
+
+        for (size_t i = 1; i < program.list.size(); i++)
+        {
+            auto &exp = program.list[i];
+
+            if (inlineGlobals && isTaggedList(exp, SYM_DEF) &&
+                declarations[exp.list[1].symbol] == 1 &&
+                isInlinable(exp))
+            {
+                globalDefs.insert(&exp);
+                functions.push_back(std::make_unique<Function>(makeFunction(exp)));
+                frames.back()[exp.list[1].symbol].function = functions.back().get();
+            }
+        }
+    }
+
+    /**
+     * Names assigned anywhere in the program. Functions with these names
+     * aren't inlined, whichever declaration the `set` refers to.
+     */
+    void collectAssigned(const Exp &exp)
+    {
+        if (exp.type != ExpType::LIST)
+        {
+            return;
+        }
+
+        if (isTaggedList(exp, SYM_SET))
+        {
+            assigned.insert(exp.list[1].symbol);
+        }
+
+        for (const auto &element : exp.list)
+        {
+            collectAssigned(element);
+        }
+    }
+
+    bool isGlobal(const Exp &def)
+    {
+        return globalDefs.count(&def) != 0;
+    }
+
+    /**
+     * Number of expressions in `exp`.
+     */
+    size_t size(const Exp &exp)
+    {
+        size_t count = 1;
+
+        if (exp.type == ExpType::LIST)
+        {
+            for (const auto &element : exp.list)
+            {
+                count += size(element);
+            }
+        }
+
+        return count;
+    }
+
+    bool definesFunctions(const Exp &exp)
+    {
+        if (exp.type != ExpType::LIST)
+        {
+            return false;
+        }
+
+        if (isTaggedList(exp, SYM_DEF) || isTaggedList(exp, SYM_LAMBDA))
+        {
+            return true;
+        }
+
+        for (const auto &element : exp.list)
+        {
+            if (definesFunctions(element))
+            {
+                return true;
+            }
+        }
+
+        return false;
+    }
+
+    /**
+     * Whether `body` is a declaration, or has a block whose last
+     * expression is one.
+     */
+    bool endsWithDeclaration(const Exp &body)
+    {
+        return isDeclaration(body) || hasBlockEndingWithDeclaration(body);
+    }
+
+    bool hasBlockEndingWithDeclaration(const Exp &exp)
+    {
+        if (exp.type != ExpType::LIST)
+        {
+            return false;
+        }
+
+        if (isTaggedList(exp, SYM_BEGIN) && exp.list.size() > 1 && isDeclaration(exp.list[exp.list.size() - 1]))
+        {
+            return true;
+        }
+
+        for (const auto &element : exp.list)
+        {
+            if (hasBlockEndingWithDeclaration(element))
+            {
+                return true;
+            }
+        }
+
+        return false;
+    }
+
+    bool isDeclaration(const Exp &exp)
+    {
+        return isTaggedList(exp, SYM_VAR) || isTaggedList(exp, SYM_DEF);
+    }
+
+    bool refersTo(const Exp &exp, SymbolId name)
+    {
+        if (exp.type == ExpType::SYMBOL)
+        {
+            return exp.symbol == name;
+        }
+
+        if (exp.type != ExpType::LIST)
+        {
+            return false;
+        }
+
+        for (const auto &element : exp.list)
+        {
+            if (refersTo(element, name))
+            {
+                return true;
+            }
+        }
+
+        return false;
+    }
+
+    void declare(SymbolId symbol, const Exp *declaration)
+    {
+        frames.back()[symbol] = Binding{declaration, nullptr};
+    }
+
+    Binding *lookup(SymbolId symbol)
+    {
+        for (auto frame = frames.rbegin(); frame != frames.rend(); frame++)
+        {
+            auto binding = frame->find(symbol);
+
+            if (binding != frame->end())
+            {
+                return &binding->second;
+            }
+        }
+
+        return nullptr;
+    }
+
+    bool isTaggedList(const Exp &exp, SymbolId tag)
+    {
+        return exp.type == ExpType::LIST && exp.list.size() > 0 &&
+               exp.list[0].type == ExpType::SYMBOL && exp.list[0].symbol == tag;
+    }
+
+    ExpArena &arena;
+
+    /**
+     * Largest body inlined, in expressions.
+     */
+    size_t budget;
+
+    bool inlineGlobals;
+
+    /**
+     * Names in scope, innermost block last; the first frame holds the
+     * globals.
+     */
+    std::vector<std::unordered_map<SymbolId, Binding>> frames;
+
+    /**
+     * Temporaries of the parameters and locals of the body being
+     * renamed, innermost block last.
+     */
+    std::vector<std::unordered_map<std::string, std::string>> renames;
+
+    std::vector<std::unique_ptr<Function>> functions;
+
+    std::unordered_set<const Exp *> globalDefs;
+
+    std::unordered_set<const Exp *> definedGlobals;
+
+    std::unordered_set<SymbolId> assigned;
+
+    /**
+     * Functions whose bodies are being inlined.
+     */
+    std::vector<const Exp *> inlining;
+
+    size_t functionDepth = 0;
+};
+
+#endif
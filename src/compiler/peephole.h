@@ -0,0 +1,232 @@
+#ifndef __peephole_h
+#define __peephole_h
+
+#include <set>
+#include <vector>
+#include "../bytecode/OpCode.h"
+#include "../bytecode/instructionList.h"
+
+/**
+ * Peephole optimizer over the decoded instructions of a code object:
+ *
+ *   - jumps to an unconditional JMP go straight to its target;
+ *   - code not reachable from the entry is removed;
+ *   - a push followed by POP (CONST, GET_*, LOAD_CELL) is removed;
+ *   - SET_CELL; POP becomes SET_CELL_POP;
+ *   - adjacent SCOPE_EXITs are merged, and SCOPE_EXIT 0 is removed;
+ *   - a JMP to the next instruction is removed.
+ *
+ * Instructions that are jump targets are never merged into the one
+ * before them.
+ */
+class PeepholeOptimizer
+{
+public:
+    void optimize(std::vector<Instruction> &instructions)
+    {
+        bool changed = true;
+
+        while (changed)
+        {
+            changed = false;
+            changed |= threadJumps(instructions);
+            changed |= removeUnreachable(instructions);
+            changed |= combinePairs(instructions);
+        }
+    }
+
+private:
+    bool threadJumps(std::vector<Instruction> &instructions)
+    {
+        bool changed = false;
+
+        for (size_t index = 0; index < instructions.size(); index++)
+        {
+            auto &instruction = instructions[index];
+
+            if (instruction.removed || !isJump(instruction.opcode))
+            {
+                continue;
+            }
+
+            auto &address = instruction.operands.back();
+            auto target = liveInstruction(instructions, address);
+
+            // Bounded, so a loop of JMPs can't hang the compiler.
+            for (size_t hops = 0; hops < instructions.size() && instructions[target].opcode == OP_JMP; hops++)
+            {
+                target = liveInstruction(instructions, instructions[target].operands[0]);
+            }
+
+            // LOOP only jumps backwards.
+            if (instruction.opcode == OP_LOOP && target > index)
+            {
+                continue;
+            }
+
+            if (target != address)
+            {
+                address = target;
+                changed = true;
+            }
+        }
+
+        return changed;
+    }
+
+    bool removeUnreachable(std::vector<Instruction> &instructions)
+    {
+        std::vector<bool> reachable(instructions.size(), false);
+        std::vector<size_t> worklist{liveInstruction(instructions, 0)};
+
+        auto reach = [&](size_t index)
+        {
+            index = liveInstruction(instructions, index);
+
+            if (!reachable[index])
+            {
+                reachable[index] = true;
+                worklist.push_back(index);
+            }
+        };
+
+        reachable[worklist.back()] = true;
+
+        while (!worklist.empty())
+        {
+            auto index = worklist.back();
+            worklist.pop_back();
+
+            const auto &instruction = instructions[index];
+
+            if (isJump(instruction.opcode))
+            {
+                reach(instruction.operands.back());
+            }
+
+            if (!isTerminator(instruction.opcode) && index + 1 < instructions.size())
+            {
+                reach(index + 1);
+            }
+        }
+
+        bool changed = false;
+
+        for (size_t i = 0; i < instructions.size(); i++)
+        {
+            if (!instructions[i].removed && !reachable[i])
+            {
+                instructions[i].removed = true;
+                changed = true;
+            }
+        }
+
+        return changed;
+    }
+
+    bool combinePairs(std::vector<Instruction> &instructions)
+    {
+        auto targets = jumpTargets(instructions);
+
+        bool changed = false;
+
+        for (size_t i = 0; i < instructions.size(); i++)
+        {
+            auto &first = instructions[i];
+
+            if (first.removed)
+            {
+                continue;
+            }
+
+            if (first.opcode == OP_SCOPE_EXIT && first.operands[0] == 0)
+            {
+                first.removed = true;
+                changed = true;
+                continue;
+            }
+
+            auto next = nextLive(instructions, i);
+
+            if (isJump(first.opcode) && next < instructions.size() &&
+                liveInstruction(instructions, first.operands.back()) == next)
+            {
+                // A JMP_IF_FALSE stays: it still checks that its
+                // condition is a boolean.
+                if (first.opcode == OP_JMP)
+                {
+                    first.removed = true;
+                    changed = true;
+                    continue;
+                }
+            }
+
+            if (next == instructions.size() || targets.count(next) != 0)
+            {
+                continue;
+            }
+
+            auto &second = instructions[next];
+
+            if (isPurePush(first.opcode) && second.opcode == OP_POP)
+            {
+                first.removed = true;
+                second.removed = true;
+                changed = true;
+            }
+            else if (first.opcode == OP_SET_CELL && second.opcode == OP_POP)
+            {
+                first.opcode = OP_SET_CELL_POP;
+                second.removed = true;
+                changed = true;
+            }
+            else if (first.opcode == OP_SCOPE_EXIT && second.opcode == OP_SCOPE_EXIT)
+            {
+                first.operands[0] += second.operands[0];
+                second.removed = true;
+                changed = true;
+            }
+        }
+
+        return changed;
+    }
+
+    /**
+     * Instructions that only push a value, without side effects.
+     */
+    bool isPurePush(uint8_t opcode)
+    {
+        return opcode == OP_CONST || opcode == OP_GET_LOCAL ||
+               opcode == OP_GET_PARENT_LOCAL || opcode == OP_GET_GLOBAL ||
+               opcode == OP_GET_CELL || opcode == OP_LOAD_CELL;
+    }
+
+    std::set<size_t> jumpTargets(const std::vector<Instruction> &instructions)
+    {
+        std::set<size_t> targets;
+
+        for (const auto &instruction : instructions)
+        {
+            if (!instruction.removed && isJump(instruction.opcode))
+            {
+                targets.insert(liveInstruction(instructions, instruction.operands.back()));
+            }
+        }
+
+        return targets;
+    }
+
+    size_t nextLive(const std::vector<Instruction> &instructions, size_t index)
+    {
+        index++;
+
+        while (index < instructions.size() && instructions[index].removed)
+        {
+            index++;
+        }
+
+        return index;
+    }
+};
+
+#endif
@@ -0,0 +1,322 @@
+#ifndef __typeInference_h
+#define __typeInference_h
+
+#include <map>
+#include <memory>
+#include <unordered_map>
+#include <unordered_set>
+#include <vector>
+#include "../scope/scope.h"
+#include "../vm/globalVar.h"
+#include "../vm/symbolTable.h"
+
+/**
+ * Flow-insensitive type inference over the analyzed program. Finds the
+ * expressions which always evaluate to a number, so the compiler can emit
+ * the unchecked NUM_* instructions for their operations.
+ *
+ * Numeric expressions are number literals, global constants, numeric
+ * locals, `-`, `*` and `/` (which only operate on numbers), `+` of two
+ * numeric operands, and `if` (with both branches), `begin`, `var` and
+ * `set` whose value is numeric. A local is numeric when its initializer
+ * and every `set` of it are numeric: every local starts out numeric, and
+ * the ones assigned anything else are dropped until nothing changes,
+ * including by functions reading them from the parent's frame.
+ * Parameters, cells and globals are never numeric.
+ *
+ * Top-level functions only have locals of their own, so each one can be
+ * inferred on its own; `topLevelFunctions` false skips them.
+ */
+class TypeInference
+{
+public:
+    TypeInference(std::shared_ptr<Global> global,
+                  const std::map<const Exp *, std::shared_ptr<Scope>> &scopeInfo,
+                  bool topLevelFunctions = true)
+        : global(global), scopeInfo(scopeInfo), topLevelFunctions(topLevelFunctions) {}
+
+    std::unordered_set<const Exp *> numericExpressions(const Exp &program)
+    {
+        do
+        {
+            changed = false;
+            numeric.clear();
+            infer(program);
+        } while (changed);
+
+        return numeric;
+    }
+
+    /**
+     * Numeric expressions of a top-level function.
+     */
+    std::unordered_set<const Exp *> numericExpressions(const Exp &exp, const Exp &params, const Exp &body)
+    {
+        do
+        {
+            changed = false;
+            numeric.clear();
+            inferFunction(exp, params, body);
+        } while (changed);
+
+        return numeric;
+    }
+
+private:
+    /**
+     * Visits `exp` and its subexpressions. Returns whether `exp` is
+     * numeric.
+     */
+    bool infer(const Exp &exp)
+    {
+        auto isNumeric = inferType(exp);
+
+        if (isNumeric)
+        {
+            numeric.insert(&exp);
+        }
+
+        return isNumeric;
+    }
+
+    bool inferType(const Exp &exp)
+    {
+        switch (exp.type)
+        {
+        case ExpType::NUMBER:
+            return true;
+
+        case ExpType::STRING:
+            return false;
+
+        case ExpType::SYMBOL:
+            return isNumericSymbol(exp.symbol);
+
+        case ExpType::LIST:
+            break;
+        }
+
+        auto &tag = exp.list[0];
+
+        if (tag.type != ExpType::SYMBOL)
+        {
+            return inferAll(exp, 0);
+        }
+
+        switch (tag.symbol)
+        {
+        case SYM_SUB:
+        case SYM_MUL:
+        case SYM_DIV:
+            inferAll(exp, 1);
+            return true;
+
+        case SYM_ADD:
+        {
+            auto op1 = infer(exp.list[1]);
+            auto op2 = infer(exp.list[2]);
+            return op1 && op2;
+        }
+
+        case SYM_IF:
+        {
+            infer(exp.list[1]);
+            auto consequent = infer(exp.list[2]);
+
+            // Without an else branch a false test leaves no value.
+            return exp.list.size() == 4 && infer(exp.list[3]) && consequent;
+        }
+
+        case SYM_BEGIN:
+        {
+            scopes.push_back(scopeInfo.at(&exp).get());
+            bindings.emplace_back();
+
+            auto isNumeric = false;
+
+            for (size_t i = 1; i < exp.list.size(); i++)
+            {
+                isNumeric = infer(exp.list[i]);
+            }
+
+            bindings.pop_back();
+            scopes.pop_back();
+
+            return isNumeric;
+        }
+
+        case SYM_VAR:
+        {
+            auto isNumeric = infer(exp.list[2]);
+            auto symbol = exp.list[1].symbol;
+
+            if (isLocal(symbol))
+            {
+                if (candidates.insert(&exp).second)
+                {
+                    numericLocals.insert(&exp);
+                }
+
+                assign(&exp, isNumeric);
+                bindings.back()[symbol] = &exp;
+            }
+            else
+            {
+                bindings.back()[symbol] = nullptr;
+            }
+
+            return isNumeric;
+        }
+
+        case SYM_SET:
+        {
+            auto isNumeric = infer(exp.list[2]);
+
+            assign(binding(exp.list[1].symbol), isNumeric);
+
+            return isNumeric;
+        }
+
+        case SYM_DEF:
+            bindings.back()[exp.list[1].symbol] = nullptr;
+            inferFunction(exp, exp.list[2], exp.list[3]);
+            return false;
+
+        case SYM_LAMBDA:
+            inferFunction(exp, exp.list[1], exp.list[2]);
+            return false;
+
+        default:
+            // `while`, comparisons and calls.
+            return inferAll(exp, 0);
+        }
+    }
+
+    bool inferAll(const Exp &exp, size_t from)
+    {
+        for (auto i = from; i < exp.list.size(); i++)
+        {
+            infer(exp.list[i]);
+        }
+
+        return false;
+    }
+
+    void inferFunction(const Exp &exp, const Exp &params, const Exp &body)
+    {
+        auto scope = scopeInfo.at(&exp).get();
+
+        if (!topLevelFunctions && scope->parent->type == ScopeType::GLOBAL)
+        {
+            return;
+        }
+
+        scopes.push_back(scope);
+        bindings.emplace_back();
+
+        for (const auto &param : params.list)
+        {
+            bindings.back()[param.symbol] = nullptr;
+        }
+
+        infer(body);
+
+        bindings.pop_back();
+        scopes.pop_back();
+    }
+
+    bool isNumericSymbol(SymbolId symbol)
+    {
+        if (isBooleanSymbol(symbol))
+        {
+            return false;
+        }
+
+        if (isLocal(symbol))
+        {
+            auto local = binding(symbol);
+            return local != nullptr && numericLocals.count(local) != 0;
+        }
+
+        return allocType(symbol) == AllocType::GLOBAL && global->isConstant(symbol);
+    }
+
+    /**
+     * Drops `local` from the numeric locals if it is assigned a value
+     * which isn't numeric.
+     */
+    void assign(const Exp *local, bool isNumeric)
+    {
+        if (local != nullptr && !isNumeric && numericLocals.erase(local) != 0)
+        {
+            changed = true;
+        }
+    }
+
+    /**
+     * Declaration of the local `symbol` refers to in the current scope,
+     * or nullptr if it isn't a `var` local.
+     */
+    const Exp *binding(SymbolId symbol)
+    {
+        if (!isLocal(symbol))
+        {
+            return nullptr;
+        }
+
+        for (auto frame = bindings.rbegin(); frame != bindings.rend(); frame++)
+        {
+            auto local = frame->find(symbol);
+
+            if (local != frame->end())
+            {
+                return local->second;
+            }
+        }
+
+        return nullptr;
+    }
+
+    /**
+     * Stack locals, including the parent's locals read by functions which
+     * don't escape it.
+     */
+    bool isLocal(SymbolId symbol)
+    {
+        auto type = allocType(symbol);
+        return type == AllocType::LOCAL || type == AllocType::PARENT_LOCAL;
+    }
+
+    AllocType allocType(SymbolId symbol)
+    {
+        auto &allocInfo = scopes.back()->allocInfo;
+        auto info = allocInfo.find(symbol);
+
+        return info == allocInfo.end() ? AllocType::GLOBAL : info->second;
+    }
+
+    std::shared_ptr<Global> global;
+
+    const std::map<const Exp *, std::shared_ptr<Scope>> &scopeInfo;
+
+    bool topLevelFunctions;
+
+    std::vector<Scope *> scopes;
+
+    /**
+     * Names declared in each enclosing block and function, innermost
+     * last, mapped to their `var` declaration (nullptr for parameters,
+     * functions and non-local variables).
+     */
+    std::vector<std::unordered_map<SymbolId, const Exp *>> bindings;
+
+    std::unordered_set<const Exp *> candidates;
+
+    std::unordered_set<const Exp *> numericLocals;
+
+    std::unordered_set<const Exp *> numeric;
+
+    bool changed;
+};
+
+#endif
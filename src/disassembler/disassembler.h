@@ -42,7 +42,7 @@ public:
             << offset
             << "    ";
 
-        auto opcode = co->code[offset];
+        auto opcode = decodeOpcode(&co->code[offset]);
 
         switch (opcode)
         {
@@ -53,14 +53,39 @@ public:
         case OP_MUL:
         case OP_POP:
         case OP_RETURN:
+        case OP_ADD_NUM:
+        case OP_ADD_STR:
+        case OP_NUM_ADD:
+        case OP_NUM_LT:
+        case OP_NUM_GT:
+        case OP_NUM_EQ:
+        case OP_NUM_GE:
+        case OP_NUM_LE:
+        case OP_NUM_NE:
             return disassembleSimple(co, opcode, offset);
         case OP_SCOPE_EXIT:
         case OP_CALL:
+        case OP_TAIL_CALL:
+        case OP_GET_PARENT_LOCAL:
+        case OP_SET_PARENT_LOCAL:
             return disassembleWord(co, opcode, offset);
         case OP_COMPARE:
+        case OP_LT_NUM:
+        case OP_GT_NUM:
+        case OP_EQ_NUM:
+        case OP_GE_NUM:
+        case OP_LE_NUM:
+        case OP_NE_NUM:
             return disassembleCompareOp(co, opcode, offset);
         case OP_JMP:
         case OP_JMP_IF_FALSE:
+        case OP_JMP_IF_NOT_LT:
+        case OP_JMP_IF_NOT_GT:
+        case OP_JMP_IF_NOT_EQ:
+        case OP_JMP_IF_NOT_GE:
+        case OP_JMP_IF_NOT_LE:
+        case OP_JMP_IF_NOT_NE:
+        case OP_LOOP:
             return disassembleJmp(co, opcode, offset);
         case OP_CONST:
             return disassembleConst(co, opcode, offset);
@@ -76,6 +101,14 @@ public:
             return disassembleCell(co, opcode, offset);
         case OP_MAKE_FUNCTION:
             return disassembleMakeFunction(co, opcode, offset);
+        case OP_SET_CELL_POP:
+            return disassembleCell(co, opcode, offset);
+        case OP_ADD_LOCAL_LOCAL:
+            return disassembleLocalLocal(co, opcode, offset);
+        case OP_ADD_LOCAL_CONST:
+            return disassembleLocalConst(co, opcode, offset);
+        case OP_COMPARE_LOCAL_CONST_JMP_IF_FALSE:
+            return disassembleCompareLocalConstJmp(co, opcode, offset);
         default:
             DIE << "disassembleInstruction: no assembly for " << opcodeToString(opcode);
         }
@@ -86,59 +119,59 @@ public:
     }
 
 private:
-    size_t disassembleSimple(CodeObject *co, uint8_t opcode, size_t offset)
+    size_t disassembleSimple(CodeObject *co, uint8_t /* opcode */, size_t offset)
     {
-        dumpBytes(co, offset, 1);
-        printOpCode(opcode);
-        return offset + 1;
+        dumpBytes(co, offset, instructionLength(&co->code[offset]));
+        printOpCode(co, offset);
+        return offset + instructionLength(&co->code[offset]);
     }
 
-    size_t disassembleConst(CodeObject *co, uint8_t opcode, size_t offset)
+    size_t disassembleConst(CodeObject *co, uint8_t /* opcode */, size_t offset)
     {
-        dumpBytes(co, offset, 2);
-        printOpCode(opcode);
+        dumpBytes(co, offset, instructionLength(&co->code[offset]));
+        printOpCode(co, offset);
 
-        auto constIdx = co->code[offset + 1];
+        auto constIdx = operand(co, offset, 0);
 
         std::cout << (int)constIdx
                   << " ("
                   << xpValueToConstantString(co->constants[constIdx])
                   << ")";
 
-        return offset + 2;
+        return offset + instructionLength(&co->code[offset]);
     }
 
-    size_t disassembleWord(CodeObject *co, uint8_t opcode, size_t offset)
+    size_t disassembleWord(CodeObject *co, uint8_t /* opcode */, size_t offset)
     {
-        dumpBytes(co, offset, 2);
-        printOpCode(opcode);
-        std::cout << (int)co->code[offset + 1];
-        return offset + 2;
+        dumpBytes(co, offset, instructionLength(&co->code[offset]));
+        printOpCode(co, offset);
+        std::cout << (int)operand(co, offset, 0);
+        return offset + instructionLength(&co->code[offset]);
     }
 
-    size_t disassembleCompareOp(CodeObject *co, uint8_t opcode, size_t offset)
+    size_t disassembleCompareOp(CodeObject *co, uint8_t /* opcode */, size_t offset)
     {
-        dumpBytes(co, offset, 2);
-        printOpCode(opcode);
+        dumpBytes(co, offset, instructionLength(&co->code[offset]));
+        printOpCode(co, offset);
 
-        auto compareOp = co->code[offset + 1];
+        auto compareOp = operand(co, offset, 0);
 
         std::cout << (int)compareOp
                   << " ("
                   << inverseCompareOp[compareOp]
                   << ")";
 
-        return offset + 2;
+        return offset + instructionLength(&co->code[offset]);
     }
 
-    size_t disassembleJmp(CodeObject *co, uint8_t opcode, size_t offset)
+    size_t disassembleJmp(CodeObject *co, uint8_t /* opcode */, size_t offset)
     {
         std::ios_base::fmtflags f(std::cout.flags());
 
-        dumpBytes(co, offset, 3);
-        printOpCode(opcode);
+        dumpBytes(co, offset, instructionLength(&co->code[offset]));
+        printOpCode(co, offset);
 
-        uint16_t address = readWordAtOffset(co, offset + 1);
+        auto address = jumpTarget(co->code.data(), offset);
 
         std::cout << std::uppercase
                   << std::hex
@@ -150,61 +183,152 @@ private:
 
         std::cout.flags(f);
 
-        return offset + 3;
+        return offset + instructionLength(&co->code[offset]);
     }
 
-    size_t disassembleGlobal(CodeObject *co, uint8_t opcode, size_t offset)
+    size_t disassembleGlobal(CodeObject *co, uint8_t /* opcode */, size_t offset)
     {
-        dumpBytes(co, offset, 2);
-        printOpCode(opcode);
+        dumpBytes(co, offset, instructionLength(&co->code[offset]));
+        printOpCode(co, offset);
 
-        auto globalIndex = co->code[offset + 1];
+        auto globalIndex = operand(co, offset, 0);
 
         std::cout << (int)globalIndex
                   << " ("
                   << global->get(globalIndex).name
                   << ")";
 
-        return offset + 2;
+        return offset + instructionLength(&co->code[offset]);
     }
 
-    size_t disassembleLocal(CodeObject *co, uint8_t opcode, size_t offset)
+    size_t disassembleLocal(CodeObject *co, uint8_t /* opcode */, size_t offset)
     {
-        dumpBytes(co, offset, 2);
-        printOpCode(opcode);
+        dumpBytes(co, offset, instructionLength(&co->code[offset]));
+        printOpCode(co, offset);
 
-        auto localIndex = co->code[offset + 1];
+        auto localIndex = operand(co, offset, 0);
 
         std::cout << (int)localIndex
                   << " ("
-                  << co->locals[localIndex].name
+                  << localName(co, localIndex)
                   << ")";
 
-        return offset + 2;
+        return offset + instructionLength(&co->code[offset]);
     }
 
-    size_t disassembleCell(CodeObject *co, uint8_t opcode, size_t offset)
+    size_t disassembleCell(CodeObject *co, uint8_t /* opcode */, size_t offset)
     {
-        dumpBytes(co, offset, 2);
-        printOpCode(opcode);
+        dumpBytes(co, offset, instructionLength(&co->code[offset]));
+        printOpCode(co, offset);
 
-        auto cellIndex = co->code[offset + 1];
+        auto cellIndex = operand(co, offset, 0);
 
         std::cout << (int)cellIndex
                   << " ("
                   << co->cellNames[cellIndex]
                   << ")";
 
-        return offset + 2;
+        return offset + instructionLength(&co->code[offset]);
+    }
+
+    size_t disassembleLocalLocal(CodeObject *co, uint8_t /* opcode */, size_t offset)
+    {
+        dumpBytes(co, offset, instructionLength(&co->code[offset]));
+        printOpCode(co, offset);
+
+        auto localIndex1 = operand(co, offset, 0);
+        auto localIndex2 = operand(co, offset, 1);
+
+        std::cout << (int)localIndex1
+                  << " ("
+                  << localName(co, localIndex1)
+                  << "), "
+                  << (int)localIndex2
+                  << " ("
+                  << localName(co, localIndex2)
+                  << ")";
+
+        return offset + instructionLength(&co->code[offset]);
+    }
+
+    size_t disassembleLocalConst(CodeObject *co, uint8_t /* opcode */, size_t offset)
+    {
+        dumpBytes(co, offset, instructionLength(&co->code[offset]));
+        printOpCode(co, offset);
+
+        auto localIndex = operand(co, offset, 0);
+        auto constIdx = operand(co, offset, 1);
+
+        std::cout << (int)localIndex
+                  << " ("
+                  << localName(co, localIndex)
+                  << "), "
+                  << (int)constIdx
+                  << " ("
+                  << xpValueToConstantString(co->constants[constIdx])
+                  << ")";
+
+        return offset + instructionLength(&co->code[offset]);
+    }
+
+    size_t disassembleCompareLocalConstJmp(CodeObject *co, uint8_t /* opcode */, size_t offset)
+    {
+        std::ios_base::fmtflags f(std::cout.flags());
+
+        dumpBytes(co, offset, instructionLength(&co->code[offset]));
+        printOpCode(co, offset);
+
+        auto localIndex = operand(co, offset, 0);
+        auto constIdx = operand(co, offset, 1);
+        auto compareOp = operand(co, offset, 2);
+        auto address = operand(co, offset, 3);
+
+        std::cout << (int)localIndex
+                  << " ("
+                  << localName(co, localIndex)
+                  << ") "
+                  << inverseCompareOp[compareOp]
+                  << " "
+                  << (int)constIdx
+                  << " ("
+                  << xpValueToConstantString(co->constants[constIdx])
+                  << ") "
+                  << std::uppercase
+                  << std::hex
+                  << std::setfill('0')
+                  << std::right
+                  << std::setw(4)
+                  << (int)address;
+
+        std::cout.flags(f);
+
+        return offset + instructionLength(&co->code[offset]);
     }
 
     size_t disassembleMakeFunction(CodeObject *co, uint8_t opcode, size_t offset) {
         return disassembleWord(co, opcode, offset);
     }
 
-    uint16_t readWordAtOffset(CodeObject *co, size_t offset)
+    /**
+     * Locals of closed blocks are already popped from `co->locals` when
+     * the code object is disassembled.
+     */
+    std::string localName(CodeObject *co, size_t localIndex)
+    {
+        for (auto local = co->locals.rbegin(); local != co->locals.rend(); local++)
+        {
+            if (local->slot == localIndex)
+            {
+                return local->name;
+            }
+        }
+
+        return "?";
+    }
+
+    size_t operand(CodeObject *co, size_t offset, size_t index)
     {
-        return ((uint16_t)(co->code[offset] << 8) | co->code[offset + 1]);
+        return readOperand(&co->code[offset], index);
     }
 
     void dumpBytes(CodeObject *co, size_t offset, size_t count)
@@ -212,7 +336,7 @@ private:
         std::ios_base::fmtflags f(std::cout.flags());
         std::stringstream ss;
 
-        for (auto i = 0; i < count; i++)
+        for (size_t i = 0; i < count; i++)
         {
             ss << std::uppercase
                << std::hex
@@ -231,15 +355,17 @@ private:
         std::cout.flags(f);
     }
 
-    void printOpCode(uint8_t opcode)
+    void printOpCode(CodeObject *co, size_t offset)
     {
         std::ios_base::fmtflags f(std::cout.flags());
 
+        auto ip = &co->code[offset];
+
         std::cout
             << std::left
             << std::setfill(' ')
             << std::setw(20)
-            << opcodeToString(opcode)
+            << (isWide(ip) ? "WIDE " : "") + opcodeToString(decodeOpcode(ip))
             << " ";
 
         std::cout.flags(f);
@@ -253,10 +379,10 @@ private:
 std::array<std::string, 6> Disassembler::inverseCompareOp = {
     "<",
     ">",
-    "=",
-    "!=",
+    "==",
+    ">=",
     "<=",
-    "=>",
+    "!=",
 };
 
 #endif
@@ -3,7 +3,7 @@
 #include "vm/xp.h"
 #include "./vm/XPValue.h"
 
-int main(int argc, char const *argv[])
+int main()
 {
     {
         XPVM vm;
@@ -0,0 +1,270 @@
+#ifndef __XPCollector_h
+#define __XPCollector_h
+
+#include <set>
+#include <vector>
+#include "XPHeap.h"
+#include "../vm/XPValue.h"
+
+/**
+ * Garbage collector over the generational XPHeap.
+ *
+ * Minor collections promote every nursery object reachable from the
+ * roots and the remembered set into the old space, then reset the
+ * nursery. Major collections mark-sweep the old space; they run right
+ * after a minor one, so the nursery is empty at that point.
+ */
+struct XPCollector
+{
+    XPCollector(XPHeap *heap) : heap(heap) {}
+
+    // ----------------------------------------------------------------
+    // Minor collection. The VM passes every root slot to `forward`,
+    // then calls `scavenge`.
+
+    void forward(XPValue &value)
+    {
+        if (IS_OBJECT(value) && heap->isYoung(AS_OBJECT(value)))
+        {
+            value = OBJECT(promote(AS_OBJECT(value)));
+        }
+    }
+
+    template <typename T>
+    void forward(T *&object)
+    {
+        if (object != nullptr && heap->isYoung(object))
+        {
+            object = (T *)promote(object);
+        }
+    }
+
+    void scavenge()
+    {
+        for (auto &object : heap->rememberedSet)
+        {
+            object->remembered = false;
+            forwardFields(object);
+        }
+        heap->rememberedSet.clear();
+
+        while (!promoted_.empty())
+        {
+            auto object = promoted_.back();
+            promoted_.pop_back();
+            forwardFields(object);
+        }
+
+        heap->forEachYoung([](Traceable *object)
+                           {
+                               if (!object->forwarded)
+                               {
+                                   Traceable::objectsFreed++;
+                                   Traceable::bytesFreed += object->size;
+                               } });
+
+        heap->resetNursery();
+
+        Traceable::minorCycles++;
+    }
+
+    // ----------------------------------------------------------------
+    // Major collection.
+
+    void gc(const std::set<Traceable *> &roots)
+    {
+        mark(roots);
+        sweep();
+        Traceable::gcCycles++;
+    }
+
+    /**
+     * Marks every object reachable from the roots.
+     */
+    void mark(const std::set<Traceable *> &roots)
+    {
+        std::vector<Traceable *> worklist(roots.begin(), roots.end());
+
+        while (!worklist.empty())
+        {
+            auto object = worklist.back();
+            worklist.pop_back();
+
+            if (object == nullptr || object->marked)
+            {
+                continue;
+            }
+
+            object->marked = true;
+
+            for (auto &p : getPointers(object))
+            {
+                if (!p->marked)
+                {
+                    worklist.push_back(p);
+                }
+            }
+        }
+    }
+
+    /**
+     * Objects referenced from the given object.
+     */
+    std::vector<Traceable *> getPointers(const Traceable *object)
+    {
+        std::vector<Traceable *> pointers;
+
+        auto xpValue = OBJECT((Object *)object);
+
+        if (IS_CODE(xpValue))
+        {
+            for (auto &constant : AS_CODE(xpValue)->constants)
+            {
+                if (IS_OBJECT(constant))
+                {
+                    pointers.push_back((Traceable *)AS_OBJECT(constant));
+                }
+            }
+        }
+        else if (IS_FUNCTION(xpValue))
+        {
+            auto fn = AS_FUNCTION(xpValue);
+
+            pointers.push_back((Traceable *)fn->co);
+
+            for (auto &cell : fn->cells)
+            {
+                if (cell != nullptr)
+                {
+                    pointers.push_back((Traceable *)cell);
+                }
+            }
+        }
+        else if (IS_CELL(xpValue))
+        {
+            auto cell = AS_CELL(xpValue);
+
+            if (IS_OBJECT(cell->value))
+            {
+                pointers.push_back((Traceable *)AS_OBJECT(cell->value));
+            }
+        }
+
+        return pointers;
+    }
+
+    /**
+     * Frees every unmarked old object and resets the marks of the
+     * survivors.
+     */
+    void sweep()
+    {
+        auto link = &heap->oldObjects;
+
+        while (*link != nullptr)
+        {
+            auto object = *link;
+
+            if (object->marked)
+            {
+                object->marked = false;
+                link = &object->next;
+            }
+            else
+            {
+                Traceable::objectsFreed++;
+                Traceable::bytesFreed += object->size;
+
+                *link = object->next;
+                heap->freeOld(object);
+            }
+        }
+    }
+
+private:
+    /**
+     * Moves a nursery object into the old space, leaving a forwarding
+     * address behind.
+     */
+    Traceable *promote(Traceable *object)
+    {
+        if (object->forwarded)
+        {
+            return object->next;
+        }
+
+        auto memory = heap->allocateOld(object->size);
+        auto xpValue = OBJECT((Object *)object);
+        Traceable *copy;
+
+        if (IS_STRING(xpValue))
+        {
+            copy = ::new (memory) StringObject(std::move(*AS_STRING(xpValue)));
+        }
+        else if (IS_FUNCTION(xpValue))
+        {
+            copy = ::new (memory) FunctionObject(std::move(*AS_FUNCTION(xpValue)));
+        }
+        else if (IS_CELL(xpValue))
+        {
+            copy = ::new (memory) CellObject(std::move(*AS_CELL(xpValue)));
+        }
+        else if (IS_CODE(xpValue))
+        {
+            copy = ::new (memory) CodeObject(std::move(*AS_CODE(xpValue)));
+        }
+        else if (IS_NATIVE(xpValue))
+        {
+            copy = ::new (memory) NativeObject(std::move(*AS_NATIVE(xpValue)));
+        }
+        else
+        {
+            DIE << "XPCollector: can't promote unknown object.";
+        }
+
+        object->forwarded = true;
+        object->next = copy;
+
+        promoted_.push_back(copy);
+        Traceable::objectsPromoted++;
+
+        return copy;
+    }
+
+    /**
+     * Forwards the nursery references held by an old object.
+     */
+    void forwardFields(Traceable *object)
+    {
+        auto xpValue = OBJECT((Object *)object);
+
+        if (IS_CODE(xpValue))
+        {
+            for (auto &constant : AS_CODE(xpValue)->constants)
+            {
+                forward(constant);
+            }
+        }
+        else if (IS_FUNCTION(xpValue))
+        {
+            auto fn = AS_FUNCTION(xpValue);
+
+            forward(fn->co);
+
+            for (auto &cell : fn->cells)
+            {
+                forward(cell);
+            }
+        }
+        else if (IS_CELL(xpValue))
+        {
+            forward(AS_CELL(xpValue)->value);
+        }
+    }
+
+    XPHeap *heap;
+
+    std::vector<Traceable *> promoted_;
+};
+
+#endif
@@ -0,0 +1,345 @@
+#ifndef __XPHeap_h
+#define __XPHeap_h
+
+#include <cstddef>
+#include <cstdint>
+#include <iostream>
+#include <new>
+#include <vector>
+#include "../Logger.h"
+
+#define NURSERY_SIZE (256 * 1024)
+
+#define HEAP_ALIGN(size) \
+    (((size) + alignof(std::max_align_t) - 1) & ~(alignof(std::max_align_t) - 1))
+
+class XPHeap;
+
+struct Traceable
+{
+    /**
+     * The header is set up here rather than in operator new: stores to
+     * an object before its constructor runs are dead as far as the
+     * compiler is concerned.
+     */
+    Traceable();
+
+    Traceable(const Traceable &) : Traceable() {}
+
+    virtual ~Traceable() = default;
+
+    bool marked;
+
+    /**
+     * Old object already recorded in the remembered set.
+     */
+    bool remembered;
+
+    /**
+     * Nursery object already promoted; `next` holds its new address.
+     */
+    bool forwarded;
+
+    size_t size;
+
+    /**
+     * Old space: next object in the old-space list.
+     * Nursery: forwarding address once promoted.
+     */
+    Traceable *next;
+
+    static void *operator new(size_t size);
+
+    static void operator delete(void *object, size_t size);
+
+    static void cleanup();
+
+    static void printStats()
+    {
+        std::cout << "---------------------------------------\n";
+        std::cout << "Memory stats:\n\n"
+                  << "\n\n";
+        std::cout << "Objects allocated : " << std::dec << Traceable::objectCount << "\n";
+        std::cout << "Bytes allocated   : " << std::dec << Traceable::bytesAllocated << "\n\n";
+        std::cout << "Minor GC cycles   : " << std::dec << Traceable::minorCycles << "\n";
+        std::cout << "Objects promoted  : " << std::dec << Traceable::objectsPromoted << "\n";
+        std::cout << "GC cycles         : " << std::dec << Traceable::gcCycles << "\n";
+        std::cout << "Objects freed     : " << std::dec << Traceable::objectsFreed << "\n";
+        std::cout << "Bytes freed       : " << std::dec << Traceable::bytesFreed << "\n\n";
+    }
+
+    static size_t objectCount;
+
+    static size_t bytesAllocated;
+
+    static size_t minorCycles;
+
+    static size_t objectsPromoted;
+
+    static size_t gcCycles;
+
+    static size_t objectsFreed;
+
+    static size_t bytesFreed;
+
+    /**
+     * Heap of the running VM; all Traceable allocations go there. Per
+     * thread: compiler threads allocate from their own heap (see
+     * XPHeap::adopt).
+     */
+    static thread_local XPHeap *heap;
+};
+
+size_t Traceable::objectCount{0};
+
+size_t Traceable::bytesAllocated{0};
+
+size_t Traceable::minorCycles{0};
+
+size_t Traceable::objectsPromoted{0};
+
+size_t Traceable::gcCycles{0};
+
+size_t Traceable::objectsFreed{0};
+
+size_t Traceable::bytesFreed{0};
+
+thread_local XPHeap *Traceable::heap{nullptr};
+
+/**
+ * Generational heap.
+ *
+ * New objects are bump-allocated in the nursery while the VM is running
+ * bytecode. Objects allocated outside of eval (compiler constants, code
+ * objects, natives), and allocations that don't fit into the remaining
+ * nursery, go straight to the old space, which is a malloc'ed intrusive
+ * list collected by mark-sweep.
+ */
+class XPHeap
+{
+public:
+    XPHeap() : nursery((uint8_t *)::operator new(NURSERY_SIZE)),
+               top(nursery),
+               end(nursery + NURSERY_SIZE) {}
+
+    ~XPHeap()
+    {
+        cleanup();
+        ::operator delete(nursery);
+    }
+
+    void *allocate(size_t size)
+    {
+        auto alignedSize = HEAP_ALIGN(size);
+
+        if (nurseryEnabled && (size_t)(end - top) >= alignedSize)
+        {
+            auto object = top;
+            top += alignedSize;
+            account(size);
+            return object;
+        }
+
+        return allocateOld(size);
+    }
+
+    void *allocateOld(size_t size)
+    {
+        oldBytes += size;
+        account(size);
+        return ::operator new(size);
+    }
+
+    /**
+     * Called from the Traceable constructor of the object just allocated.
+     */
+    void initObject(Traceable *object)
+    {
+        object->size = lastSize;
+        object->marked = false;
+        object->remembered = false;
+        object->forwarded = false;
+        object->next = nullptr;
+
+        if (!isYoung(object))
+        {
+            object->next = oldObjects;
+            oldObjects = object;
+        }
+    }
+
+    bool isYoung(const void *object)
+    {
+        return object >= nursery && object < end;
+    }
+
+    size_t nurseryAvailable()
+    {
+        return end - top;
+    }
+
+    /**
+     * Records an old object which may now point into the nursery.
+     */
+    void writeBarrier(Traceable *owner)
+    {
+        if (owner->remembered || isYoung(owner))
+        {
+            return;
+        }
+
+        owner->remembered = true;
+        rememberedSet.push_back(owner);
+    }
+
+    /**
+     * Calls `fn` for every object in the nursery, in allocation order.
+     */
+    template <typename Fn>
+    void forEachYoung(Fn fn)
+    {
+        auto cursor = nursery;
+
+        while (cursor < top)
+        {
+            auto object = (Traceable *)cursor;
+            cursor += HEAP_ALIGN(object->size);
+            fn(object);
+        }
+    }
+
+    /**
+     * Destroys every nursery object and rewinds the bump pointer.
+     * Survivors must have been promoted before.
+     */
+    void resetNursery()
+    {
+        forEachYoung([](Traceable *object)
+                     {
+                         Traceable::objectCount--;
+                         Traceable::bytesAllocated -= object->size;
+                         object->~Traceable(); });
+
+        top = nursery;
+    }
+
+    /**
+     * Frees an old-space object (already unlinked from the list).
+     */
+    void freeOld(Traceable *object)
+    {
+        Traceable::objectCount--;
+        Traceable::bytesAllocated -= object->size;
+        oldBytes -= object->size;
+
+        object->~Traceable();
+        ::operator delete(object);
+    }
+
+    /**
+     * Moves the objects of a detached heap into this one, once the thread
+     * which allocated them is done.
+     */
+    void adopt(XPHeap &other)
+    {
+        while (other.oldObjects != nullptr)
+        {
+            auto object = other.oldObjects;
+            other.oldObjects = object->next;
+
+            object->next = oldObjects;
+            oldObjects = object;
+
+            oldBytes += object->size;
+            Traceable::objectCount++;
+            Traceable::bytesAllocated += object->size;
+        }
+
+        other.oldBytes = 0;
+    }
+
+    void cleanup()
+    {
+        resetNursery();
+
+        while (oldObjects != nullptr)
+        {
+            auto object = oldObjects;
+            oldObjects = object->next;
+            freeOld(object);
+        }
+
+        rememberedSet.clear();
+    }
+
+    /**
+     * Bump allocation is only used while bytecode runs; everything else
+     * is pretenured.
+     */
+    bool nurseryEnabled = false;
+
+    /**
+     * Heap of a compiler thread: its objects only count in the statistics
+     * once adopted.
+     */
+    bool detached = false;
+
+    Traceable *oldObjects = nullptr;
+
+    size_t oldBytes = 0;
+
+    std::vector<Traceable *> rememberedSet;
+
+private:
+    void account(size_t size)
+    {
+        lastSize = size;
+
+        if (detached)
+        {
+            return;
+        }
+
+        Traceable::objectCount++;
+        Traceable::bytesAllocated += size;
+    }
+
+    size_t lastSize = 0;
+
+    uint8_t *nursery;
+
+    uint8_t *top;
+
+    uint8_t *end;
+};
+
+Traceable::Traceable()
+{
+    Traceable::heap->initObject(this);
+}
+
+void *Traceable::operator new(size_t size)
+{
+    if (Traceable::heap == nullptr)
+    {
+        DIE << "Traceable: no heap to allocate from.";
+    }
+
+    return Traceable::heap->allocate(size);
+}
+
+/**
+ * Objects are freed by the heap (sweep, nursery reset, cleanup), never
+ * through delete.
+ */
+void Traceable::operator delete(void * /* object */, size_t /* size */) {}
+
+void Traceable::cleanup()
+{
+    if (Traceable::heap != nullptr)
+    {
+        Traceable::heap->cleanup();
+    }
+}
+
+#endif
@@ -0,0 +1,433 @@
+#ifndef __XPImage_h
+#define __XPImage_h
+
+#include <cstdint>
+#include <cstring>
+#include <fstream>
+#include <map>
+#include <set>
+#include <string>
+#include <vector>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include "../Logger.h"
+#include "../vm/XPValue.h"
+#include "../vm/globalVar.h"
+
+/**
+ * Compiled program image (.xpc).
+ *
+ * Layout, all integers are little-endian u32:
+ *
+ *   header:  "XPC\0", version, code object count, global count
+ *   globals: name, value, constant (0 or 1)
+ *   code:    name, arity, freeCount, maxStack,
+ *            cell names (count, names), constants (count, values),
+ *            bytecode (size, bytes)
+ *
+ * Strings are a length followed by the bytes. Values are a kind byte
+ * followed by the payload (see ImageValueKind). Code object 0 is main.
+ *
+ * Loading maps the file and points each CodeObject at its bytecode in
+ * the mapping, so nothing is parsed or compiled, and the bytecode isn't
+ * copied.
+ */
+#define XP_IMAGE_MAGIC "XPC"
+
+#define XP_IMAGE_VERSION 2
+
+enum class ImageValueKind : uint8_t
+{
+    NUMBER,
+    BOOLEAN,
+    STRING,
+    CODE,
+    FUNCTION,
+    NATIVE,
+};
+
+class ImageWriter
+{
+public:
+    /**
+     * Writes the code objects reachable from `main`, and the global table.
+     */
+    void write(const std::string &path, FunctionObject *main, const Global &global)
+    {
+        collectCode(main->co);
+
+        bytes.insert(bytes.end(), XP_IMAGE_MAGIC, XP_IMAGE_MAGIC + 4);
+        writeU32(XP_IMAGE_VERSION);
+        writeU32(codeObjects.size());
+        writeU32(global.globals.size());
+
+        for (const auto &globalVar : global.globals)
+        {
+            writeString(globalVar.name);
+            writeValue(globalVar.value);
+            writeU32(globalVar.constant);
+        }
+
+        for (auto co : codeObjects)
+        {
+            writeString(co->name);
+            writeU32(co->arity);
+            writeU32(co->freeCount);
+            writeU32(co->maxStack);
+
+            writeU32(co->cellNames.size());
+            for (const auto &cellName : co->cellNames)
+            {
+                writeString(cellName);
+            }
+
+            writeU32(co->constants.size());
+            for (const auto &constant : co->constants)
+            {
+                writeValue(constant);
+            }
+
+            writeU32(co->code.size());
+            bytes.insert(bytes.end(), co->code.begin(), co->code.end());
+        }
+
+        std::ofstream file(path, std::ios::binary | std::ios::trunc);
+
+        if (!file.write((const char *)bytes.data(), bytes.size()))
+        {
+            DIE << "ImageWriter: can't write " << path;
+        }
+    }
+
+private:
+    void collectCode(CodeObject *co)
+    {
+        if (codeIndices.count(co) != 0)
+        {
+            return;
+        }
+
+        codeIndices[co] = codeObjects.size();
+        codeObjects.push_back(co);
+
+        for (const auto &constant : co->constants)
+        {
+            if (IS_CODE(constant))
+            {
+                collectCode(AS_CODE(constant));
+            }
+            else if (IS_FUNCTION(constant))
+            {
+                collectCode(AS_FUNCTION(constant)->co);
+            }
+        }
+    }
+
+    void writeValue(const XPValue &value)
+    {
+        if (IS_NUMBER(value))
+        {
+            auto number = AS_NUMBER(value);
+            uint8_t raw[sizeof(double)];
+            memcpy(raw, &number, sizeof(double));
+
+            writeKind(ImageValueKind::NUMBER);
+            bytes.insert(bytes.end(), raw, raw + sizeof(double));
+        }
+        else if (IS_BOOLEAN(value))
+        {
+            writeKind(ImageValueKind::BOOLEAN);
+            bytes.push_back(AS_BOOLEAN(value));
+        }
+        else if (IS_STRING(value))
+        {
+            writeKind(ImageValueKind::STRING);
+            writeString(AS_CPPSTRING(value));
+        }
+        else if (IS_CODE(value))
+        {
+            writeKind(ImageValueKind::CODE);
+            writeU32(codeIndices.at(AS_CODE(value)));
+        }
+        else if (IS_FUNCTION(value))
+        {
+            writeKind(ImageValueKind::FUNCTION);
+            writeU32(codeIndices.at(AS_FUNCTION(value)->co));
+        }
+        else if (IS_NATIVE(value))
+        {
+            // Natives are bound by name to the loading VM's ones.
+            writeKind(ImageValueKind::NATIVE);
+            writeString(AS_NATIVE(value)->name);
+        }
+        else
+        {
+            DIE << "ImageWriter: can't serialize " << value;
+        }
+    }
+
+    void writeKind(ImageValueKind kind)
+    {
+        bytes.push_back((uint8_t)kind);
+    }
+
+    void writeU32(uint32_t value)
+    {
+        for (auto i = 0; i < 4; i++)
+        {
+            bytes.push_back((value >> (8 * i)) & 0xff);
+        }
+    }
+
+    void writeString(const std::string &string)
+    {
+        writeU32(string.size());
+        bytes.insert(bytes.end(), string.begin(), string.end());
+    }
+
+    std::vector<uint8_t> bytes;
+
+    std::vector<CodeObject *> codeObjects;
+
+    std::map<CodeObject *, size_t> codeIndices;
+};
+
+/**
+ * A mapped image. The mapping is private and copy-on-write, and must
+ * outlive every code object loaded from it.
+ */
+class XPImage
+{
+public:
+    XPImage(const std::string &path)
+    {
+        auto fd = open(path.c_str(), O_RDONLY);
+
+        if (fd == -1)
+        {
+            DIE << "XPImage: can't open " << path;
+        }
+
+        struct stat info;
+
+        if (fstat(fd, &info) != 0 || info.st_size == 0)
+        {
+            close(fd);
+            DIE << "XPImage: can't read " << path;
+        }
+
+        size = info.st_size;
+
+        auto memory = mmap(nullptr, size, PROT_READ | PROT_WRITE, MAP_PRIVATE, fd, 0);
+        close(fd);
+
+        if (memory == MAP_FAILED)
+        {
+            DIE << "XPImage: can't map " << path;
+        }
+
+        begin = (uint8_t *)memory;
+        cursor = begin;
+        end = begin + size;
+    }
+
+    ~XPImage()
+    {
+        munmap(begin, size);
+    }
+
+    XPImage(const XPImage &) = delete;
+
+    XPImage &operator=(const XPImage &) = delete;
+
+    /**
+     * Builds the code objects and installs the image's global table in
+     * `global`. Returns main; `objects` receives every object created,
+     * which the VM keeps as GC roots.
+     */
+    FunctionObject *load(Global &global, std::set<Traceable *> &objects)
+    {
+        cursor = begin;
+
+        if (remaining() < 4 || memcmp(cursor, XP_IMAGE_MAGIC, 4) != 0)
+        {
+            DIE << "XPImage: not an .xpc image.";
+        }
+        cursor += 4;
+
+        auto version = readU32();
+
+        if (version != XP_IMAGE_VERSION)
+        {
+            DIE << "XPImage: unsupported image version " << version;
+        }
+
+        auto codeCount = readU32();
+        auto globalCount = readU32();
+
+        if (codeCount == 0 || codeCount > remaining())
+        {
+            DIE << "XPImage: corrupt code object count " << codeCount;
+        }
+
+        codeObjects.clear();
+
+        for (size_t i = 0; i < codeCount; i++)
+        {
+            auto co = AS_CODE(ALLOC_CODE("", 0));
+            codeObjects.push_back(co);
+            objects.insert((Traceable *)co);
+        }
+
+        std::vector<GlobalVar> globals;
+        globals.reserve(globalCount);
+
+        for (size_t i = 0; i < globalCount; i++)
+        {
+            auto name = readString();
+            auto value = readValue(global, objects);
+            globals.push_back({name, value, readU32() != 0});
+        }
+
+        for (auto co : codeObjects)
+        {
+            co->name = readString();
+            co->arity = readU32();
+            co->freeCount = readU32();
+            co->maxStack = readU32();
+
+            auto cellCount = readU32();
+            co->cellNames.reserve(cellCount);
+
+            for (size_t i = 0; i < cellCount; i++)
+            {
+                co->addCell(readString());
+            }
+
+            auto constantCount = readU32();
+            co->constants.reserve(constantCount);
+
+            for (size_t i = 0; i < constantCount; i++)
+            {
+                co->addConstant(readValue(global, objects));
+            }
+
+            auto codeSize = readU32();
+            need(codeSize);
+
+            co->entry = cursor;
+            cursor += codeSize;
+        }
+
+        global.assign(std::move(globals));
+
+        auto main = AS_FUNCTION(ALLOC_FUNCTION(codeObjects[0]));
+        objects.insert((Traceable *)main);
+
+        return main;
+    }
+
+private:
+    XPValue readValue(Global &global, std::set<Traceable *> &objects)
+    {
+        need(1);
+
+        switch ((ImageValueKind)*cursor++)
+        {
+        case ImageValueKind::NUMBER:
+        {
+            double number;
+            need(sizeof(double));
+            memcpy(&number, cursor, sizeof(double));
+            cursor += sizeof(double);
+            return NUMBER(number);
+        }
+        case ImageValueKind::BOOLEAN:
+            need(1);
+            return BOOLEAN(*cursor++ != 0);
+        case ImageValueKind::STRING:
+        {
+            auto string = ALLOC_STRING(readString());
+            objects.insert((Traceable *)AS_OBJECT(string));
+            return string;
+        }
+        case ImageValueKind::CODE:
+            return OBJECT(codeObject(readU32()));
+        case ImageValueKind::FUNCTION:
+        {
+            auto fn = ALLOC_FUNCTION(codeObject(readU32()));
+            objects.insert((Traceable *)AS_OBJECT(fn));
+            return fn;
+        }
+        case ImageValueKind::NATIVE:
+        {
+            auto name = readString();
+            auto index = global.getGlobalIndex(name);
+
+            if (index == -1 || !IS_NATIVE(global.get(index).value))
+            {
+                DIE << "XPImage: unknown native " << name;
+            }
+
+            return global.get(index).value;
+        }
+        default:
+            DIE << "XPImage: corrupt value.";
+        }
+
+        return NUMBER(0);
+    }
+
+    CodeObject *codeObject(size_t index)
+    {
+        if (index >= codeObjects.size())
+        {
+            DIE << "XPImage: corrupt code index " << index;
+        }
+        return codeObjects[index];
+    }
+
+    uint32_t readU32()
+    {
+        need(4);
+        uint32_t value = cursor[0] | (cursor[1] << 8) | (cursor[2] << 16) | ((uint32_t)cursor[3] << 24);
+        cursor += 4;
+        return value;
+    }
+
+    std::string readString()
+    {
+        auto length = readU32();
+        need(length);
+        std::string string((const char *)cursor, length);
+        cursor += length;
+        return string;
+    }
+
+    size_t remaining()
+    {
+        return end - cursor;
+    }
+
+    void need(size_t count)
+    {
+        if (remaining() < count)
+        {
+            DIE << "XPImage: truncated image.";
+        }
+    }
+
+    uint8_t *begin;
+
+    uint8_t *cursor;
+
+    uint8_t *end;
+
+    size_t size;
+
+    std::vector<CodeObject *> codeObjects;
+};
+
+#endif
@@ -1,26 +1,23 @@
 /**
- * LR parser for C++ generated by the Syntax tool.
+ * LR parser for C++, in the format of the Syntax tool's LALR1 parsers.
  *
  * https://www.npmjs.com/package/syntax-cli
  *
- *   npm install -g syntax-cli
+ * Generated from XPGrammar.bnf and the XPParser.h.in template: edit those
+ * instead, and regenerate with
  *
- *   syntax-cli --help
- *
- * To regenerate run:
- *
- *   syntax-cli \
- *     --grammar ~/path-to-grammar-file \
- *     --mode <parsing-mode> \
- *     --output ~/ParserClassName.h
+ *   python3 src/parser/generateParser.py
  */
 #ifndef __Syntax_LR_Parser_h
 #define __Syntax_LR_Parser_h
 
+#ifdef __clang__
 #pragma clang diagnostic push
 #pragma clang diagnostic ignored "-Wunused-private-field"
+#endif
 
 #include <assert.h>
+#include <algorithm>
 #include <array>
 #include <iostream>
 #include <map>
@@ -28,6 +25,7 @@
 #include <regex>
 #include <sstream>
 #include <string>
+#include <string_view>
 #include <vector>
 
 // ------------------------------------
@@ -50,6 +48,10 @@
 //   }
 //
 // clang-format off
+#include <deque>
+
+#include "../vm/symbolTable.h"
+
 /**
  * Expression type.
  */
@@ -60,33 +62,135 @@ enum class ExpType {
   LIST,
 };
 
+struct Exp;
+
+/**
+ * Elements of a list: a span of an ExpArena.
+ */
+struct ExpList {
+  Exp *items = nullptr;
+  size_t count = 0;
+
+  size_t size() const { return count; }
+  Exp &operator[](size_t i) const;
+  Exp *begin() const { return items; }
+  Exp *end() const;
+};
+
 /**
- * Expression.
+ * Expression. Symbols are interned, and the text of strings and the
+ * lists are kept in an ExpArena, so expressions are small and copied
+ * without allocating.
  */
 struct Exp {
   ExpType type;
 
   int number;
-  std::string string;
-  std::vector<Exp> list;
+
+  // Symbols: the interned name.
+  SymbolId symbol;
+
+  // Strings: the text, in the arena of the AST.
+  const std::string *text;
+
+  ExpList list;
+
+  Exp() : type(ExpType::LIST), number(0), symbol(0), text(nullptr) {}
 
   // Numbers:
-  Exp(int number) : type(ExpType::NUMBER), number(number) {}
-
-  // Strings, Symbols:
-  Exp(std::string& strVal) {
-    if (strVal[0] == '"') {
-      type = ExpType::STRING;
-      string = strVal.substr(1, strVal.size() - 2);
-    } else {
-      type = ExpType::SYMBOL;
-      string = strVal;
+  Exp(int number)
+      : type(ExpType::NUMBER), number(number), symbol(0), text(nullptr) {}
+
+  // Strings:
+  Exp(const std::string *text)
+      : type(ExpType::STRING), number(0), symbol(0), text(text) {}
+
+  // Symbols:
+  Exp(std::string_view name)
+      : type(ExpType::SYMBOL), number(0),
+        symbol(internSymbol(std::string(name))), text(nullptr) {}
+
+  // Lists:
+  Exp(ExpList list)
+      : type(ExpType::LIST), number(0), symbol(0), text(nullptr), list(list) {}
+
+  /**
+   * Text of a string, or name of a symbol.
+   */
+  const std::string &string() const {
+    return type == ExpType::STRING ? *text : symbols().name(symbol);
+  }
+};
+
+inline Exp &ExpList::operator[](size_t i) const { return items[i]; }
+
+inline Exp *ExpList::end() const { return items + count; }
+
+/**
+ * Storage of the lists and string literals of ASTs. Its blocks never
+ * move, so expressions can be referred to by address (the compiler keys
+ * its analyses by `const Exp *`). String literals aren't interned: they
+ * live as long as their AST, so a long-running VM which parses many
+ * programs (see XPVM::execStream) doesn't keep them all.
+ */
+class ExpArena {
+public:
+  /**
+   * Moves `entries` from `from` on into a new list.
+   */
+  ExpList list(std::vector<Exp> &entries, size_t from = 0) {
+    auto count = entries.size() - from;
+
+    if (count == 0) {
+      return ExpList{};
     }
+
+    auto items = allocate(count);
+
+    std::move(entries.begin() + from, entries.end(), items);
+    entries.resize(from);
+
+    return ExpList{items, count};
   }
 
-  // Lists:
-  Exp(std::vector<Exp> list) : type(ExpType::LIST), list(list) {}
+  /**
+   * Copies the text of a string literal token, without its quotes.
+   */
+  const std::string *string(std::string_view token) {
+    strings.emplace_back(token.substr(1, token.size() - 2));
+    return &strings.back();
+  }
+
+  void clear() {
+    blocks.clear();
+    strings.clear();
+    used = 0;
+    capacity = 0;
+  }
+
+private:
+  static constexpr size_t BLOCK_SIZE = 4096;
+
+  Exp *allocate(size_t count) {
+    if (used + count > capacity) {
+      capacity = std::max(count, BLOCK_SIZE);
+      blocks.push_back(std::make_unique<Exp[]>(capacity));
+      used = 0;
+    }
+
+    auto items = blocks.back().get() + used;
+    used += count;
+
+    return items;
+  }
+
+  std::vector<std::unique_ptr<Exp[]>> blocks;
+
+  std::deque<std::string> strings;
+
+  size_t used = 0;
 
+  size_t capacity = 0;
 };
 
 using Value = Exp; // clang-format on
@@ -125,12 +229,12 @@ enum class TokenType {
   };
 
   // ------------------------------------------------------------------
-  // Token.
+  // Token: a plain value, whose text is the range of the source between
+  // its offsets (see Tokenizer::text).
 
   struct Token
   {
     TokenType type;
-    std::string value;
 
     int startOffset;
     int endOffset;
@@ -140,8 +244,6 @@ enum class TokenType {
     int endColumn;
   };
 
-  using SharedToken = std::shared_ptr<Token>;
-
   typedef TokenType (*LexRuleHandler)(const Tokenizer &, const std::string &);
 
   // ------------------------------------------------------------------
@@ -196,7 +298,7 @@ enum class TokenType {
     /**
      * Whether there are still tokens in the stream.
      */
-    inline bool hasMoreTokens() { return cursor_ <= str_.length(); }
+    inline bool hasMoreTokens() { return cursor_ <= (int)str_.length(); }
 
     /**
      * Returns current tokenizing state.
@@ -226,7 +328,7 @@ enum class TokenType {
     /**
      * Returns next token.
      */
-    SharedToken getNextToken()
+    Token getNextToken()
     {
       if (!hasMoreTokens())
       {
@@ -234,6 +336,11 @@ enum class TokenType {
         return toToken(TokenType::__EOF);
       }
 
+      if (!regexRules)
+      {
+        return scanToken_();
+      }
+
       auto strSlice = str_.substr(cursor_);
 
       auto lexRulesForState = lexRulesByStartConditions_.at(getCurrentState());
@@ -282,20 +389,34 @@ enum class TokenType {
     /**
      * Whether the cursor is at the EOF.
      */
-    inline bool isEOF() { return cursor_ == str_.length(); }
+    inline bool isEOF() { return cursor_ == (int)str_.length(); }
 
-    SharedToken toToken(TokenType tokenType)
+    Token toToken(TokenType tokenType)
     {
-      return std::shared_ptr<Token>(new Token{
+      return Token{
           .type = tokenType,
-          .value = yytext,
           .startOffset = tokenStartOffset_,
           .endOffset = tokenEndOffset_,
           .startLine = tokenStartLine_,
           .endLine = tokenEndLine_,
           .startColumn = tokenStartColumn_,
           .endColumn = tokenEndColumn_,
-      });
+      };
+    }
+
+    /**
+     * Text of a token, in the tokenizing string: valid until the next
+     * initString.
+     */
+    std::string_view text(const Token &token) const
+    {
+      if (token.type == TokenType::__EOF)
+      {
+        return __EOF;
+      }
+
+      return std::string_view(str_).substr(token.startOffset,
+                                           token.endOffset - token.startOffset);
     }
 
     /**
@@ -329,11 +450,168 @@ enum class TokenType {
     }
 
     /**
-     * Matched text.
+     * Tokenize with the regex rules instead of the hand-written scanner
+     * (scanToken_), e.g. to check that both return the same tokens. On in
+     * builds with XP_REGEX_TOKENIZER defined.
+     */
+#ifdef XP_REGEX_TOKENIZER
+    bool regexRules = true;
+#else
+    bool regexRules = false;
+#endif
+
+    /**
+     * Matched text, passed to the handlers of the regex rules. The
+     * hand-written scanner doesn't copy the tokens' text (see text).
      */
     std::string yytext;
 
+    /**
+     * Character classes of the regex rules, in the "C" locale. FormReader
+     * splits programs into forms with them too.
+     */
+    static bool isSpace(char c)
+    {
+      return c == ' ' || (c >= '\t' && c <= '\r');
+    }
+
+    static bool isDigit(char c)
+    {
+      return c >= '0' && c <= '9';
+    }
+
+    static bool isSymbolChar(char c)
+    {
+      return (c >= 'a' && c <= 'z') || (c >= 'A' && c <= 'Z') || isDigit(c) ||
+             c == '_' || c == '-' || c == '+' || c == '*' || c == '=' ||
+             c == '!' || c == '<' || c == '>' || c == '/';
+    }
+
   private:
+    /**
+     * Hand-written scanner for the lexical grammar of XPGrammar.bnf, used
+     * instead of the regex rules unless regexRules is set.
+     * Scans the string in place, trying the rules in the same order as
+     * the regex tokenizer (the first rule matching wins), so it returns
+     * the same tokens and locations.
+     */
+    Token scanToken_()
+    {
+      for (;;)
+      {
+        if (isEOF())
+        {
+          cursor_++;
+          yytext = __EOF;
+          return toToken(TokenType::__EOF);
+        }
+
+        auto length = (int)str_.length();
+        auto start = cursor_;
+        auto c = str_[start];
+        auto next = start + 1 < length ? str_[start + 1] : '\0';
+        auto end = start + 1;
+
+        TokenType tokenType;
+        size_t close;
+
+        if (c == '(')
+        {
+          tokenType = TokenType::TOKEN_TYPE_7;
+        }
+        else if (c == ')')
+        {
+          tokenType = TokenType::TOKEN_TYPE_8;
+        }
+        // `.` doesn't match line terminators.
+        else if (c == '/' && next == '/')
+        {
+          while (end < length && str_[end] != '\n' && str_[end] != '\r')
+          {
+            end++;
+          }
+
+          tokenType = TokenType::__EMPTY;
+        }
+        // An unterminated comment is a symbol.
+        else if (c == '/' && next == '*' &&
+                 (close = str_.find("*/", start + 2)) != std::string::npos)
+        {
+          end = close + 2;
+          tokenType = TokenType::__EMPTY;
+        }
+        else if (isSpace(c))
+        {
+          while (end < length && isSpace(str_[end]))
+          {
+            end++;
+          }
+
+          tokenType = TokenType::__EMPTY;
+        }
+        else if (c == '"' && (close = str_.find('"', start + 1)) != std::string::npos)
+        {
+          end = close + 1;
+          tokenType = TokenType::STRING;
+        }
+        else if (isDigit(c))
+        {
+          while (end < length && isDigit(str_[end]))
+          {
+            end++;
+          }
+
+          tokenType = TokenType::NUMBER;
+        }
+        else if (isSymbolChar(c))
+        {
+          while (end < length && isSymbolChar(str_[end]))
+          {
+            end++;
+          }
+
+          tokenType = TokenType::SYMBOL;
+        }
+        else
+        {
+          throwUnexpectedToken(std::string(1, c), currentLine_, currentColumn_);
+        }
+
+        captureLocations_(start, end);
+        cursor_ = end;
+
+        if (tokenType != TokenType::__EMPTY)
+        {
+          return toToken(tokenType);
+        }
+      }
+    }
+
+    /**
+     * Captures the locations of the token between the `start` and `end`
+     * offsets of the string, like captureLocations_ below.
+     */
+    void captureLocations_(int start, int end)
+    {
+      tokenStartOffset_ = start;
+      tokenStartLine_ = currentLine_;
+      tokenStartColumn_ = start - currentLineBeginOffset_;
+
+      for (auto i = start; i < end; i++)
+      {
+        if (str_[i] == '\n')
+        {
+          currentLine_++;
+          currentLineBeginOffset_ = i + 1;
+        }
+      }
+
+      tokenEndOffset_ = end;
+      tokenEndLine_ = currentLine_;
+      tokenEndColumn_ = end - currentLineBeginOffset_;
+      currentColumn_ = tokenEndColumn_;
+    }
+
     /**
      * Captures token locations.
      */
@@ -352,7 +630,7 @@ enum class TokenType {
       std::stringstream ss{matched};
       std::string lineStr;
       std::getline(ss, lineStr, '\n');
-      while (ss.tellg() > 0 && ss.tellg() <= len)
+      while (ss.tellg() > 0 && ss.tellg() <= (std::streamoff)len)
       {
         currentLine_++;
         currentLineBeginOffset_ = tokenStartOffset_ + ss.tellg();
@@ -420,35 +698,35 @@ enum class TokenType {
   std::string Tokenizer::__EOF("$");
 
   // clang-format off
-inline TokenType _lexRule1(const Tokenizer& tokenizer, const std::string& yytext) {
+inline TokenType _lexRule1(const Tokenizer& /* tokenizer */, const std::string& /* yytext */) {
 return TokenType::TOKEN_TYPE_7;
 }
 
-inline TokenType _lexRule2(const Tokenizer& tokenizer, const std::string& yytext) {
+inline TokenType _lexRule2(const Tokenizer& /* tokenizer */, const std::string& /* yytext */) {
 return TokenType::TOKEN_TYPE_8;
 }
 
-inline TokenType _lexRule3(const Tokenizer& tokenizer, const std::string& yytext) {
+inline TokenType _lexRule3(const Tokenizer& /* tokenizer */, const std::string& /* yytext */) {
 return TokenType::__EMPTY;
 }
 
-inline TokenType _lexRule4(const Tokenizer& tokenizer, const std::string& yytext) {
+inline TokenType _lexRule4(const Tokenizer& /* tokenizer */, const std::string& /* yytext */) {
 return TokenType::__EMPTY;
 }
 
-inline TokenType _lexRule5(const Tokenizer& tokenizer, const std::string& yytext) {
+inline TokenType _lexRule5(const Tokenizer& /* tokenizer */, const std::string& /* yytext */) {
 return TokenType::__EMPTY;
 }
 
-inline TokenType _lexRule6(const Tokenizer& tokenizer, const std::string& yytext) {
+inline TokenType _lexRule6(const Tokenizer& /* tokenizer */, const std::string& /* yytext */) {
 return TokenType::STRING;
 }
 
-inline TokenType _lexRule7(const Tokenizer& tokenizer, const std::string& yytext) {
+inline TokenType _lexRule7(const Tokenizer& /* tokenizer */, const std::string& /* yytext */) {
 return TokenType::NUMBER;
 }
 
-inline TokenType _lexRule8(const Tokenizer& tokenizer, const std::string& yytext) {
+inline TokenType _lexRule8(const Tokenizer& /* tokenizer */, const std::string& /* yytext */) {
 return TokenType::SYMBOL;
 }
   // clang-format on
@@ -489,6 +767,7 @@ std::map<TokenizerState, std::vector<size_t>> Tokenizer::lexRulesByStartConditio
    */
   enum class TE
   {
+    Error,
     Accept,
     Shift,
     Reduce,
@@ -496,7 +775,7 @@ std::map<TokenizerState, std::vector<size_t>> Tokenizer::lexRulesByStartConditio
   };
 
   /**
-   * Parsing table entry.
+   * Parsing table entry. Empty entries ({}) are errors.
    */
   struct TableEntry
   {
@@ -525,9 +804,13 @@ class XPParser;
     ProductionHandler handler;
   };
 
-  // Key: Encoded symbol (terminal or non-terminal) index
+  // clang-format off
+  static constexpr size_t COLUMNS_COUNT = 10;
+  // clang-format on
+
+  // Index: Encoded symbol (terminal or non-terminal)
   // Value: TableEntry
-  using Row = std::map<int, TableEntry>;
+  using Row = std::array<TableEntry, COLUMNS_COUNT>;
 
   /**
    * Parser class.
@@ -542,9 +825,9 @@ class XPParser {
     std::vector<Value> valuesStack;
 
     /**
-     * Token values stack.
+     * Token values stack: the tokens' text, in the string being parsed.
      */
-    std::vector<std::string> tokensStack;
+    std::vector<std::string_view> tokensStack;
 
     /**
      * Parsing states stack.
@@ -556,6 +839,19 @@ class XPParser {
      */
     Tokenizer tokenizer;
 
+    /**
+     * Lists of the last parsed program. Cleared by parse(), so an AST is
+     * only valid until the next parse.
+     */
+    ExpArena arena;
+
+    /**
+     * Entries of the lists being parsed, innermost list last. A list's
+     * entries are moved into the arena once it's closed, so the entries
+     * aren't copied as the list grows.
+     */
+    std::vector<Exp> listEntries;
+
     /**
      * Previous state to calculate the next one.
      */
@@ -574,6 +870,8 @@ class XPParser {
       tokenizer.initString(str);
 
       // Initialize the stacks.
+      arena.clear();
+      listEntries.clear();
       valuesStack.clear();
       tokensStack.clear();
       statesStack.clear();
@@ -582,31 +880,28 @@ class XPParser {
       statesStack.push_back(0);
 
       auto token = tokenizer.getNextToken();
-      auto shiftedToken = token;
 
       // Main parsing loop.
       for (;;)
       {
         auto state = statesStack.back();
-        auto column = (int)token->type;
+        auto column = (int)token.type;
+        auto entry = table_[state][column];
 
-        if (table_[state].count(column) == 0)
+        if (entry.type == TE::Error)
         {
           throwUnexpectedToken(token);
         }
 
-        auto entry = table_[state].at(column);
-
         // Shift a token, go to state.
         if (entry.type == TE::Shift)
         {
           // Push token.
-          tokensStack.push_back(token->value);
+          tokensStack.push_back(tokenizer.text(token));
 
           // Push next state number: "s5" -> 5
           statesStack.push_back(entry.value);
 
-          shiftedToken = token;
           token = tokenizer.getNextToken();
         }
 
@@ -614,9 +909,7 @@ class XPParser {
         else if (entry.type == TE::Reduce)
         {
           auto productionNumber = entry.value;
-          auto production = productions_[productionNumber];
-
-          tokenizer.yytext = shiftedToken->value;
+          auto &production = productions_[productionNumber];
 
           auto rhsLength = production.rhsLength;
           while (rhsLength > 0)
@@ -631,7 +924,7 @@ class XPParser {
           auto previousState = statesStack.back();
 
           auto symbolToReduceWith = production.opcode;
-          auto nextStateEntry = table_[previousState].at(symbolToReduceWith);
+          auto nextStateEntry = table_[previousState][symbolToReduceWith];
           assert(nextStateEntry.type == TE::Transit);
 
           statesStack.push_back(nextStateEntry.value);
@@ -669,16 +962,16 @@ class XPParser {
     /**
      * Throws parser error on unexpected token.
      */
-    [[noreturn]] void throwUnexpectedToken(SharedToken token)
+    [[noreturn]] void throwUnexpectedToken(const Token &token)
     {
-      if (token->type == TokenType::__EOF && !tokenizer.hasMoreTokens())
+      if (token.type == TokenType::__EOF && !tokenizer.hasMoreTokens())
       {
         std::string errMsg = "Unexpected end of input.\n";
         std::cerr << errMsg;
         throw std::runtime_error(errMsg.c_str());
       }
-      tokenizer.throwUnexpectedToken(token->value, token->startLine,
-                                     token->startColumn);
+      tokenizer.throwUnexpectedToken(std::string(tokenizer.text(token)),
+                                     token.startLine, token.startColumn);
     }
 
     // clang-format off
@@ -686,7 +979,7 @@ class XPParser {
   static std::array<Production, PRODUCTIONS_COUNT> productions_;
 
   static constexpr size_t ROWS_COUNT = 11;
-  static std::array<Row, ROWS_COUNT> table_;
+  static const std::array<Row, ROWS_COUNT> table_;
     // clang-format on
   };
 
@@ -731,7 +1024,7 @@ void _handler4(yyparse& parser) {
 // Semantic action prologue.
 auto _1 = POP_T();
 
-auto __ = Exp(std::stoi(_1)) ;
+auto __ = Exp(std::stoi(std::string(_1))) ;
 
  // Semantic action epilogue.
 PUSH_VR();
@@ -742,7 +1035,7 @@ void _handler5(yyparse& parser) {
 // Semantic action prologue.
 auto _1 = POP_T();
 
-auto __ = Exp(_1) ;
+auto __ = Exp(parser.arena.string(_1)) ;
 
  // Semantic action epilogue.
 PUSH_VR();
@@ -766,7 +1059,7 @@ parser.tokensStack.pop_back();
 auto _2 = POP_V();
 parser.tokensStack.pop_back();
 
-auto __ = _2 ;
+auto __ = Exp(parser.arena.list(parser.listEntries, _2.number)) ;
 
  // Semantic action epilogue.
 PUSH_VR();
@@ -777,7 +1070,7 @@ void _handler8(yyparse& parser) {
 // Semantic action prologue.
 
 
-auto __ = Exp(std::vector<Exp>{}) ;
+auto __ = Exp((int)parser.listEntries.size()) ;
 
  // Semantic action epilogue.
 PUSH_VR();
@@ -789,7 +1082,7 @@ void _handler9(yyparse& parser) {
 auto _2 = POP_V();
 auto _1 = POP_V();
 
-_1.list.push_back(_2); auto __ = _1 ;
+parser.listEntries.push_back(_2); auto __ = _1 ;
 
  // Semantic action epilogue.
 PUSH_VR();
@@ -813,21 +1106,25 @@ std::array<Production, yyparse::PRODUCTIONS_COUNT> yyparse::productions_ = {{{-1
   // Parsing table.
 
   // clang-format off
-std::array<Row, yyparse::ROWS_COUNT> yyparse::table_ = {
-    Row {{0, {TE::Transit, 1}}, {1, {TE::Transit, 2}}, {2, {TE::Transit, 3}}, {4, {TE::Shift, 4}}, {5, {TE::Shift, 5}}, {6, {TE::Shift, 6}}, {7, {TE::Shift, 7}}},
-    Row {{9, {TE::Accept, 0}}},
-    Row {{4, {TE::Reduce, 1}}, {5, {TE::Reduce, 1}}, {6, {TE::Reduce, 1}}, {7, {TE::Reduce, 1}}, {8, {TE::Reduce, 1}}, {9, {TE::Reduce, 1}}},
-    Row {{4, {TE::Reduce, 2}}, {5, {TE::Reduce, 2}}, {6, {TE::Reduce, 2}}, {7, {TE::Reduce, 2}}, {8, {TE::Reduce, 2}}, {9, {TE::Reduce, 2}}},
-    Row {{4, {TE::Reduce, 3}}, {5, {TE::Reduce, 3}}, {6, {TE::Reduce, 3}}, {7, {TE::Reduce, 3}}, {8, {TE::Reduce, 3}}, {9, {TE::Reduce, 3}}},
-    Row {{4, {TE::Reduce, 4}}, {5, {TE::Reduce, 4}}, {6, {TE::Reduce, 4}}, {7, {TE::Reduce, 4}}, {8, {TE::Reduce, 4}}, {9, {TE::Reduce, 4}}},
-    Row {{4, {TE::Reduce, 5}}, {5, {TE::Reduce, 5}}, {6, {TE::Reduce, 5}}, {7, {TE::Reduce, 5}}, {8, {TE::Reduce, 5}}, {9, {TE::Reduce, 5}}},
-    Row {{3, {TE::Transit, 8}}, {4, {TE::Reduce, 7}}, {5, {TE::Reduce, 7}}, {6, {TE::Reduce, 7}}, {7, {TE::Reduce, 7}}, {8, {TE::Reduce, 7}}},
-    Row {{0, {TE::Transit, 10}}, {1, {TE::Transit, 2}}, {2, {TE::Transit, 3}}, {4, {TE::Shift, 4}}, {5, {TE::Shift, 5}}, {6, {TE::Shift, 6}}, {7, {TE::Shift, 7}}, {8, {TE::Shift, 9}}},
-    Row {{4, {TE::Reduce, 6}}, {5, {TE::Reduce, 6}}, {6, {TE::Reduce, 6}}, {7, {TE::Reduce, 6}}, {8, {TE::Reduce, 6}}, {9, {TE::Reduce, 6}}},
-    Row {{4, {TE::Reduce, 8}}, {5, {TE::Reduce, 8}}, {6, {TE::Reduce, 8}}, {7, {TE::Reduce, 8}}, {8, {TE::Reduce, 8}}}
-};
+const std::array<Row, yyparse::ROWS_COUNT> yyparse::table_ = {{
+    Row {{{TE::Transit, 1}, {TE::Transit, 2}, {TE::Transit, 3}, {}, {TE::Shift, 4}, {TE::Shift, 5}, {TE::Shift, 6}, {TE::Shift, 7}, {}, {}}},
+    Row {{{}, {}, {}, {}, {}, {}, {}, {}, {}, {TE::Accept, 0}}},
+    Row {{{}, {}, {}, {}, {TE::Reduce, 1}, {TE::Reduce, 1}, {TE::Reduce, 1}, {TE::Reduce, 1}, {TE::Reduce, 1}, {TE::Reduce, 1}}},
+    Row {{{}, {}, {}, {}, {TE::Reduce, 2}, {TE::Reduce, 2}, {TE::Reduce, 2}, {TE::Reduce, 2}, {TE::Reduce, 2}, {TE::Reduce, 2}}},
+    Row {{{}, {}, {}, {}, {TE::Reduce, 3}, {TE::Reduce, 3}, {TE::Reduce, 3}, {TE::Reduce, 3}, {TE::Reduce, 3}, {TE::Reduce, 3}}},
+    Row {{{}, {}, {}, {}, {TE::Reduce, 4}, {TE::Reduce, 4}, {TE::Reduce, 4}, {TE::Reduce, 4}, {TE::Reduce, 4}, {TE::Reduce, 4}}},
+    Row {{{}, {}, {}, {}, {TE::Reduce, 5}, {TE::Reduce, 5}, {TE::Reduce, 5}, {TE::Reduce, 5}, {TE::Reduce, 5}, {TE::Reduce, 5}}},
+    Row {{{}, {}, {}, {TE::Transit, 8}, {TE::Reduce, 7}, {TE::Reduce, 7}, {TE::Reduce, 7}, {TE::Reduce, 7}, {TE::Reduce, 7}, {}}},
+    Row {{{TE::Transit, 10}, {TE::Transit, 2}, {TE::Transit, 3}, {}, {TE::Shift, 4}, {TE::Shift, 5}, {TE::Shift, 6}, {TE::Shift, 7}, {TE::Shift, 9}, {}}},
+    Row {{{}, {}, {}, {}, {TE::Reduce, 6}, {TE::Reduce, 6}, {TE::Reduce, 6}, {TE::Reduce, 6}, {TE::Reduce, 6}, {TE::Reduce, 6}}},
+    Row {{{}, {}, {}, {}, {TE::Reduce, 8}, {TE::Reduce, 8}, {TE::Reduce, 8}, {TE::Reduce, 8}, {TE::Reduce, 8}, {}}}
+}};
   // clang-format on
 
 } // namespace syntax
 
+#ifdef __clang__
+#pragma clang diagnostic pop
+#endif
+
 #endif
\ No newline at end of file
@@ -0,0 +1,289 @@
+#ifndef __formReader_h
+#define __formReader_h
+
+#include <cerrno>
+#include <string>
+#include <string_view>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include "../Logger.h"
+#include "XPParser.h"
+
+/**
+ * Splits a program read from a file descriptor into its top-level forms,
+ * so each one can be parsed and compiled as soon as it's complete.
+ *
+ * A regular file is mapped, and the forms are views of the mapping.
+ * Other descriptors (pipes, sockets) are read in chunks, and only the
+ * form being read is buffered. Either way, memory is bounded by the
+ * largest form rather than by the program.
+ *
+ * The forms are delimited with the lexical rules of XPGrammar.bnf and the
+ * tokenizer's character classes (see Tokenizer::scanToken_): parentheses
+ * in strings, comments and symbols (e.g. `a//b`) don't count. Malformed input is returned as is, for the
+ * parser to report.
+ */
+class FormReader
+{
+public:
+    /**
+     * Reads from `fd`, which the caller keeps open while reading.
+     */
+    FormReader(int fd) : fd(fd)
+    {
+        struct stat info;
+
+        if (fstat(fd, &info) == 0 && S_ISREG(info.st_mode) && info.st_size > 0)
+        {
+            auto memory = mmap(nullptr, info.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+
+            if (memory != MAP_FAILED)
+            {
+                madvise(memory, info.st_size, MADV_SEQUENTIAL);
+
+                mapping = (const char *)memory;
+                mappingSize = info.st_size;
+                source = std::string_view(mapping, mappingSize);
+                eof = true;
+            }
+        }
+    }
+
+    ~FormReader()
+    {
+        if (mapping != nullptr)
+        {
+            munmap((void *)mapping, mappingSize);
+        }
+    }
+
+    FormReader(const FormReader &) = delete;
+
+    FormReader &operator=(const FormReader &) = delete;
+
+    /**
+     * Reads the next top-level form into `form`, which stays valid until
+     * the next call. Returns false at the end of the input.
+     */
+    bool next(std::string_view &form)
+    {
+        discardForm();
+
+        for (;;)
+        {
+            if (scanForm())
+            {
+                form = source.substr(formStart, cursor - formStart);
+                return true;
+            }
+
+            if (eof)
+            {
+                // An unterminated form, for the parser to report.
+                if (formStart != std::string::npos)
+                {
+                    form = source.substr(formStart);
+                    cursor = source.size();
+                    return true;
+                }
+
+                return false;
+            }
+
+            readChunk();
+        }
+    }
+
+private:
+    static constexpr size_t CHUNK_SIZE = 64 * 1024;
+
+    /**
+     * Scans tokens from the cursor until a form is complete. Stops at the
+     * start of a token which may continue past the data read so far.
+     */
+    bool scanForm()
+    {
+        auto size = source.size();
+
+        while (cursor < size)
+        {
+            auto start = cursor;
+            auto c = source[start];
+            auto end = start + 1;
+
+            if (syntax::Tokenizer::isSpace(c))
+            {
+                cursor = end;
+                continue;
+            }
+
+            // Comments, and `/` starting a symbol.
+            if (c == '/')
+            {
+                if (end == size && !eof)
+                {
+                    return false;
+                }
+
+                auto next = end < size ? source[end] : '\0';
+
+                if (next == '/')
+                {
+                    while (end < size && source[end] != '\n' && source[end] != '\r')
+                    {
+                        end++;
+                    }
+
+                    if (end == size && !eof)
+                    {
+                        return false;
+                    }
+
+                    cursor = end;
+                    continue;
+                }
+
+                if (next == '*')
+                {
+                    auto close = source.find("*/", start + 2);
+
+                    if (close == std::string::npos && !eof)
+                    {
+                        return false;
+                    }
+
+                    // An unterminated comment is a symbol.
+                    if (close != std::string::npos)
+                    {
+                        cursor = close + 2;
+                        continue;
+                    }
+                }
+            }
+
+            if (c == '"')
+            {
+                auto close = source.find('"', start + 1);
+
+                if (close == std::string::npos)
+                {
+                    if (!eof)
+                    {
+                        return false;
+                    }
+
+                    close = size - 1;
+                }
+
+                end = close + 1;
+            }
+            else if (syntax::Tokenizer::isSymbolChar(c))
+            {
+                while (end < size && syntax::Tokenizer::isSymbolChar(source[end]))
+                {
+                    end++;
+                }
+
+                if (end == size && !eof)
+                {
+                    return false;
+                }
+            }
+
+            if (formStart == std::string::npos)
+            {
+                formStart = start;
+            }
+
+            if (c == '(')
+            {
+                depth++;
+            }
+            else if (c == ')' && depth > 0)
+            {
+                depth--;
+            }
+
+            cursor = end;
+
+            if (depth == 0)
+            {
+                return true;
+            }
+        }
+
+        return false;
+    }
+
+    /**
+     * Drops the last form returned. Read data is compacted, so the buffer
+     * only holds the form being read.
+     */
+    void discardForm()
+    {
+        formStart = std::string::npos;
+
+        if (mapping != nullptr || cursor == 0)
+        {
+            return;
+        }
+
+        buffer.erase(0, cursor);
+        cursor = 0;
+        source = buffer;
+    }
+
+    void readChunk()
+    {
+        auto used = buffer.size();
+        buffer.resize(used + CHUNK_SIZE);
+
+        ssize_t count;
+
+        do
+        {
+            count = read(fd, &buffer[used], CHUNK_SIZE);
+        } while (count == -1 && errno == EINTR);
+
+        if (count == -1)
+        {
+            DIE << "FormReader: can't read the program.";
+        }
+
+        buffer.resize(used + count);
+        source = buffer;
+        eof = count == 0;
+    }
+
+    int fd;
+
+    const char *mapping = nullptr;
+
+    size_t mappingSize = 0;
+
+    /**
+     * Data read (or mapped) and not discarded yet.
+     */
+    std::string buffer;
+
+    std::string_view source;
+
+    bool eof = false;
+
+    size_t cursor = 0;
+
+    /**
+     * Offset of the form being read in `source`, or npos before its
+     * first token.
+     */
+    size_t formStart = std::string::npos;
+
+    /**
+     * Nesting of the form being read.
+     */
+    int depth = 0;
+};
+
+#endif
@@ -0,0 +1,578 @@
+#!/usr/bin/env python3
+"""
+Generates XPParser.h from XPGrammar.bnf and the XPParser.h.in template.
+
+    python3 src/parser/generateParser.py           # writes XPParser.h
+    python3 src/parser/generateParser.py --check   # fails if it's stale
+
+XPParser.h started as the output of syntax-cli (LALR1 mode), which was then
+tuned by hand: plain-value tokens, a dense parsing table, the hand-written
+scanner, the AST arena. Those parts now live in the template, and this
+script fills in the parts which come from the grammar, in syntax-cli's
+format and with its state numbering:
+
+  - the module include (the grammar's %{ ... %} block);
+  - the token types, and the lexical rules and their handlers;
+  - the productions and their semantic actions;
+  - the LALR(1) parsing table.
+
+It only supports what XPGrammar.bnf uses: lexical rules returning a token
+name or %empty, in the INITIAL state, and semantic actions assigning $$.
+"""
+
+import os
+import re
+import sys
+
+HERE = os.path.dirname(os.path.abspath(__file__))
+
+GRAMMAR = os.path.join(HERE, "XPGrammar.bnf")
+TEMPLATE = os.path.join(HERE, "XPParser.h.in")
+OUTPUT = os.path.join(HERE, "XPParser.h")
+
+EOF = "$"
+ACCEPT = "$accept"
+EMPTY = "%empty"
+
+
+class GrammarError(Exception):
+    pass
+
+
+# ---------------------------------------------------------------------
+# Grammar file.
+
+
+def readGrammar(text):
+    """
+    Splits the grammar into its lexical rules, module include and
+    productions.
+    """
+    lexMatch = re.search(r"^%lex\s*$(.*?)^/lex\s*$", text, re.M | re.S)
+
+    if not lexMatch:
+        raise GrammarError("no %lex ... /lex section")
+
+    lexRules = readLexRules(lexMatch.group(1))
+
+    rest = text[lexMatch.end():]
+    includeMatch = re.search(r"^%\{(.*?)^%\}", rest, re.M | re.S)
+
+    if not includeMatch:
+        raise GrammarError("no %{ ... %} module include")
+
+    moduleInclude = includeMatch.group(1).strip()
+
+    bnf = rest[includeMatch.end():]
+    bnf = bnf[bnf.index("%%") + 2:]
+
+    return lexRules, moduleInclude, readProductions(bnf)
+
+
+def readLexRules(section):
+    """
+    [(regex, token name or %empty)] of the rules after the %% line.
+    """
+    rules = []
+    body = section[section.index("%%") + 2:]
+
+    for line in body.splitlines():
+        line = line.strip()
+
+        if not line or line.startswith("//"):
+            continue
+
+        regex, action = line.rsplit(None, 1)
+        rules.append((regex.strip(), action))
+
+    return rules
+
+
+BNF_TOKEN = re.compile(
+    r"""\s+
+      | //[^\n]*
+      | /\*.*?\*/
+      | (?P<literal>'[^']*')
+      | (?P<empty>%empty)
+      | (?P<name>[A-Za-z_][A-Za-z0-9_]*)
+      | (?P<punct>[:|;])
+      | (?P<action>\{)""",
+    re.X | re.S,
+)
+
+
+def readProductions(bnf):
+    """
+    [(lhs, [symbols], action or None)], in the order of the grammar.
+    """
+    tokens = []
+    i = 0
+
+    while i < len(bnf):
+        match = BNF_TOKEN.match(bnf, i)
+
+        if not match:
+            raise GrammarError("unexpected %r in the BNF" % bnf[i:i + 20])
+
+        if match.group("action"):
+            end = matchingBrace(bnf, match.start())
+            tokens.append(("action", bnf[match.start() + 1:end]))
+            i = end + 1
+            continue
+
+        for kind in ("literal", "empty", "name", "punct"):
+            if match.group(kind):
+                tokens.append((kind, match.group(kind)))
+
+        i = match.end()
+
+    productions = []
+    i = 0
+
+    while i < len(tokens):
+        kind, lhs = tokens[i]
+
+        if kind != "name" or tokens[i + 1] != ("punct", ":"):
+            raise GrammarError("expected a rule at %r" % (lhs,))
+
+        i += 2
+        rhs, action = [], None
+
+        while True:
+            kind, value = tokens[i]
+            i += 1
+
+            if kind in ("name", "literal"):
+                rhs.append(value)
+            elif kind == "action":
+                action = value
+            elif value in ("|", ";"):
+                productions.append((lhs, rhs, action))
+                rhs, action = [], None
+
+                if value == ";":
+                    break
+
+    return productions
+
+
+def matchingBrace(text, start):
+    depth = 0
+
+    for i in range(start, len(text)):
+        if text[i] == "{":
+            depth += 1
+        elif text[i] == "}":
+            depth -= 1
+
+            if depth == 0:
+                return i
+
+    raise GrammarError("unterminated action")
+
+
+# ---------------------------------------------------------------------
+# LALR(1) automaton.
+
+
+class Grammar:
+    def __init__(self, productions):
+        # Production 0 is the augmented one, $accept -> start.
+        self.productions = [(ACCEPT, [productions[0][0]], None)] + productions
+
+        self.nonterminals = []
+        self.terminals = []
+
+        for lhs, _, _ in productions:
+            if lhs not in self.nonterminals:
+                self.nonterminals.append(lhs)
+
+        for _, rhs, _ in productions:
+            for symbol in rhs:
+                if symbol not in self.nonterminals and symbol not in self.terminals:
+                    self.terminals.append(symbol)
+
+        # Encoded symbols: the nonterminals, then the terminals, then EOF.
+        self.symbols = self.nonterminals + self.terminals + [EOF]
+        self.column = {symbol: i for i, symbol in enumerate(self.symbols)}
+
+        self.nullable = set()
+        self.first = {symbol: set() for symbol in self.nonterminals}
+        self.computeFirstSets()
+
+    def isTerminal(self, symbol):
+        return symbol not in self.nonterminals and symbol != ACCEPT
+
+    def computeFirstSets(self):
+        changed = True
+
+        while changed:
+            changed = False
+
+            for lhs, rhs, _ in self.productions[1:]:
+                first = self.firstOf(rhs)
+
+                if not first[0] <= self.first[lhs]:
+                    self.first[lhs] |= first[0]
+                    changed = True
+
+                if first[1] and lhs not in self.nullable:
+                    self.nullable.add(lhs)
+                    changed = True
+
+    def firstOf(self, symbols):
+        """
+        (FIRST set, whether nullable) of a sequence of symbols.
+        """
+        first = set()
+
+        for symbol in symbols:
+            if self.isTerminal(symbol):
+                first.add(symbol)
+                return first, False
+
+            first |= self.first[symbol]
+
+            if symbol not in self.nullable:
+                return first, False
+
+        return first, True
+
+    def closure(self, kernel):
+        """
+        LR(0) items of a state, in syntax-cli's order: the kernel, then
+        the productions of each nonterminal after a dot, as they're met.
+        """
+        items = list(kernel)
+        i = 0
+
+        while i < len(items):
+            production, dot = items[i]
+            rhs = self.productions[production][1]
+
+            if dot < len(rhs) and rhs[dot] in self.nonterminals:
+                for number, (lhs, _, _) in enumerate(self.productions):
+                    if lhs == rhs[dot] and (number, 0) not in items:
+                        items.append((number, 0))
+
+            i += 1
+
+        return items
+
+    def lr0States(self):
+        """
+        States (their items) and transitions, numbered breadth first,
+        with the transitions of a state in the order of its items.
+        """
+        states = [self.closure([(0, 0)])]
+        kernels = [((0, 0),)]
+        transitions = []
+
+        i = 0
+
+        while i < len(states):
+            moves = {}
+            order = []
+
+            for production, dot in states[i]:
+                rhs = self.productions[production][1]
+
+                if dot < len(rhs):
+                    symbol = rhs[dot]
+
+                    if symbol not in moves:
+                        moves[symbol] = []
+                        order.append(symbol)
+
+                    moves[symbol].append((production, dot + 1))
+
+            stateTransitions = {}
+
+            for symbol in order:
+                kernel = tuple(moves[symbol])
+
+                if kernel not in kernels:
+                    kernels.append(kernel)
+                    states.append(self.closure(list(kernel)))
+
+                stateTransitions[symbol] = kernels.index(kernel)
+
+            transitions.append(stateTransitions)
+            i += 1
+
+        return states, transitions
+
+    def lookaheads(self, states, transitions):
+        """
+        LALR(1) lookaheads of every item of every state: the LR(1)
+        closure of the kernels, propagated along the transitions until
+        nothing changes.
+        """
+        lookaheads = [{item: set() for item in state} for state in states]
+        lookaheads[0][(0, 0)].add(EOF)
+
+        changed = True
+
+        while changed:
+            changed = False
+
+            for index, state in enumerate(states):
+                current = lookaheads[index]
+
+                # Closure: B -> .gamma gets FIRST(beta a) of A -> alpha . B beta, a
+                closed = False
+
+                while not closed:
+                    closed = True
+
+                    for production, dot in state:
+                        rhs = self.productions[production][1]
+
+                        if dot >= len(rhs) or rhs[dot] not in self.nonterminals:
+                            continue
+
+                        first, nullable = self.firstOf(rhs[dot + 1:])
+                        spontaneous = first | (current[(production, dot)] if nullable else set())
+
+                        for number, (lhs, _, _) in enumerate(self.productions):
+                            if lhs == rhs[dot] and not spontaneous <= current[(number, 0)]:
+                                current[(number, 0)] |= spontaneous
+                                closed = False
+                                changed = True
+
+                for production, dot in state:
+                    rhs = self.productions[production][1]
+
+                    if dot < len(rhs):
+                        target = lookaheads[transitions[index][rhs[dot]]]
+
+                        if not current[(production, dot)] <= target[(production, dot + 1)]:
+                            target[(production, dot + 1)] |= current[(production, dot)]
+                            changed = True
+
+        return lookaheads
+
+    def table(self):
+        """
+        Rows of (entry type, value) or None, by encoded symbol.
+        """
+        states, transitions = self.lr0States()
+        lookaheads = self.lookaheads(states, transitions)
+
+        rows = []
+
+        for index, state in enumerate(states):
+            row = [None] * len(self.symbols)
+
+            def put(symbol, entry):
+                column = self.column[symbol]
+
+                if row[column] is not None and row[column] != entry:
+                    raise GrammarError("conflict in state %d on %s: %s and %s" %
+                                       (index, symbol, row[column], entry))
+
+                row[column] = entry
+
+            for symbol, target in transitions[index].items():
+                put(symbol, ("Shift" if self.isTerminal(symbol) else "Transit", target))
+
+            for production, dot in state:
+                if dot == len(self.productions[production][1]):
+                    for symbol in sorted(lookaheads[index][(production, dot)], key=self.column.get):
+                        if production == 0:
+                            put(symbol, ("Accept", 0))
+                        else:
+                            put(symbol, ("Reduce", production))
+
+            rows.append(row)
+
+        return rows
+
+
+# ---------------------------------------------------------------------
+# Rendering, in syntax-cli's format.
+
+
+def tokenTypeName(grammar, terminal):
+    if terminal.startswith("'"):
+        return "TOKEN_TYPE_%d" % grammar.column[terminal]
+
+    return terminal
+
+
+def renderTokenTypes(grammar):
+    lines = ["  %s = %d," % (tokenTypeName(grammar, terminal), grammar.column[terminal])
+             for terminal in grammar.terminals]
+
+    return "\n".join(lines + ["  __EOF = %d" % grammar.column[EOF]])
+
+
+def regexFromLex(regex):
+    """
+    The lexical grammar's regex in std::regex syntax: \\" is " outside
+    character classes.
+    """
+    result = []
+    inClass = False
+    i = 0
+
+    while i < len(regex):
+        c = regex[i]
+
+        if c == "\\" and i + 1 < len(regex):
+            pair = regex[i:i + 2]
+            result.append('"' if pair == '\\"' and not inClass else pair)
+            i += 2
+            continue
+
+        if c == "[":
+            inClass = True
+        elif c == "]":
+            inClass = False
+
+        result.append(c)
+        i += 1
+
+    return "".join(result)
+
+
+def allLexRules(grammar, lexRules):
+    """
+    The rules for the literal tokens of the productions, then the
+    lexical grammar's, as (regex, token type).
+    """
+    rules = []
+
+    for terminal in grammar.terminals:
+        if terminal.startswith("'"):
+            rules.append((re.escape(terminal[1:-1]), tokenTypeName(grammar, terminal)))
+
+    for regex, action in lexRules:
+        if action == EMPTY:
+            tokenType = "__EMPTY"
+        elif action in grammar.terminals:
+            tokenType = action
+        else:
+            raise GrammarError("lexical rule %s returns an unknown token %s" % (regex, action))
+
+        rules.append((regexFromLex(regex), tokenType))
+
+    return rules
+
+
+def renderLexRuleHandlers(rules):
+    return "\n\n".join(
+        "inline TokenType _lexRule%d(const Tokenizer& /* tokenizer */, const std::string& /* yytext */) {\n"
+        "return TokenType::%s;\n"
+        "}" % (i + 1, tokenType)
+        for i, (_, tokenType) in enumerate(rules))
+
+
+def renderLexRules(rules):
+    return ",\n".join('  {std::regex(R"(^%s)"), &_lexRule%d}' % (regex, i + 1)
+                      for i, (regex, _) in enumerate(rules))
+
+
+def renderHandler(grammar, number):
+    _, rhs, action = grammar.productions[number]
+
+    if action is None:
+        code = "auto __ = _1;"
+    else:
+        code = re.sub(r"\$\$\s*=", "auto __ =", action.lstrip())
+        code = re.sub(r"\$(\d+)", r"_\1", code) + ";"
+
+    prologue = []
+
+    for i in range(len(rhs), 0, -1):
+        used = re.search(r"\b_%d\b" % i, code) is not None
+
+        if grammar.isTerminal(rhs[i - 1]):
+            prologue.append("auto _%d = POP_T();" % i if used else "parser.tokensStack.pop_back();")
+        else:
+            prologue.append("auto _%d = POP_V();" % i if used else "parser.valuesStack.pop_back();")
+
+    return ("void _handler%d(yyparse& parser) {\n"
+            "// Semantic action prologue.\n"
+            "%s\n\n"
+            "%s\n\n"
+            " // Semantic action epilogue.\n"
+            "PUSH_VR();\n\n"
+            "}" % (number + 1, "\n".join(prologue), code))
+
+
+def renderProductions(grammar):
+    entries = []
+
+    for number, (lhs, rhs, _) in enumerate(grammar.productions):
+        opcode = -1 if number == 0 else grammar.column[lhs]
+        entries.append("{%d, %d, &_handler%d}" % (opcode, len(rhs), number + 1))
+
+    return "{{" + ",\n".join(entries) + "}}"
+
+
+def renderTable(rows):
+    def entry(cell):
+        return "{}" if cell is None else "{TE::%s, %d}" % cell
+
+    return ",\n".join("    Row {{" + ", ".join(entry(cell) for cell in row) + "}}"
+                      for row in rows)
+
+
+def generate(grammarText, template):
+    lexRules, moduleInclude, productions = readGrammar(grammarText)
+    grammar = Grammar(productions)
+    rules = allLexRules(grammar, lexRules)
+    rows = grammar.table()
+
+    values = {
+        "MODULE_INCLUDE": moduleInclude,
+        "TOKEN_TYPES": renderTokenTypes(grammar),
+        "LEX_RULES_COUNT": str(len(rules)),
+        "LEX_RULE_HANDLERS": renderLexRuleHandlers(rules),
+        "LEX_RULES": renderLexRules(rules),
+        "LEX_RULES_BY_START_CONDITIONS": "{{TokenizerState::INITIAL, {%s}}}" %
+                                         ", ".join(str(i) for i in range(len(rules))),
+        "COLUMNS_COUNT": str(len(grammar.symbols)),
+        "PRODUCTIONS_COUNT": str(len(grammar.productions)),
+        "PRODUCTION_HANDLERS": "\n\n".join(renderHandler(grammar, number)
+                                           for number in range(len(grammar.productions))),
+        "PRODUCTIONS": renderProductions(grammar),
+        "ROWS_COUNT": str(len(rows)),
+        "TABLE": renderTable(rows),
+    }
+
+    def substitute(match):
+        if match.group(1) not in values:
+            raise GrammarError("unknown template field %s" % match.group(0))
+
+        return values[match.group(1)]
+
+    return re.sub(r"\{\{([A-Z_]+)\}\}", substitute, template)
+
+
+def main(argv):
+    with open(GRAMMAR) as file:
+        grammarText = file.read()
+
+    with open(TEMPLATE) as file:
+        template = file.read()
+
+    output = generate(grammarText, template)
+
+    if "--check" in argv:
+        with open(OUTPUT) as file:
+            if file.read() != output:
+                print("%s is stale: run %s" % (os.path.relpath(OUTPUT), os.path.relpath(__file__)))
+                return 1
+
+        return 0
+
+    with open(OUTPUT, "w") as file:
+        file.write(output)
+
+    return 0
+
+
+if __name__ == "__main__":
+    sys.exit(main(sys.argv[1:]))
@@ -1,10 +1,10 @@
 #ifndef _scope_h
 #define _scope_h
 
-#include <string>
-#include <map>
 #include <set>
+#include <unordered_map>
 #include "../bytecode/OpCode.h"
+#include "../vm/symbolTable.h"
 #include "../Logger.h"
 
 enum class ScopeType
@@ -18,7 +18,10 @@ enum class AllocType
 {
     GLOBAL,
     LOCAL,
-    CELL
+    CELL,
+    // Local of the enclosing function, read from its frame by a function
+    // which doesn't escape it.
+    PARENT_LOCAL
 };
 
 struct Scope
@@ -26,26 +29,26 @@ struct Scope
     Scope(ScopeType type, std::shared_ptr<Scope> parent)
         : type(type), parent(parent) {}
 
-    void addLocal(const std::string &name)
+    void addLocal(SymbolId symbol)
     {
-        allocInfo[name] = type == ScopeType::GLOBAL ? AllocType::GLOBAL : AllocType::LOCAL;
+        allocInfo[symbol] = type == ScopeType::GLOBAL ? AllocType::GLOBAL : AllocType::LOCAL;
     }
 
-    void addCell(const std::string &name)
+    void addCell(SymbolId symbol)
     {
-        cells.insert(name);
-        allocInfo[name] = AllocType::CELL;
+        cells.insert(symbol);
+        allocInfo[symbol] = AllocType::CELL;
     }
 
-    void addFree(const std::string &name)
+    void addFree(SymbolId symbol)
     {
-        free.insert(name);
-        allocInfo[name] = AllocType::CELL;
+        free.insert(symbol);
+        allocInfo[symbol] = AllocType::CELL;
     }
 
-    int getNameGetter(const std::string &name)
+    int getNameGetter(SymbolId symbol) const
     {
-        switch (allocInfo[name])
+        switch (allocType(symbol))
         {
         case AllocType::GLOBAL:
             return OP_GET_GLOBAL;
@@ -53,12 +56,18 @@ struct Scope
             return OP_GET_LOCAL;
         case AllocType::CELL:
             return OP_GET_CELL;
+        case AllocType::PARENT_LOCAL:
+            return OP_GET_PARENT_LOCAL;
         }
+
+        DIE << "getNameGetter: unknown allocation of " << symbols().name(symbol);
+
+        return 0;
     }
 
-    int getNameSetter(const std::string &name)
+    int getNameSetter(SymbolId symbol) const
     {
-        switch (allocInfo[name])
+        switch (allocType(symbol))
         {
         case AllocType::GLOBAL:
             return OP_SET_GLOBAL;
@@ -66,61 +75,147 @@ struct Scope
             return OP_SET_LOCAL;
         case AllocType::CELL:
             return OP_SET_CELL;
+        case AllocType::PARENT_LOCAL:
+            return OP_SET_PARENT_LOCAL;
         }
+
+        DIE << "getNameSetter: unknown allocation of " << symbols().name(symbol);
+
+        return 0;
+    }
+
+    /**
+     * Allocation of a name; names the scope doesn't know are globals.
+     * Doesn't insert them: the compiler threads read the scopes of the
+     * program concurrently (see XPCompiler::compileDeferred).
+     */
+    AllocType allocType(SymbolId symbol) const
+    {
+        auto it = allocInfo.find(symbol);
+
+        return it == allocInfo.end() ? AllocType::GLOBAL : it->second;
     }
 
-    void maybePromote(const std::string &name)
+    void maybePromote(SymbolId symbol)
     {
         auto initAllocType = type == ScopeType::GLOBAL ? AllocType::GLOBAL : AllocType::LOCAL;
 
-        if (allocInfo.count(name) != 0)
+        if (allocInfo.count(symbol) != 0)
         {
-            initAllocType = allocInfo[name];
+            initAllocType = allocInfo[symbol];
         }
 
-        if (initAllocType == AllocType::CELL)
+        if (initAllocType == AllocType::CELL || initAllocType == AllocType::PARENT_LOCAL)
         {
             return;
         }
 
-        auto [ownerScope, allocType] = resolve(name, initAllocType);
+        auto [ownerScope, allocType] = resolve(symbol, initAllocType);
 
-        allocInfo[name] = allocType;
+        allocInfo[symbol] = allocType;
 
         if (allocType == AllocType::CELL)
         {
-            promote(name, ownerScope);
+            promote(symbol, ownerScope);
+        }
+        else if (allocType == AllocType::PARENT_LOCAL)
+        {
+            borrow(symbol);
         }
     }
 
-    void promote(const std::string &name, Scope *ownerScope)
+    void promote(SymbolId symbol, Scope *ownerScope)
     {
-        ownerScope->addCell(name);
+        // Free variables of the owner are already cells of an outer scope.
+        if (ownerScope->free.count(symbol) == 0)
+        {
+            ownerScope->addCell(symbol);
+        }
 
         auto scope = this;
 
         while (scope != ownerScope)
         {
-            scope->addFree(name);
+            scope->addFree(symbol);
             scope = scope->parent.get();
         }
     }
 
-    std::pair<Scope *, AllocType> resolve(const std::string &name, AllocType allocType)
+    /**
+     * Records `symbol` as a local of the parent read by the enclosing
+     * function.
+     */
+    void borrow(SymbolId symbol)
     {
-        if (allocInfo.count(name) != 0)
+        auto scope = this;
+
+        while (scope->type != ScopeType::FUNCTION)
         {
+            scope = scope->parent.get();
+        }
+
+        scope->borrowed.insert(symbol);
+    }
+
+    /**
+     * Allocation of `symbol` where it's declared, seen from this scope.
+     */
+    AllocType declaredAllocType(SymbolId symbol)
+    {
+        auto scope = this;
+
+        while (scope != nullptr)
+        {
+            auto info = scope->allocInfo.find(symbol);
+
+            if (info != scope->allocInfo.end() && info->second != AllocType::PARENT_LOCAL)
+            {
+                return info->second;
+            }
+
+            scope = scope->parent.get();
+        }
+
+        return AllocType::GLOBAL;
+    }
+
+    std::pair<Scope *, AllocType> resolve(SymbolId symbol, AllocType allocType)
+    {
+        auto info = allocInfo.find(symbol);
+
+        // Names borrowed from the parent are declared further out.
+        if (info != allocInfo.end() && info->second != AllocType::PARENT_LOCAL)
+        {
+            // A local or parent local which is a cell is shared through the
+            // cell. Blocks which already read a global or a free variable
+            // have it in allocInfo too.
+            if (info->second == AllocType::CELL || info->second == AllocType::GLOBAL)
+            {
+                allocType = info->second;
+            }
+
             return std::make_pair(this, allocType);
         }
 
+        // Crossing a function: only the first one, if it doesn't escape,
+        // can read the local from its caller's frame.
         if (type == ScopeType::FUNCTION)
         {
-            allocType = AllocType::CELL;
+            allocType = allocType == AllocType::LOCAL && !escapes
+                            ? AllocType::PARENT_LOCAL
+                            : AllocType::CELL;
+        }
+
+        // Names not declared in the program may still be VM globals
+        // (natives, constants); the compiler checks them against Global.
+        if (type == ScopeType::GLOBAL)
+        {
+            return std::make_pair(this, AllocType::GLOBAL);
         }
 
         if (parent == nullptr)
         {
-            DIE << "[Scope] Reference error: " << name << " is not defined.";
+            DIE << "[Scope] Reference error: " << symbols().name(symbol) << " is not defined.";
         }
 
         if (parent->type == ScopeType::GLOBAL)
@@ -128,18 +223,27 @@ struct Scope
             allocType = AllocType::GLOBAL;
         }
 
-        return parent->resolve(name, allocType);
+        return parent->resolve(symbol, allocType);
     }
 
     ScopeType type;
 
     std::shared_ptr<Scope> parent;
 
-    std::map<std::string, AllocType> allocInfo;
+    std::unordered_map<SymbolId, AllocType> allocInfo;
+
+    std::set<SymbolId> free;
+
+    std::set<SymbolId> cells;
 
-    std::set<std::string> free;
+    /**
+     * Function scopes: whether the function may be called from another
+     * frame than its parent's (see EscapeAnalysis), and the parent's
+     * locals it reads from the parent's frame.
+     */
+    bool escapes = true;
 
-    std::set<std::string> cells;
+    std::set<SymbolId> borrowed;
 };
 
 #endif
@@ -0,0 +1,101 @@
+#ifndef __XPStack_h
+#define __XPStack_h
+
+#include <cstddef>
+#include <sys/mman.h>
+#include <unistd.h>
+#include "../Logger.h"
+#include "XPValue.h"
+
+/**
+ * Memory committed to the stack at a time.
+ */
+#define STACK_COMMIT_SIZE (64 * 1024)
+
+/**
+ * The VM value stack: one contiguous region of `limit` slots.
+ *
+ * The whole region is reserved up front without backing memory, and
+ * pages are committed on demand as the stack grows, so deep recursion
+ * doesn't cost anything until it happens. Slots never move, which keeps
+ * sp/bp and the frame records stored in the stack valid.
+ */
+class XPStack
+{
+public:
+    XPStack(size_t limit)
+    {
+        reservedSize = roundToPage(limit * sizeof(XPValue));
+
+        auto memory = mmap(nullptr, reservedSize, PROT_NONE,
+                           MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+
+        if (memory == MAP_FAILED)
+        {
+            DIE << "XPStack: can't reserve " << reservedSize << " bytes.";
+        }
+
+        begin = (XPValue *)memory;
+        committed = begin;
+        end = (XPValue *)((uint8_t *)memory + reservedSize);
+    }
+
+    ~XPStack()
+    {
+        munmap(begin, reservedSize);
+    }
+
+    XPStack(const XPStack &) = delete;
+
+    XPStack &operator=(const XPStack &) = delete;
+
+    /**
+     * Makes every slot below `top` usable.
+     */
+    void ensure(XPValue *top)
+    {
+        if (top > committed)
+        {
+            grow(top);
+        }
+    }
+
+    XPValue *begin;
+
+private:
+    void grow(XPValue *top)
+    {
+        if (top > end)
+        {
+            DIE << "stack overflow!";
+        }
+
+        auto commitEnd = std::min((uint8_t *)begin + roundTo((uint8_t *)top - (uint8_t *)begin, STACK_COMMIT_SIZE),
+                                  (uint8_t *)end);
+
+        if (mprotect(committed, commitEnd - (uint8_t *)committed, PROT_READ | PROT_WRITE) != 0)
+        {
+            DIE << "XPStack: can't commit stack memory.";
+        }
+
+        committed = (XPValue *)commitEnd;
+    }
+
+    static size_t roundTo(size_t size, size_t unit)
+    {
+        return (size + unit - 1) / unit * unit;
+    }
+
+    static size_t roundToPage(size_t size)
+    {
+        return roundTo(size, sysconf(_SC_PAGESIZE));
+    }
+
+    XPValue *committed;
+
+    XPValue *end;
+
+    size_t reservedSize;
+};
+
+#endif
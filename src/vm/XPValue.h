@@ -1,10 +1,14 @@
 #ifndef __XPVvalue_h
 #define __XPVvalue_h
 
+#include <cstdint>
+#include <cstring>
 #include <string>
+#include <unordered_map>
 #include <vector>
-#include <list>
 #include "../Logger.h"
+#include "symbolTable.h"
+#include "../gc/XPHeap.h"
 
 enum class XPValueType
 {
@@ -22,60 +26,6 @@ enum class ObjectType
     CELL
 };
 
-struct Traceable
-{
-    bool marked;
-
-    size_t size;
-
-    static void *operator new(size_t size)
-    {
-        void *object = ::operator new(size);
-
-        ((Traceable *)object)->size = size;
-
-        Traceable::objects.push_back((Traceable *)object);
-
-        Traceable::bytesAllocated += size;
-
-        return object;
-    }
-
-    static void operator delete(void *object, size_t size)
-    {
-
-        Traceable::bytesAllocated -= size;
-
-        ::operator delete(object);
-    }
-
-    static void cleanup()
-    {
-        for (auto &object : objects)
-        {
-            delete object;
-        }
-        objects.clear();
-    }
-
-    static void printStats()
-    {
-        std::cout << "---------------------------------------\n";
-        std::cout << "Memory stats:\n\n"
-                  << "\n\n";
-        std::cout << "Objects allocated : " << std::dec << Traceable::objects.size() << "\n";
-        std::cout << "Bytes allocated   : " << std::dec << Traceable::bytesAllocated << "\n\n";
-    }
-
-    static size_t bytesAllocated;
-
-    static std::list<Traceable *> objects;
-};
-
-size_t Traceable::bytesAllocated{0};
-
-std::list<Traceable *> Traceable::objects{};
-
 struct Object : public Traceable
 {
     Object(ObjectType type) : type(type) {}
@@ -103,6 +53,49 @@ struct NativeObject : public Object
     size_t arity;
 };
 
+/**
+ * Value representation. On 64-bit targets values are NaN-boxed into 8
+ * bytes: numbers are stored as plain doubles, and booleans and object
+ * pointers live in the payload of a quiet NaN. Builds with
+ * XP_NO_NAN_BOXING defined (and 32-bit targets) use the 16-byte tagged
+ * union instead. Both are accessed only through the macros below.
+ */
+#if UINTPTR_MAX == UINT64_MAX && !defined(XP_NO_NAN_BOXING)
+#define XP_NAN_BOXING
+#endif
+
+#ifdef XP_NAN_BOXING
+
+struct XPValue
+{
+    uint64_t bits;
+};
+
+#define SIGN_BIT ((uint64_t)0x8000000000000000)
+#define QNAN ((uint64_t)0x7ffc000000000000)
+
+#define TAG_FALSE 2
+#define TAG_TRUE 3
+
+#define FALSE_BITS (QNAN | TAG_FALSE)
+#define TRUE_BITS (QNAN | TAG_TRUE)
+
+inline XPValue numberToValue(double number)
+{
+    XPValue value;
+    memcpy(&value.bits, &number, sizeof(double));
+    return value;
+}
+
+inline double valueToNumber(XPValue value)
+{
+    double number;
+    memcpy(&number, &value.bits, sizeof(double));
+    return number;
+}
+
+#else
+
 struct XPValue
 {
     XPValueType type;
@@ -114,10 +107,24 @@ struct XPValue
     };
 };
 
+#endif
+
 struct LocalVar
 {
     std::string name;
     size_t scoleLevel;
+    SymbolId symbol;
+
+    /**
+     * Index of the local this one shadows, or -1.
+     */
+    int shadowed;
+
+    /**
+     * Stack slot, counted from the frame's base. Blocks in expressions
+     * put their locals above the temporaries below them.
+     */
+    size_t slot;
 };
 
 struct CodeObject : public Object
@@ -129,6 +136,12 @@ struct CodeObject : public Object
     std::string name;
     size_t arity;
     std::vector<uint8_t> code;
+
+    /**
+     * First instruction: `code.data()` for compiled code, or the bytecode
+     * in a mapped image (see XPImage), in which case `code` is empty.
+     */
+    uint8_t *entry = nullptr;
     std::vector<XPValue> constants;
 
     size_t scopeLevel = 0;
@@ -137,11 +150,45 @@ struct CodeObject : public Object
 
     size_t freeCount = 0;
 
+    /**
+     * Maximum stack height reached by the code, counted from the frame's
+     * base (the callee slot); computed by the compiler.
+     */
+    size_t maxStack = 0;
+
     std::vector<LocalVar> locals;
 
-    void addLocal(const std::string &name)
+    void addLocal(const std::string &name, size_t slot)
+    {
+        auto symbol = internSymbol(name);
+        auto shadowed = localIndices.find(symbol);
+
+        locals.push_back({name, scopeLevel, symbol,
+                          shadowed == localIndices.end() ? -1 : shadowed->second,
+                          slot});
+        localIndices[symbol] = locals.size() - 1;
+    }
+
+    void popLocal()
     {
-        locals.push_back({name, scopeLevel});
+        auto &local = locals.back();
+
+        if (local.shadowed == -1)
+        {
+            localIndices.erase(local.symbol);
+        }
+        else
+        {
+            localIndices[local.symbol] = local.shadowed;
+        }
+
+        locals.pop_back();
+    }
+
+    void addCell(const std::string &name)
+    {
+        cellNames.push_back(name);
+        cellIndices[internSymbol(name)] = cellNames.size() - 1;
     }
 
     void addConstant(const XPValue &value)
@@ -149,37 +196,38 @@ struct CodeObject : public Object
         constants.push_back(value);
     }
 
-    int getlocalIndex(const std::string &name)
+    /**
+     * Stack slot of the innermost local named `symbol`, or -1.
+     */
+    int getlocalIndex(SymbolId symbol)
     {
-        if (locals.size() > 0)
-        {
-            for (auto i = (int)locals.size() - 1; i >= 0; i--)
-            {
-                if (locals[i].name == name)
-                {
-                    return i;
-                }
-            }
-        }
+        auto local = localIndices.find(symbol);
+        return local == localIndices.end() ? -1 : locals[local->second].slot;
+    }
 
-        return -1;
+    /**
+     * Last cell named `symbol`, or -1.
+     */
+    int getCellIndex(SymbolId symbol)
+    {
+        auto cell = cellIndices.find(symbol);
+        return cell == cellIndices.end() ? -1 : cell->second;
     }
 
-    int getCellIndex(const std::string &name)
+    int getlocalIndex(const std::string &name)
     {
-        if (locals.size() > 0)
-        {
-            for (auto i = (int)cellNames.size() - 1; i >= 0; i--)
-            {
-                if (cellNames[i] == name)
-                {
-                    return i;
-                }
-            }
-        }
+        return getlocalIndex(internSymbol(name));
+    }
 
-        return -1;
+    int getCellIndex(const std::string &name)
+    {
+        return getCellIndex(internSymbol(name));
     }
+
+private:
+    std::unordered_map<SymbolId, int> localIndices;
+
+    std::unordered_map<SymbolId, int> cellIndices;
 };
 
 struct CellObject : public Object
@@ -196,38 +244,53 @@ struct FunctionObject : public Object
     std::vector<CellObject *> cells;
 };
 
-#define OBJECT(value) ((XPValue){XPValueType::OBJECT, .object = value})
-#define CELL(cellObject) OBJECT((Object *)cellObject)
-#define NUMBER(value) ((XPValue){XPValueType::NUMBER, .number = value})
-#define BOOLEAN(value) ((XPValue){XPValueType::BOOLEAN, .boolean = value})
-#define ALLOC_STRING(value) \
-    ((XPValue){XPValueType::OBJECT, .object = (Object *)new StringObject(value)})
-#define ALLOC_CODE(name, arity) \
-    ((XPValue){XPValueType::OBJECT, .object = (Object *)new CodeObject(name, arity)})
-#define ALLOC_NATIVE(fn, name, arity) \
-    ((XPValue){XPValueType::OBJECT, .object = (Object *)new NativeObject(fn, name, arity)})
+#ifdef XP_NAN_BOXING
+
+#define OBJECT(value) ((XPValue){SIGN_BIT | QNAN | (uint64_t)(uintptr_t)(value)})
+#define NUMBER(value) numberToValue(value)
+#define BOOLEAN(value) ((XPValue){(value) ? TRUE_BITS : FALSE_BITS})
 
-#define ALLOC_FUNCTION(co) \
-    ((XPValue){XPValueType::OBJECT, .object = (Object *)new FunctionObject(co)})
+#define AS_NUMBER(xPValue) valueToNumber(xPValue)
+#define AS_OBJECT(xPValue) ((Object *)(uintptr_t)((xPValue).bits & ~(SIGN_BIT | QNAN)))
+#define AS_BOOLEAN(xPValue) ((xPValue).bits == TRUE_BITS)
 
-#define ALLOC_CELL(value) \
-    ((XPValue){XPValueType::OBJECT, .object = (Object *)new CellObject(value)})
+#define IS_NUMBER(xpValue) (((xpValue).bits & QNAN) != QNAN)
+#define IS_OBJECT(xpValue) (((xpValue).bits & (QNAN | SIGN_BIT)) == (QNAN | SIGN_BIT))
+#define IS_BOOLEAN(xpValue) (((xpValue).bits | 1) == TRUE_BITS)
+
+#else
+
+#define OBJECT(value) ((XPValue){XPValueType::OBJECT, .object = (Object *)(value)})
+#define NUMBER(value) ((XPValue){XPValueType::NUMBER, .number = value})
+#define BOOLEAN(value) ((XPValue){XPValueType::BOOLEAN, .boolean = value})
 
 #define AS_NUMBER(xPValue) ((double)(xPValue).number)
 #define AS_OBJECT(xPValue) ((Object *)(xPValue).object)
 #define AS_BOOLEAN(xPValue) ((bool)(xPValue).boolean)
-#define AS_NATIVE(xPValue) ((NativeObject *)(xPValue).object)
-#define AS_FUNCTION(xPValue) ((FunctionObject *)(xPValue).object)
-#define AS_CELL(xPValue) ((CellObject *)(xPValue).object)
-
-#define AS_STRING(xPValue) ((StringObject *)(xPValue).object)
-#define AS_CODE(xPValue) ((CodeObject *)(xPValue).object)
-#define AS_CPPSTRING(xPValue) (AS_STRING(xPValue)->string)
 
 #define IS_NUMBER(xpValue) ((xpValue).type == XPValueType::NUMBER)
 #define IS_OBJECT(xpValue) ((xpValue).type == XPValueType::OBJECT)
 #define IS_BOOLEAN(xpValue) ((xpValue).type == XPValueType::BOOLEAN)
 
+#endif
+
+#define CELL(cellObject) OBJECT((Object *)cellObject)
+#define ALLOC_STRING(value) OBJECT(new StringObject(value))
+#define ALLOC_CODE(name, arity) OBJECT(new CodeObject(name, arity))
+#define ALLOC_NATIVE(fn, name, arity) OBJECT(new NativeObject(fn, name, arity))
+
+#define ALLOC_FUNCTION(co) OBJECT(new FunctionObject(co))
+
+#define ALLOC_CELL(value) OBJECT(new CellObject(value))
+
+#define AS_NATIVE(xPValue) ((NativeObject *)AS_OBJECT(xPValue))
+#define AS_FUNCTION(xPValue) ((FunctionObject *)AS_OBJECT(xPValue))
+#define AS_CELL(xPValue) ((CellObject *)AS_OBJECT(xPValue))
+
+#define AS_STRING(xPValue) ((StringObject *)AS_OBJECT(xPValue))
+#define AS_CODE(xPValue) ((CodeObject *)AS_OBJECT(xPValue))
+#define AS_CPPSTRING(xPValue) (AS_STRING(xPValue)->string)
+
 #define IS_OBJECT_TYPE(xpValue, objectType) \
     (IS_OBJECT(xpValue) && AS_OBJECT(xpValue)->type == objectType)
 
@@ -269,7 +332,7 @@ std::string xpValueToTypeString(const XPValue &value)
     }
     else
     {
-        DIE << "xpValueToTypeString unknown type: " << (int)value.type;
+        DIE << "xpValueToTypeString unknown type";
     }
     return "";
 }
@@ -280,11 +343,11 @@ std::string xpValueToConstantString(const XPValue &value)
 
     if (IS_NUMBER(value))
     {
-        ss << value.number;
+        ss << AS_NUMBER(value);
     }
     else if (IS_BOOLEAN(value))
     {
-        ss << (value.boolean == true ? "true" : "false");
+        ss << (AS_BOOLEAN(value) ? "true" : "false");
     }
     else if (IS_STRING(value))
     {
@@ -312,7 +375,7 @@ std::string xpValueToConstantString(const XPValue &value)
     }
     else
     {
-        DIE << "xpValueToConstantString unknown value: " << (int)value.type;
+        DIE << "xpValueToConstantString unknown value";
     }
 
     return ss.str();
@@ -1,13 +1,21 @@
 #ifndef global_var_h
 #define global_var_h
 
+#include <unordered_map>
 #include <vector>
 #include "XPValue.h"
+#include "symbolTable.h"
 
 struct GlobalVar
 {
     std::string name;
     XPValue value;
+
+    /**
+     * Registered with addConst: never reassigned, so the compiler inlines
+     * its value.
+     */
+    bool constant = false;
 };
 
 struct Global
@@ -27,20 +35,15 @@ struct Global
         globals[index].value = value;
     }
 
-    int getGlobalIndex(const std::string &name)
+    int getGlobalIndex(SymbolId symbol)
     {
-        if (globals.size() > 0)
-        {
-            for (auto i = (int)globals.size() - 1; i >= 0; i--)
-            {
-                if (globals[i].name == name)
-                {
-                    return i;
-                }
-            }
-        }
+        auto index = indices.find(symbol);
+        return index == indices.end() ? -1 : index->second;
+    }
 
-        return -1;
+    int getGlobalIndex(const std::string &name)
+    {
+        return getGlobalIndex(internSymbol(name));
     }
 
     void define(const std::string &name)
@@ -52,7 +55,7 @@ struct Global
             return;
         }
 
-        globals.push_back({name, NUMBER(0)});
+        add({name, NUMBER(0)});
     }
 
     void addNativeFunction(const std::string &name, std::function<void()> fn, size_t arity)
@@ -63,7 +66,7 @@ struct Global
             return;
         }
 
-        globals.push_back({name, ALLOC_NATIVE(fn, name, arity)});
+        add({name, ALLOC_NATIVE(fn, name, arity)});
     }
 
     void addConst(const std::string &name, double value)
@@ -73,7 +76,18 @@ struct Global
             return;
         }
 
-        globals.push_back({name, NUMBER(value)});
+        add({name, NUMBER(value), true});
+    }
+
+    bool isConstant(SymbolId symbol)
+    {
+        auto index = getGlobalIndex(symbol);
+        return index != -1 && globals[index].constant;
+    }
+
+    bool isConstant(const std::string &name)
+    {
+        return isConstant(internSymbol(name));
     }
 
     bool exists(const std::string &name)
@@ -81,7 +95,30 @@ struct Global
         return getGlobalIndex(name) != -1;
     }
 
+    /**
+     * Replaces the whole table (see XPImage::load).
+     */
+    void assign(std::vector<GlobalVar> vars)
+    {
+        globals.clear();
+        indices.clear();
+
+        for (auto &var : vars)
+        {
+            add(std::move(var));
+        }
+    }
+
     std::vector<GlobalVar> globals;
+
+private:
+    void add(GlobalVar var)
+    {
+        indices[internSymbol(var.name)] = globals.size();
+        globals.push_back(std::move(var));
+    }
+
+    std::unordered_map<SymbolId, int> indices;
 };
 
 #endif
\ No newline at end of file
@@ -0,0 +1,80 @@
+#ifndef __opcode_profiler_h
+#define __opcode_profiler_h
+
+#include <algorithm>
+#include <iomanip>
+#include <iostream>
+#include <unordered_map>
+#include <vector>
+#include "../bytecode/OpCode.h"
+
+#define PROFILE_TOP_COUNT 20
+
+/**
+ * Counts executed opcode pairs and triples (XP_PROFILE_OPCODES builds).
+ */
+struct OpcodeProfiler
+{
+    void record(uint8_t opcode)
+    {
+        history = ((history << 8) | opcode) & 0xffffff;
+        executed++;
+
+        if (executed >= 2)
+        {
+            pairs[history & 0xffff]++;
+        }
+
+        if (executed >= 3)
+        {
+            triples[history]++;
+        }
+    }
+
+    void dump()
+    {
+        std::cout << "\n---------- Opcode profile ----------\n\n"
+                  << "Instructions executed: " << std::dec << executed << "\n";
+
+        dumpTop("pairs", pairs, 2);
+        dumpTop("triples", triples, 3);
+    }
+
+private:
+    void dumpTop(const std::string &title,
+                 const std::unordered_map<uint32_t, size_t> &counts,
+                 size_t length)
+    {
+        std::vector<std::pair<uint32_t, size_t>> sorted(counts.begin(), counts.end());
+
+        std::sort(sorted.begin(), sorted.end(), [](const auto &a, const auto &b)
+                  { return a.second > b.second; });
+
+        std::cout << "\nTop " << title << ":\n\n";
+
+        for (size_t i = 0; i < sorted.size() && i < PROFILE_TOP_COUNT; i++)
+        {
+            auto sequence = sorted[i].first;
+
+            std::cout << std::setw(12) << sorted[i].second << "  ";
+
+            for (auto j = length; j > 0; j--)
+            {
+                std::cout << opcodeToString((sequence >> ((j - 1) * 8)) & 0xff)
+                          << (j > 1 ? " " : "");
+            }
+
+            std::cout << "\n";
+        }
+    }
+
+    uint32_t history = 0;
+
+    size_t executed = 0;
+
+    std::unordered_map<uint32_t, size_t> pairs;
+
+    std::unordered_map<uint32_t, size_t> triples;
+};
+
+#endif
@@ -0,0 +1,134 @@
+#ifndef __symbolTable_h
+#define __symbolTable_h
+
+#include <cstdint>
+#include <deque>
+#include <string>
+#include <unordered_map>
+
+/**
+ * Interned name. Equal names have equal ids, so the compiler's name
+ * tables (Global, Scope, CodeObject) hash and compare integers.
+ */
+using SymbolId = uint32_t;
+
+/**
+ * Names of the special forms and literals, interned first by every
+ * SymbolTable, so their ids are these constants: the compiler passes
+ * dispatch with a `switch` on Exp::symbol. The comparisons are in the
+ * order of the COMPARE operand (see compareOp).
+ */
+enum SpecialSymbol : SymbolId
+{
+    SYM_ADD,
+    SYM_SUB,
+    SYM_MUL,
+    SYM_DIV,
+    SYM_LT,
+    SYM_GT,
+    SYM_EQ,
+    SYM_GE,
+    SYM_LE,
+    SYM_NE,
+    SYM_IF,
+    SYM_WHILE,
+    SYM_VAR,
+    SYM_SET,
+    SYM_BEGIN,
+    SYM_DEF,
+    SYM_LAMBDA,
+    SYM_TRUE,
+    SYM_FALSE,
+    SPECIAL_SYMBOLS_COUNT,
+};
+
+/**
+ * Whether `symbol` is the tag of a special form (rather than a call).
+ */
+inline bool isSpecialForm(SymbolId symbol)
+{
+    return symbol <= SYM_LAMBDA;
+}
+
+inline bool isCompareOp(SymbolId symbol)
+{
+    return symbol >= SYM_LT && symbol <= SYM_NE;
+}
+
+/**
+ * COMPARE operand of a comparison symbol.
+ */
+inline uint8_t compareOp(SymbolId symbol)
+{
+    return symbol - SYM_LT;
+}
+
+inline bool isBooleanSymbol(SymbolId symbol)
+{
+    return symbol == SYM_TRUE || symbol == SYM_FALSE;
+}
+
+class SymbolTable
+{
+public:
+    SymbolTable()
+    {
+        static const char *specialNames[SPECIAL_SYMBOLS_COUNT] = {
+            "+", "-", "*", "/",
+            "<", ">", "==", ">=", "<=", "!=",
+            "if", "while", "var", "set", "begin", "def", "lambda",
+            "true", "false"};
+
+        for (auto name : specialNames)
+        {
+            intern(name);
+        }
+    }
+
+    SymbolId intern(const std::string &name)
+    {
+        auto symbol = ids.find(name);
+
+        if (symbol != ids.end())
+        {
+            return symbol->second;
+        }
+
+        names.push_back(name);
+        return ids[name] = names.size() - 1;
+    }
+
+    const std::string &name(SymbolId symbol)
+    {
+        return names[symbol];
+    }
+
+private:
+    std::unordered_map<std::string, SymbolId> ids;
+
+    /**
+     * Interning never moves the names, so references to them stay valid
+     * (see Exp::string).
+     */
+    std::deque<std::string> names;
+};
+
+/**
+ * Process-wide table: ids are shared by every VM and compiler. Symbols
+ * are never freed, so it grows with the distinct names of the programs
+ * compiled, not with their size: string literals are kept in the AST
+ * (see ExpArena), and the compiler's own names are a fixed set (see
+ * Inliner).
+ */
+SymbolTable &symbols()
+{
+    static SymbolTable table;
+    return table;
+}
+
+SymbolId internSymbol(const std::string &name)
+{
+    return symbols().intern(name);
+}
+
+#endif
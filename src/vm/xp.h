@@ -2,29 +2,93 @@
 #define __xp_h
 
 #include <iostream>
-#include <array>
+#include <algorithm>
 #include <string>
-#include <stack>
 #include <vector>
 
 #include "../Logger.h"
 #include "../bytecode/OpCode.h"
 #include "../parser/XPParser.h"
+#include "../parser/formReader.h"
 #include "../compiler/XPCompiler.h"
+#include "../gc/XPCollector.h"
+#include "../image/XPImage.h"
 #include "XPValue.h"
+#include "XPStack.h"
 #include "globalVar.h"
+#include "opcodeProfiler.h"
 
 using syntax::XPParser;
 
 #define READ_BYTE() *ip++
 
-#define STACK_LIMIT 512
+/**
+ * Instruction dispatch. GCC and Clang support labels as values, so each
+ * handler jumps straight to the next one through a table of label
+ * addresses (direct threading). Other compilers, or builds with
+ * XP_SWITCH_DISPATCH defined, use the portable switch loop.
+ */
+#if (defined(__GNUC__) || defined(__clang__)) && !defined(XP_SWITCH_DISPATCH)
+#define XP_COMPUTED_GOTO
+#endif
+
+/**
+ * Build with XP_PROFILE_OPCODES defined to count executed opcode pairs
+ * and triples; the VM prints the most frequent ones on exit. Used to
+ * pick the superinstructions.
+ */
+#ifdef XP_PROFILE_OPCODES
+#define PROFILE_INSTRUCTION() profiler.record(*ip)
+#else
+#define PROFILE_INSTRUCTION()
+#endif
+
+#ifdef XP_COMPUTED_GOTO
+#define INSTRUCTION(opcode) L_##opcode
+#define UNKNOWN_INSTRUCTION() UNKNOWN_OPCODE
+#define DISPATCH()                         \
+    do                                     \
+    {                                      \
+        PROFILE_INSTRUCTION();             \
+        goto *dispatchTable[READ_BYTE()];  \
+    } while (false)
+#else
+#define INSTRUCTION(opcode) case OP_##opcode
+#define UNKNOWN_INSTRUCTION() default
+#define DISPATCH() continue
+#endif
+
+/**
+ * Default size of the VM stack, in value slots.
+ */
+#ifndef STACK_LIMIT
+#define STACK_LIMIT (1024 * 1024)
+#endif
+
+/**
+ * Slots above a frame's precomputed max height that natives and the
+ * slow paths of the superinstructions may push to.
+ */
+#define STACK_RESERVE 2
+
+#ifndef GC_THRESHOLD
+#define GC_THRESHOLD (1024 * 1024)
+#endif
+
+/**
+ * Free nursery space guaranteed after every GC safe point; enough for
+ * the allocations of any single instruction.
+ */
+#define NURSERY_RESERVE 1024
 
 #define GET_CONST() (fn->co->constants[READ_BYTE()])
 
 #define READ_SHORT() (ip += 2, (uint16_t)((ip[-2] << 8) | ip[-1]))
 
-#define TO_ADDRESS(index) (&fn->co->code[index])
+#define READ_WORD() \
+    (ip += 4, ((uint32_t)ip[-4] << 24) | ((uint32_t)ip[-3] << 16) | ((uint32_t)ip[-2] << 8) | ip[-1])
+
+#define TO_ADDRESS(index) (fn->co->entry + (index))
 
 #define BINARY_OP(op)                \
     do                               \
@@ -34,37 +98,78 @@ using syntax::XPParser;
         push(NUMBER(op1 op op2));    \
     } while (false)
 
-#define COMPARE_VALUES(op, op1, op2) \
-    do                               \
-    {                                \
-        bool res;                    \
-        switch (op)                  \
-        {                            \
-        case 0:                      \
-            res = op1 < op2;         \
-            break;                   \
-        case 1:                      \
-            res = op1 > op2;         \
-            break;                   \
-        case 2:                      \
-            res = op1 == op2;        \
-            break;                   \
-        case 3:                      \
-            res = op1 >= op2;        \
-            break;                   \
-        case 4:                      \
-            res = op1 <= op2;        \
-            break;                   \
-        case 5:                      \
-            res = op1 != op2;        \
-            break;                   \
-        }                            \
-        push(BOOLEAN(res));          \
+/**
+ * Unchecked operation on the two topmost values, which the compiler has
+ * proven to be numbers; `box` makes the result value.
+ */
+#define NUMBER_OP(op, box)                  \
+    do                                      \
+    {                                       \
+        auto op2 = AS_NUMBER(peek(0));      \
+        auto op1 = AS_NUMBER(peek(1));      \
+        popN(2);                            \
+        push(box(op1 op op2));              \
     } while (false)
 
+/**
+ * JMP_IF_NOT_<op>: compares the two topmost values and jumps if the
+ * comparison is false. `kind` is the COMPARE operand, for the generic
+ * path.
+ */
+#define COMPARE_JMP_IF_NOT(op, kind)                            \
+    do                                                          \
+    {                                                           \
+        auto address = READ_SHORT();                            \
+        auto op2 = peek(0);                                     \
+        auto op1 = peek(1);                                     \
+        bool cond;                                              \
+        if (IS_NUMBER(op1) && IS_NUMBER(op2))                   \
+        {                                                       \
+            popN(2);                                            \
+            cond = AS_NUMBER(op1) op AS_NUMBER(op2);            \
+        }                                                       \
+        else                                                    \
+        {                                                       \
+            compare(kind);                                      \
+            cond = AS_BOOLEAN(pop());                           \
+        }                                                       \
+        if (!cond)                                              \
+        {                                                       \
+            ip = TO_ADDRESS(address);                           \
+        }                                                       \
+    } while (false)
+
+#define COMPARE_VALUES(op, op1, op2) push(BOOLEAN(compareValues(op, op1, op2)))
+
+/**
+ * Quickened COMPARE of two numbers; falls back to the generic compare,
+ * which re-quickens the instruction, if either operand isn't a number.
+ */
+#define COMPARE_NUM(op)                                             \
+    do                                                              \
+    {                                                               \
+        auto op2 = peek(0);                                         \
+        auto op1 = peek(1);                                         \
+        if (IS_NUMBER(op1) && IS_NUMBER(op2))                       \
+        {                                                           \
+            ip++;                                                   \
+            popN(2);                                                \
+            push(BOOLEAN(AS_NUMBER(op1) op AS_NUMBER(op2)));        \
+        }                                                           \
+        else                                                        \
+        {                                                           \
+            quickenCompare(ip - 1);                                 \
+            compare(READ_BYTE());                                   \
+        }                                                           \
+    } while (false)
+
+/**
+ * Frame record of a call, stored inline in the value stack right below
+ * the callee slot: [record][callee][args][locals...]. The callee's bp
+ * points at the callee slot.
+ */
 struct Frame
 {
-
     uint8_t *ra;
 
     XPValue *bp;
@@ -72,34 +177,52 @@ struct Frame
     FunctionObject *fn;
 };
 
+#define FRAME_SLOTS ((sizeof(Frame) + sizeof(XPValue) - 1) / sizeof(XPValue))
+
+#define FRAME_OF(base) ((Frame *)((base) - FRAME_SLOTS))
+
 class XPVM
 {
 public:
-    XPVM() : global(std::make_shared<Global>()),
-             parser(std::make_unique<XPParser>()),
-             compiler(std::make_unique<XPCompiler>(global))
+    XPVM(size_t stackLimit = STACK_LIMIT)
+        : heap(std::make_unique<XPHeap>()),
+          global(std::make_shared<Global>()),
+          parser(std::make_unique<XPParser>()),
+          compiler(std::make_unique<XPCompiler>(global)),
+          stack(stackLimit),
+          collector(std::make_unique<XPCollector>(heap.get()))
     {
+        Traceable::heap = heap.get();
         setGlobalVariables();
     }
 
     ~XPVM()
     {
-        Traceable::cleanup();
+#ifdef XP_PROFILE_OPCODES
+        profiler.dump();
+#endif
+
+        heap->cleanup();
+
+        if (Traceable::heap == heap.get())
+        {
+            Traceable::heap = nullptr;
+        }
     }
 
+    /**
+     * No overflow check: the space for a frame's pushes is committed once,
+     * when the frame is entered.
+     */
     void push(const XPValue &value)
     {
-        if ((size_t)(sp - stack.begin()) == STACK_LIMIT)
-        {
-            DIE << "stack overflow!";
-        }
         *sp = value;
         sp++;
     }
 
     XPValue pop()
     {
-        if (sp == stack.begin())
+        if (sp == stack.begin)
         {
             DIE << "pop(): empty stack!";
         }
@@ -109,257 +232,979 @@ public:
 
     XPValue peek(size_t offset = 0)
     {
-        if (stack.size() == 0)
-        {
-            DIE << "peek(): empty stack.\n";
-        }
-
         return *(sp - 1 - offset);
     }
 
     void popN(size_t count)
     {
-        if (stack.size() == 0)
-        {
-            DIE << "popN(): empty stack.\n";
-        }
-
         sp -= count;
     }
 
     XPValue exec(const std::string &program)
 
     {
+        auto main = compile(program);
+
+        compiler->disassembleByteCode();
+
+        return run(main);
+    }
+
+    /**
+     * Options for the next compilations (XPCompiler::optimize, ...).
+     */
+    XPCompiler &getCompiler()
+    {
+        return *compiler;
+    }
+
+    /**
+     * Compiles a program without running it, for run().
+     */
+    FunctionObject *compile(const std::string &program)
+    {
+        Traceable::heap = heap.get();
+
         auto ast = parser->parse("(begin " + program + ")");
 
         compiler->compile(ast);
 
-        fn = compiler->getMainFunction();
+        return compiler->getMainFunction();
+    }
+
+    /**
+     * Runs top-level forms in the session of the earlier calls, e.g. from
+     * a REPL: they see the globals defined so far. Only the new forms are
+     * parsed and compiled (see XPCompiler::compileIncremental), so a call
+     * costs the same however much was loaded before it. Unlike exec, it
+     * doesn't print the disassembly, which execFile would print for every
+     * form.
+     */
+    XPValue execIncremental(const std::string &forms)
+    {
+        Traceable::heap = heap.get();
+
+        auto ast = parser->parse("(begin " + forms + ")");
 
-        ip = &fn->co->code[0];
+        compiler->compileIncremental(ast);
 
-        sp = &stack[0];
+        return run(compiler->getMainFunction());
+    }
+
+    /**
+     * Runs a program file, as a session (see execIncremental) of its
+     * top-level forms: each form is parsed, compiled and run as soon as
+     * it's read, and its AST is discarded before the next one (see
+     * FormReader), and its code is released once it has run (see
+     * XPCompiler::releaseMain).
+     * Returns the value of the last form, or false if there is none.
+     */
+    XPValue execFile(const std::string &path)
+    {
+        auto fd = open(path.c_str(), O_RDONLY);
+
+        if (fd == -1)
+        {
+            DIE << "execFile: can't open " << path;
+        }
+
+        auto result = execStream(fd);
+        close(fd);
+
+        return result;
+    }
+
+    /**
+     * Runs a program read from `fd` (a file, or a pipe), like execFile.
+     */
+    XPValue execStream(int fd)
+    {
+        FormReader reader(fd);
+        std::string_view form;
+
+        // An empty program has no last form: its value is false.
+        if (!reader.next(form))
+        {
+            return BOOLEAN(false);
+        }
+
+        for (;;)
+        {
+            auto result = execIncremental(std::string(form));
+            compiler->releaseMain();
+
+            if (!reader.next(form))
+            {
+                return result;
+            }
+
+            // A form which doesn't allocate never reaches a safe point in
+            // eval, so the released code is collected here.
+            maybeGC();
+        }
+    }
+
+    /**
+     * Compiles a program into an .xpc image, for execImage.
+     */
+    void compileToImage(const std::string &program, const std::string &path)
+    {
+        ImageWriter().write(path, compile(program), *global);
+    }
+
+    /**
+     * Runs a compiled image, without parsing or compiling. Natives are
+     * bound by name to this VM's ones.
+     */
+    XPValue execImage(const std::string &path)
+    {
+        Traceable::heap = heap.get();
+
+        images.push_back(std::make_unique<XPImage>(path));
+
+        auto main = images.back()->load(*global, imageObjects);
+
+        return run(main);
+    }
+
+    /**
+     * Runs a main function from its first instruction.
+     */
+    XPValue run(FunctionObject *main)
+    {
+        fn = main;
+
+        ip = fn->co->entry;
+
+        sp = stack.begin;
 
         bp = sp;
 
-        compiler->disassembleByteCode();
+        stack.ensure(bp + fn->co->maxStack + STACK_RESERVE);
+
+        heap->nurseryEnabled = true;
+        auto result = eval();
+        heap->nurseryEnabled = false;
 
-        return eval();
+        return result;
     }
 
     XPValue eval()
     {
+#ifdef XP_COMPUTED_GOTO
+        static void *dispatchTable[256];
+
+        if (dispatchTable[OP_HALT] == nullptr)
+        {
+            for (auto &label : dispatchTable)
+            {
+                label = &&UNKNOWN_OPCODE;
+            }
+#define SET_LABEL(opcode) dispatchTable[OP_##opcode] = &&L_##opcode;
+            OPCODE_LIST(SET_LABEL)
+#undef SET_LABEL
+        }
+
+        DISPATCH();
+#else
         for (;;)
         {
-            // dumpStack();
-            auto opcode = READ_BYTE();
+            PROFILE_INSTRUCTION();
 
-            switch (opcode)
+            switch (READ_BYTE())
             {
-            case OP_HALT:
-                return pop();
+#endif
+        INSTRUCTION(HALT):
+            return pop();
 
-            case OP_CONST:
-                push(GET_CONST());
-                break;
+        INSTRUCTION(CONST):
+            push(GET_CONST());
+            DISPATCH();
 
-            case OP_ADD:
-            {
-                auto op2 = pop();
-                auto op1 = pop();
+        INSTRUCTION(ADD):
+            quickenAdd(ip - 1);
+            add();
+            DISPATCH();
 
-                if (IS_NUMBER(op1) && IS_NUMBER(op2))
-                {
-                    push(NUMBER(AS_NUMBER(op1) + AS_NUMBER(op2)));
-                }
-                else if (IS_STRING(op1) && IS_STRING(op2))
-                {
-                    auto s1 = AS_CPPSTRING(op1);
-                    auto s2 = AS_CPPSTRING(op2);
-                    push(ALLOC_STRING(s1 + s2));
-                }
-                break;
+        INSTRUCTION(ADD_NUM):
+        {
+            auto op2 = peek(0);
+            auto op1 = peek(1);
+
+            if (IS_NUMBER(op1) && IS_NUMBER(op2))
+            {
+                popN(2);
+                push(NUMBER(AS_NUMBER(op1) + AS_NUMBER(op2)));
             }
+            else
+            {
+                quickenAdd(ip - 1);
+                add();
+            }
+            DISPATCH();
+        }
 
-            case OP_DIV:
-                BINARY_OP(/);
-                break;
-            case OP_MUL:
-                BINARY_OP(*);
-                break;
-            case OP_SUB:
-                BINARY_OP(-);
-                break;
-            case OP_COMPARE:
+        INSTRUCTION(ADD_STR):
+            if (IS_STRING(peek(0)) && IS_STRING(peek(1)))
+            {
+                concat();
+            }
+            else
             {
-                auto op = READ_BYTE();
+                quickenAdd(ip - 1);
+                add();
+            }
+            DISPATCH();
 
-                auto op2 = pop();
-                auto op1 = pop();
+        INSTRUCTION(ADD_LOCAL_LOCAL):
+        {
+            auto op1 = bp[READ_BYTE()];
+            auto op2 = bp[READ_BYTE()];
+            addValues(op1, op2);
+            DISPATCH();
+        }
 
-                if (IS_NUMBER(op2) && IS_NUMBER(op1))
-                {
-                    COMPARE_VALUES(op, AS_NUMBER(op1), AS_NUMBER(op2));
-                }
-                else if (IS_STRING(op1) && IS_STRING(op2))
-                {
-                    COMPARE_VALUES(op, AS_CPPSTRING(op1), AS_CPPSTRING(op2));
-                }
-                break;
-            }
+        INSTRUCTION(ADD_LOCAL_CONST):
+        {
+            auto op1 = bp[READ_BYTE()];
+            auto op2 = GET_CONST();
+            addValues(op1, op2);
+            DISPATCH();
+        }
 
-            case OP_JMP_IF_FALSE:
+        INSTRUCTION(DIV):
+            BINARY_OP(/);
+            DISPATCH();
+        INSTRUCTION(MUL):
+            BINARY_OP(*);
+            DISPATCH();
+        INSTRUCTION(SUB):
+            BINARY_OP(-);
+            DISPATCH();
+        INSTRUCTION(COMPARE):
+            quickenCompare(ip - 1);
+            compare(READ_BYTE());
+            DISPATCH();
+
+        INSTRUCTION(LT_NUM):
+            COMPARE_NUM(<);
+            DISPATCH();
+        INSTRUCTION(GT_NUM):
+            COMPARE_NUM(>);
+            DISPATCH();
+        INSTRUCTION(EQ_NUM):
+            COMPARE_NUM(==);
+            DISPATCH();
+        INSTRUCTION(GE_NUM):
+            COMPARE_NUM(>=);
+            DISPATCH();
+        INSTRUCTION(LE_NUM):
+            COMPARE_NUM(<=);
+            DISPATCH();
+        INSTRUCTION(NE_NUM):
+            COMPARE_NUM(!=);
+            DISPATCH();
+
+        INSTRUCTION(NUM_ADD):
+            NUMBER_OP(+, NUMBER);
+            DISPATCH();
+        INSTRUCTION(NUM_LT):
+            NUMBER_OP(<, BOOLEAN);
+            DISPATCH();
+        INSTRUCTION(NUM_GT):
+            NUMBER_OP(>, BOOLEAN);
+            DISPATCH();
+        INSTRUCTION(NUM_EQ):
+            NUMBER_OP(==, BOOLEAN);
+            DISPATCH();
+        INSTRUCTION(NUM_GE):
+            NUMBER_OP(>=, BOOLEAN);
+            DISPATCH();
+        INSTRUCTION(NUM_LE):
+            NUMBER_OP(<=, BOOLEAN);
+            DISPATCH();
+        INSTRUCTION(NUM_NE):
+            NUMBER_OP(!=, BOOLEAN);
+            DISPATCH();
+
+        INSTRUCTION(COMPARE_LOCAL_CONST_JMP_IF_FALSE):
+        {
+            auto op1 = bp[READ_BYTE()];
+            auto op2 = GET_CONST();
+            auto op = READ_BYTE();
+            auto address = READ_SHORT();
+            compareJmpIfFalse(op1, op2, op, address);
+            DISPATCH();
+        }
+
+        INSTRUCTION(JMP_IF_FALSE):
+        {
+
+            auto cond = condition(pop());
+
+            auto address = READ_SHORT();
+
+            if (!cond)
             {
+                ip = TO_ADDRESS(address);
+            }
+            DISPATCH();
+        }
+
+        INSTRUCTION(JMP_IF_NOT_LT):
+            COMPARE_JMP_IF_NOT(<, 0);
+            DISPATCH();
+        INSTRUCTION(JMP_IF_NOT_GT):
+            COMPARE_JMP_IF_NOT(>, 1);
+            DISPATCH();
+        INSTRUCTION(JMP_IF_NOT_EQ):
+            COMPARE_JMP_IF_NOT(==, 2);
+            DISPATCH();
+        INSTRUCTION(JMP_IF_NOT_GE):
+            COMPARE_JMP_IF_NOT(>=, 3);
+            DISPATCH();
+        INSTRUCTION(JMP_IF_NOT_LE):
+            COMPARE_JMP_IF_NOT(<=, 4);
+            DISPATCH();
+        INSTRUCTION(JMP_IF_NOT_NE):
+            COMPARE_JMP_IF_NOT(!=, 5);
+            DISPATCH();
+
+        INSTRUCTION(JMP):
+            ip = TO_ADDRESS(READ_SHORT());
+            DISPATCH();
+
+        INSTRUCTION(LOOP):
+        {
+            // Every loop iteration passes here: the place for interrupt
+            // and fuel checks.
+            auto distance = READ_SHORT();
+            ip -= distance;
+            DISPATCH();
+        }
+        INSTRUCTION(GET_GLOBAL):
+        {
+            auto globalIndex = READ_BYTE();
+            push(global->get(globalIndex).value);
+            DISPATCH();
+        }
+        INSTRUCTION(SET_GLOBAL):
+        {
+            auto globalIndex = READ_BYTE();
+            auto value = peek(0);
+            global->set(globalIndex, value);
+            DISPATCH();
+        }
+        INSTRUCTION(POP):
+            pop();
+            DISPATCH();
+        INSTRUCTION(GET_LOCAL):
+        {
+            auto localIndex = READ_BYTE();
+            push(bp[localIndex]);
+            DISPATCH();
+        }
+        INSTRUCTION(SET_LOCAL):
+        {
+            auto localIndex = READ_BYTE();
+            auto value = peek(0);
+            bp[localIndex] = value;
+            DISPATCH();
+        }
+
+        // The caller's frame is the parent declaring the local: these are
+        // only emitted in functions which don't escape it.
+        INSTRUCTION(GET_PARENT_LOCAL):
+        {
+            auto localIndex = READ_BYTE();
+            push(FRAME_OF(bp)->bp[localIndex]);
+            DISPATCH();
+        }
+        INSTRUCTION(SET_PARENT_LOCAL):
+        {
+            auto localIndex = READ_BYTE();
+            FRAME_OF(bp)->bp[localIndex] = peek(0);
+            DISPATCH();
+        }
+
+        INSTRUCTION(GET_CELL):
+        {
+            auto cellIndex = READ_BYTE();
+            push(fn->cells[cellIndex]->value);
+            DISPATCH();
+        }
 
-                auto cond = AS_BOOLEAN(pop());
+        INSTRUCTION(SET_CELL):
+            setCell(READ_BYTE());
+            DISPATCH();
 
-                auto address = READ_SHORT();
+        INSTRUCTION(SET_CELL_POP):
+            setCell(READ_BYTE());
+            pop();
+            DISPATCH();
 
-                if (!cond)
+        INSTRUCTION(LOAD_CELL):
+        {
+            auto cellIndex = READ_BYTE();
+            push(CELL(fn->cells[cellIndex]));
+            DISPATCH();
+        }
+
+        INSTRUCTION(MAKE_FUNCTION):
+            makeFunction(READ_BYTE());
+            DISPATCH();
+
+        INSTRUCTION(SCOPE_EXIT):
+            scopeExit(READ_BYTE());
+            DISPATCH();
+
+        INSTRUCTION(CALL):
+            call(READ_BYTE());
+            DISPATCH();
+
+        INSTRUCTION(TAIL_CALL):
+            tailCall(READ_BYTE());
+            DISPATCH();
+
+        INSTRUCTION(RETURN):
+        {
+            // The result replaces the frame record.
+            auto result = peek(0);
+            auto frame = FRAME_OF(bp);
+
+            ip = frame->ra;
+            bp = frame->bp;
+            fn = frame->fn;
+
+            sp = (XPValue *)frame;
+            push(result);
+            DISPATCH();
+        }
+
+        INSTRUCTION(WIDE):
+        {
+            // Same instructions with 32-bit operands; only emitted for
+            // indices and jump addresses out of the normal range.
+            switch (READ_BYTE())
+            {
+            case OP_CONST:
+                push(fn->co->constants[READ_WORD()]);
+                break;
+            case OP_COMPARE:
+                compare(READ_WORD());
+                break;
+            case OP_JMP_IF_FALSE:
+            {
+                auto address = READ_WORD();
+                if (!condition(pop()))
                 {
                     ip = TO_ADDRESS(address);
                 }
                 break;
             }
-            case OP_JMP:
-                ip = TO_ADDRESS(READ_SHORT());
-                break;
-            case OP_GET_GLOBAL:
+            case OP_JMP_IF_NOT_LT:
+            case OP_JMP_IF_NOT_GT:
+            case OP_JMP_IF_NOT_EQ:
+            case OP_JMP_IF_NOT_GE:
+            case OP_JMP_IF_NOT_LE:
+            case OP_JMP_IF_NOT_NE:
             {
-                auto globalIndex = READ_BYTE();
-                push(global->get(globalIndex).value);
+                uint8_t op = ip[-1] - OP_JMP_IF_NOT_LT;
+                auto op2 = pop();
+                auto op1 = pop();
+                compareJmpIfFalse(op1, op2, op, READ_WORD());
                 break;
             }
-            case OP_SET_GLOBAL:
+            case OP_JMP:
+                ip = TO_ADDRESS(READ_WORD());
+                break;
+            case OP_LOOP:
             {
-                auto globalIndex = READ_BYTE();
-                // auto value = peek(0);
-                auto value = pop();
-                global->set(globalIndex, value);
+                auto distance = READ_WORD();
+                ip -= distance;
                 break;
             }
-            case OP_POP:
-                pop();
+            case OP_GET_GLOBAL:
+                push(global->get(READ_WORD()).value);
+                break;
+            case OP_SET_GLOBAL:
+                global->set(READ_WORD(), peek(0));
                 break;
             case OP_GET_LOCAL:
-            {
-                auto localIndex = READ_BYTE();
-                if (localIndex < 0 || localIndex >= stack.size())
-                {
-                    DIE << "OP_GET_LOCAL Invalid varibale index: " << (int)localIndex;
-                }
-                push(bp[localIndex]);
+                push(bp[READ_WORD()]);
                 break;
-            }
             case OP_SET_LOCAL:
-            {
-                auto localIndex = READ_BYTE();
-                auto value = peek(0);
-                if (localIndex < 0 || localIndex >= stack.size())
-                {
-                    DIE << "OP_SET_LOCAL Invalid varibale index: " << (int)localIndex;
-                }
-                bp[localIndex] = value;
+                bp[READ_WORD()] = peek(0);
+                break;
+            case OP_GET_PARENT_LOCAL:
+                push(FRAME_OF(bp)->bp[READ_WORD()]);
+                break;
+            case OP_SET_PARENT_LOCAL:
+                FRAME_OF(bp)->bp[READ_WORD()] = peek(0);
                 break;
-            }
-
             case OP_GET_CELL:
+                push(fn->cells[READ_WORD()]->value);
+                break;
+            case OP_SET_CELL:
+                setCell(READ_WORD());
+                break;
+            case OP_SET_CELL_POP:
+                setCell(READ_WORD());
+                pop();
+                break;
+            case OP_LOAD_CELL:
+                push(CELL(fn->cells[READ_WORD()]));
+                break;
+            case OP_MAKE_FUNCTION:
+                makeFunction(READ_WORD());
+                break;
+            case OP_SCOPE_EXIT:
+                scopeExit(READ_WORD());
+                break;
+            case OP_CALL:
+                call(READ_WORD());
+                break;
+            case OP_TAIL_CALL:
+                tailCall(READ_WORD());
+                break;
+            case OP_ADD_LOCAL_LOCAL:
             {
-                auto cellIndex = READ_BYTE();
-                push(fn->cells[cellIndex]->value);
+                auto op1 = bp[READ_WORD()];
+                auto op2 = bp[READ_WORD()];
+                addValues(op1, op2);
                 break;
             }
-
-            case OP_SET_CELL:
+            case OP_ADD_LOCAL_CONST:
             {
-                auto cellIndex = READ_BYTE();
-                auto value = peek(0);
-                if (fn->cells.size() <= cellIndex)
-                {
-                    fn->cells.push_back(AS_CELL(ALLOC_CELL(value)));
-                }
-                else
-                {
-                    fn->cells[cellIndex]->value = value;
-                }
+                auto op1 = bp[READ_WORD()];
+                auto op2 = fn->co->constants[READ_WORD()];
+                addValues(op1, op2);
                 break;
             }
-
-            case OP_LOAD_CELL:
+            case OP_COMPARE_LOCAL_CONST_JMP_IF_FALSE:
             {
-                auto cellIndex = READ_BYTE();
-                push(CELL(fn->cells[cellIndex]));
+                auto op1 = bp[READ_WORD()];
+                auto op2 = fn->co->constants[READ_WORD()];
+                auto op = READ_WORD();
+                auto address = READ_WORD();
+                compareJmpIfFalse(op1, op2, op, address);
                 break;
             }
+            default:
+                DIE << "Unknown wide opcode: " << std::hex << int(ip[-1]);
+            }
+            DISPATCH();
+        }
 
-            case OP_MAKE_FUNCTION:
-            {
-                auto co = AS_CODE(pop());
-                auto cellsCount = READ_BYTE();
+        UNKNOWN_INSTRUCTION():
+            DIE << "Unknown opcode: " << std::hex << int(ip[-1]);
+#ifndef XP_COMPUTED_GOTO
+            }
+        }
+#endif
+        return pop();
+    }
 
-                auto fnValue = ALLOC_FUNCTION(co);
-                auto fn = AS_FUNCTION(fnValue);
+    /**
+     * Generic `+` over the two topmost values: numbers are added,
+     * strings concatenated. Any other operands are a type error.
+     */
+    void add()
+    {
+        auto op2 = peek(0);
+        auto op1 = peek(1);
 
-                for (auto i = 0; i < cellsCount; i++)
-                {
-                    fn->cells.push_back(AS_CELL(pop()));
-                }
+        if (IS_NUMBER(op1) && IS_NUMBER(op2))
+        {
+            popN(2);
+            push(NUMBER(AS_NUMBER(op1) + AS_NUMBER(op2)));
+        }
+        else if (IS_STRING(op1) && IS_STRING(op2))
+        {
+            concat();
+        }
+        else
+        {
+            DIE << "Can't add " << op1 << " and " << op2;
+        }
+    }
 
-                break;
-            }
+    /**
+     * Concatenates the two topmost values, which are strings.
+     */
+    void concat()
+    {
+        maybeGC();
+        auto s1 = AS_CPPSTRING(peek(1));
+        auto s2 = AS_CPPSTRING(peek(0));
+        popN(2);
+        push(ALLOC_STRING(s1 + s2));
+    }
 
-            case OP_SCOPE_EXIT:
-            {
-                auto count = READ_BYTE();
-                *(sp - 1 - count) = peek(0);
-                popN(count);
-                break;
-            }
-            case OP_CALL:
-            {
-                auto argsCount = READ_BYTE();
-                auto fnValue = peek(argsCount);
+    /**
+     * Rewrites the ADD (or quickened ADD) at `instruction` into the form
+     * for the types of the two topmost values. Mixed operands keep the
+     * current form.
+     */
+    void quickenAdd([[maybe_unused]] uint8_t *instruction)
+    {
+#ifndef XP_NO_QUICKENING
+        auto op2 = peek(0);
+        auto op1 = peek(1);
 
-                if (IS_NATIVE(fnValue))
-                {
-                    AS_NATIVE(fnValue)->function();
-                    auto result = pop();
+        if (IS_NUMBER(op1) && IS_NUMBER(op2))
+        {
+            *instruction = OP_ADD_NUM;
+        }
+        else if (IS_STRING(op1) && IS_STRING(op2))
+        {
+            *instruction = OP_ADD_STR;
+        }
+#endif
+    }
 
-                    popN(argsCount + 1);
-                    push(result);
-                }
+    /**
+     * Rewrites the COMPARE (or quickened compare) at `instruction` into
+     * its number form when the two topmost values are numbers, and back
+     * to COMPARE otherwise.
+     */
+    void quickenCompare([[maybe_unused]] uint8_t *instruction)
+    {
+#ifndef XP_NO_QUICKENING
+        auto op = instruction[1];
+
+        if (op <= OP_NE_NUM - OP_LT_NUM && IS_NUMBER(peek(0)) && IS_NUMBER(peek(1)))
+        {
+            *instruction = OP_LT_NUM + op;
+        }
+        else
+        {
+            *instruction = OP_COMPARE;
+        }
+#endif
+    }
+
+    /**
+     * `+` of two operands which aren't on the stack yet.
+     */
+    void addValues(const XPValue &op1, const XPValue &op2)
+    {
+        if (IS_NUMBER(op1) && IS_NUMBER(op2))
+        {
+            push(NUMBER(AS_NUMBER(op1) + AS_NUMBER(op2)));
+        }
+        else
+        {
+            push(op1);
+            push(op2);
+            add();
+        }
+    }
+
+    void compareJmpIfFalse(const XPValue &op1, const XPValue &op2, uint8_t op, size_t address)
+    {
+        bool cond;
+
+        if (IS_NUMBER(op1) && IS_NUMBER(op2))
+        {
+            cond = compareValues(op, AS_NUMBER(op1), AS_NUMBER(op2));
+        }
+        else
+        {
+            push(op1);
+            push(op2);
+            compare(op);
+            cond = AS_BOOLEAN(pop());
+        }
 
-                auto callee = AS_FUNCTION(fnValue);
+        if (!cond)
+        {
+            ip = TO_ADDRESS(address);
+        }
+    }
 
-                callStack.push(Frame{ip, bp, fn});
+    /**
+     * Value of an `if`/`while` test, which must be a boolean.
+     */
+    bool condition(const XPValue &value)
+    {
+        if (!IS_BOOLEAN(value))
+        {
+            DIE << "Condition is not a boolean: " << value;
+        }
 
-                fn = callee;
+        return AS_BOOLEAN(value);
+    }
 
-                fn->cells.resize(fn->co->freeCount);
+    /**
+     * Creates a closure from the code object on top of the stack and the
+     * `cellsCount` cells below it.
+     */
+    void makeFunction(size_t cellsCount)
+    {
+        maybeGC();
 
-                bp = sp - argsCount - 1;
+        auto co = AS_CODE(pop());
 
-                ip = &callee->co->code[0];
+        auto fnValue = ALLOC_FUNCTION(co);
+        auto fn = AS_FUNCTION(fnValue);
 
-                break;
-            }
+        fn->cells.resize(cellsCount);
 
-            case OP_RETURN:
-            {
-                auto callerFrame = callStack.top();
+        for (auto i = cellsCount; i > 0; i--)
+        {
+            fn->cells[i - 1] = AS_CELL(pop());
+        }
+        heap->writeBarrier(fn);
+
+        push(fnValue);
+    }
+
+    /**
+     * Pops `count` values below the top one.
+     */
+    void scopeExit(size_t count)
+    {
+        *(sp - 1 - count) = peek(0);
+        popN(count);
+    }
+
+    /**
+     * Calls a native in place. Returns false for bytecode functions.
+     */
+    bool callNative(size_t argsCount)
+    {
+        auto fnValue = peek(argsCount);
+
+        if (!IS_NATIVE(fnValue))
+        {
+            return false;
+        }
 
-                ip = callerFrame.ra;
-                bp = callerFrame.bp;
-                fn = callerFrame.fn;
+        AS_NATIVE(fnValue)->function();
+        auto result = pop();
 
-                callStack.pop();
+        popN(argsCount + 1);
+        push(result);
+        return true;
+    }
+
+    void call(size_t argsCount)
+    {
+        if (callNative(argsCount))
+        {
+            return;
+        }
+
+        // Shift the callee and its arguments up to make room for the
+        // frame record below them.
+        auto callee = AS_FUNCTION(peek(argsCount));
+        auto base = sp - argsCount - 1;
+
+        stack.ensure(base + FRAME_SLOTS + callee->co->maxStack + STACK_RESERVE);
+
+        std::copy_backward(base, sp, sp + FRAME_SLOTS);
+        *(Frame *)base = Frame{ip, bp, fn};
+
+        bp = base + FRAME_SLOTS;
+        sp += FRAME_SLOTS;
+
+        fn = callee;
+
+        fn->cells.resize(fn->co->freeCount);
+
+        ip = callee->co->entry;
+    }
+
+    /**
+     * Replaces the current frame: moves the callee and its arguments down
+     * to bp, and keeps the caller's frame record.
+     */
+    void tailCall(size_t argsCount)
+    {
+        if (callNative(argsCount))
+        {
+            return;
+        }
+
+        auto callee = AS_FUNCTION(peek(argsCount));
+
+        stack.ensure(bp + callee->co->maxStack + STACK_RESERVE);
+
+        std::copy(sp - argsCount - 1, sp, bp);
+        sp = bp + argsCount + 1;
+
+        fn = callee;
+
+        fn->cells.resize(fn->co->freeCount);
+
+        ip = callee->co->entry;
+    }
+
+    /**
+     * Generic comparison of the two topmost values.
+     */
+    void compare(uint8_t op)
+    {
+        auto op2 = pop();
+        auto op1 = pop();
+
+        if (IS_NUMBER(op2) && IS_NUMBER(op1))
+        {
+            COMPARE_VALUES(op, AS_NUMBER(op1), AS_NUMBER(op2));
+        }
+        else if (IS_STRING(op1) && IS_STRING(op2))
+        {
+            COMPARE_VALUES(op, AS_CPPSTRING(op1), AS_CPPSTRING(op2));
+        }
+        else
+        {
+            DIE << "Can't compare " << op1 << " and " << op2;
+        }
+    }
+
+    /**
+     * Stores the top of the stack into a cell, allocating the cell on
+     * the first write.
+     */
+    void setCell(size_t cellIndex)
+    {
+        if (fn->cells.size() <= cellIndex)
+        {
+            maybeGC();
+            fn->cells.push_back(AS_CELL(ALLOC_CELL(peek(0))));
+            heap->writeBarrier(fn);
+        }
+        else
+        {
+            fn->cells[cellIndex]->value = peek(0);
+            heap->writeBarrier(fn->cells[cellIndex]);
+        }
+    }
+
+    /**
+     * GC safe point: every live value is reachable from the roots.
+     * Empties the nursery when it runs low, and collects the old space
+     * once it has grown past the threshold.
+     */
+    void maybeGC()
+    {
+        if (heap->nurseryAvailable() >= NURSERY_RESERVE && heap->oldBytes < gcThreshold)
+        {
+            return;
+        }
+
+        minorGC();
+
+        if (heap->oldBytes >= gcThreshold)
+        {
+            collector->gc(getGCRoots());
+
+            gcThreshold = std::max((size_t)GC_THRESHOLD, heap->oldBytes * 2);
+        }
+    }
+
+    /**
+     * Promotes the nursery survivors. Roots are updated in place.
+     */
+    void minorGC()
+    {
+        forEachStackSlot([&](XPValue &value)
+                         { collector->forward(value); },
+                         [&](Frame &frame)
+                         { collector->forward(frame.fn); });
+
+        collector->forward(fn);
+
+        for (auto &global : global->globals)
+        {
+            collector->forward(global.value);
+        }
+
+        collector->scavenge();
+    }
+
+    std::set<Traceable *> getGCRoots()
+    {
+        auto roots = getStackGCRoots();
+
+        roots.insert((Traceable *)fn);
+
+        auto constantRoots = getConstantGCRoots();
+        roots.insert(constantRoots.begin(), constantRoots.end());
+
+        auto globalRoots = getGlobalGCRoots();
+        roots.insert(globalRoots.begin(), globalRoots.end());
+
+        return roots;
+    }
+
+    std::set<Traceable *> getStackGCRoots()
+    {
+        std::set<Traceable *> roots;
+
+        forEachStackSlot([&](XPValue &value)
+                         {
+                             if (IS_OBJECT(value))
+                             {
+                                 roots.insert((Traceable *)AS_OBJECT(value));
+                             } },
+                         [&](Frame &frame)
+                         { roots.insert((Traceable *)frame.fn); });
+
+        return roots;
+    }
+
+    /**
+     * Walks the stack from the top frame down, calling `onValue` for every
+     * value slot and `onFrame` for every inline frame record.
+     */
+    template <typename ValueFn, typename FrameFn>
+    void forEachStackSlot(ValueFn onValue, FrameFn onFrame)
+    {
+        auto top = sp;
+        auto base = bp;
+
+        for (;;)
+        {
+            for (auto value = base; value < top; value++)
+            {
+                onValue(*value);
+            }
+
+            if (base == stack.begin)
+            {
                 break;
             }
 
-            default:
-                DIE << "Unknown opcode: " << std::hex << int(opcode);
+            auto frame = FRAME_OF(base);
+            onFrame(*frame);
+
+            top = (XPValue *)frame;
+            base = frame->bp;
+        }
+    }
+
+    std::set<Traceable *> getConstantGCRoots()
+    {
+        auto roots = compiler->getConstantObjects();
+        roots.insert(imageObjects.begin(), imageObjects.end());
+        return roots;
+    }
+
+    std::set<Traceable *> getGlobalGCRoots()
+    {
+        std::set<Traceable *> roots;
+
+        for (const auto &global : global->globals)
+        {
+            if (IS_OBJECT(global.value))
+            {
+                roots.insert((Traceable *)AS_OBJECT(global.value));
             }
         }
+
+        return roots;
     }
 
     void
@@ -380,20 +1225,22 @@ public:
     {
         std::cout << "\n---------- Stack ----------\n";
 
-        if (sp == stack.begin())
+        if (sp == stack.begin)
         {
             std::cout << "(empty)";
         }
 
         auto csp = sp - 1;
 
-        while (csp >= stack.begin())
+        while (csp >= stack.begin)
         {
             std::cout << *csp-- << "\n";
         }
         std::cout << "\n";
     }
 
+    std::unique_ptr<XPHeap> heap;
+
     uint8_t *ip;
 
     XPValue *sp;
@@ -406,9 +1253,25 @@ public:
 
     std::unique_ptr<XPCompiler> compiler;
 
-    std::array<XPValue, STACK_LIMIT> stack;
+    XPStack stack;
+
+    /**
+     * Mapped images, kept alive as long as their code may run.
+     */
+    std::vector<std::unique_ptr<XPImage>> images;
+
+    /**
+     * Objects created by loading images; GC roots.
+     */
+    std::set<Traceable *> imageObjects;
+
+    std::unique_ptr<XPCollector> collector;
+
+    size_t gcThreshold = GC_THRESHOLD;
 
-    std::stack<Frame> callStack;
+#ifdef XP_PROFILE_OPCODES
+    OpcodeProfiler profiler;
+#endif
 
     FunctionObject *fn;
 };
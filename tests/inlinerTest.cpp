@@ -0,0 +1,52 @@
+/**
+ * Inlining doesn't change behaviour: every program gives its expected
+ * result, the same with XPCompiler::inlineCalls on and off.
+ */
+#include "test.h"
+
+struct Case
+{
+    const char *program;
+    const char *expected;
+};
+
+static const Case programs[] = {
+    // Bodies ending with a declaration aren't inlined.
+    {"(def f (x) (var y (+ x 1))) (+ (f 5) 1)", "XPValue (NUMBER): 7"},
+    {"(def f (q) (+ (begin (var a 5) (var b 6)) q)) (f 1)", "XPValue (NUMBER): 12"},
+    {"(def f (x) (var y (+ x 1))) (def g (x) (* (f x) 2)) (g 3)", "XPValue (NUMBER): 8"},
+
+    // Locals, and names shadowed at the call site.
+    {"(def f (x) (begin (var t (* x 2)) (+ t 1))) (+ (f 3) (f 4))", "XPValue (NUMBER): 16"},
+    {"(var k 10) (def f (x) (+ x k)) (begin (var k 1) (f 2))", "XPValue (NUMBER): 12"},
+    {"(def f (a b) (- a b)) (var a 1) (var b 5) (f b a)", "XPValue (NUMBER): 4"},
+
+    // Nested calls, and calls of inlined functions in arguments.
+    {"(def sq (x) (* x x)) (def f (x) (+ (sq x) 1)) (f (f 2))", "XPValue (NUMBER): 26"},
+    {"(def g (a) (+ a 1)) (def f (x) (begin (var a (g x)) (g a))) (f (g 1))", "XPValue (NUMBER): 4"},
+
+    // Local functions, and functions which aren't inlined.
+    {"(def f (n) (begin (def twice (x) (* x 2)) (twice (twice n)))) (f 3)", "XPValue (NUMBER): 12"},
+    {"(def fib (n) (if (< n 2) n (+ (fib (- n 1)) (fib (- n 2))))) (fib 12)", "XPValue (NUMBER): 144"},
+    {"(def f (x) (+ x 1)) (var g f) (g 4)", "XPValue (NUMBER): 5"},
+
+    // Errors in inlined bodies.
+    {"(def f (x) (+ x \"a\")) (f 1)", "Fatal error: Can't add XPValue (NUMBER): 1 and XPValue (STRING): \"a\""},
+};
+
+int main()
+{
+    for (const auto &test : programs)
+    {
+        auto inlined = runProgram(test.program, [](XPCompiler &compiler)
+                                  { compiler.inlineCalls = true; });
+        auto called = runProgram(test.program, [](XPCompiler &compiler)
+                                 { compiler.inlineCalls = false; });
+
+        CHECK(inlined == called, test.program << "\n  inlined: " << inlined << "\n  called: " << called);
+        CHECK(called.output.find(test.expected) == 0,
+              test.program << "\n  " << called << "\n  expected: " << test.expected);
+    }
+
+    return testResult("inlinerTest");
+}
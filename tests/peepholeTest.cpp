@@ -0,0 +1,112 @@
+/**
+ * The peephole optimizer shortens the bytecode without changing
+ * behaviour: every program gives its expected result with
+ * XPCompiler::optimize on and off (XP_NO_PEEPHOLE), and is shorter with
+ * it on.
+ */
+#include "test.h"
+
+struct Case
+{
+    const char *program;
+    const char *expected;
+};
+
+static const Case programs[] = {
+    // Jump threading: the inner if's JMP goes to the outer one's end (and
+    // the outer one's JMP, only reached from it, is removed).
+    {"(var i 0) (var n 0)"
+     "(while (< i 10) (begin (if (> i 5) (if (> i 7) (set n (+ n 10)) (set n (+ n 1))) (set n (- n 1))) (set i (+ i 1))))"
+     "n",
+     "XPValue (NUMBER): 16"},
+    {"(var x 7) (if (< x 0) (if (< x 9) 1 (while true x)) 3)", "XPValue (NUMBER): 3"},
+
+    // Unreachable code: the exit of a loop which never ends, on a branch
+    // which isn't taken.
+    {"(def f (x) (if (> x 0) x (while true (set x (+ x 1))))) (f 5)", "XPValue (NUMBER): 5"},
+
+    // A push followed by POP, in statement position.
+    {"(var x 1) (begin x 2 \"s\" x (+ x 1))", "XPValue (NUMBER): 2"},
+    {"(begin (while false 1) 5)", "XPValue (NUMBER): 5"},
+
+    // SET_CELL; POP, and LOAD_CELL; POP.
+    {"(def counter () (begin (var c 0) (lambda () (begin (set c (+ c 1)) c c)))) (var k (counter)) (k) (k) (k)",
+     "XPValue (NUMBER): 3"},
+
+    // Adjacent scope exits.
+    {"(begin (var a 1) (begin (var b 2) (begin (var c 3) (+ a (+ b c)))))", "XPValue (NUMBER): 6"},
+
+    // Locals, strings and calls.
+    {"(def f (a b) (begin (var t (+ a b)) (if (> t 10) \"big\" \"small\"))) (+ (f 3 4) (f 10 20))",
+     "XPValue (STRING): \"smallbig\""},
+};
+
+// Errors are the same with the optimizer on.
+static const Case errors[] = {
+    {"(+ 1 \"a\")", "Fatal error: Can't add XPValue (NUMBER): 1 and XPValue (STRING): \"a\""},
+    {"(< \"a\" 1)", "Fatal error: Can't compare XPValue (STRING): \"a\" and XPValue (NUMBER): 1"},
+    {"(if \"x\" 1 2)", "Fatal error: Condition is not a boolean: XPValue (STRING): \"x\""},
+    {"(if 1 2 3)", "Fatal error: Condition is not a boolean: XPValue (NUMBER): 1"},
+};
+
+/**
+ * Size of the code of `co` and of the functions it defines.
+ */
+static size_t codeSize(CodeObject *co)
+{
+    auto size = co->code.size();
+
+    for (const auto &constant : co->constants)
+    {
+        if (IS_CODE(constant))
+        {
+            size += codeSize(AS_CODE(constant));
+        }
+        else if (IS_FUNCTION(constant))
+        {
+            size += codeSize(AS_FUNCTION(constant)->co);
+        }
+    }
+
+    return size;
+}
+
+static size_t codeSize(const std::string &program, bool optimize)
+{
+    XPVM vm;
+    vm.getCompiler().optimize = optimize;
+
+    return codeSize(vm.compile(program)->co);
+}
+
+static void check(const Case &test, bool optimize)
+{
+    auto outcome = runProgram(test.program, [=](XPCompiler &compiler)
+                              { compiler.optimize = optimize; });
+
+    CHECK(outcome.output.find(test.expected) == 0,
+          test.program << "\n  optimize " << optimize << ": " << outcome << "\n  expected: " << test.expected);
+}
+
+int main()
+{
+    for (const auto &test : programs)
+    {
+        check(test, true);
+        check(test, false);
+
+        auto optimized = codeSize(test.program, true);
+        auto unoptimized = codeSize(test.program, false);
+
+        CHECK(optimized < unoptimized,
+              test.program << "\n  " << optimized << " bytes optimized, " << unoptimized << " unoptimized");
+    }
+
+    for (const auto &test : errors)
+    {
+        check(test, true);
+        check(test, false);
+    }
+
+    return testResult("peepholeTest");
+}
@@ -0,0 +1,31 @@
+#!/bin/sh
+# Builds and runs every test (tests/*Test.cpp), and checks that the generated
+# parser is up to date; exits nonzero if any fails.
+#
+#   ./tests/run.sh [extra compiler flags, e.g. -DXP_NO_NAN_BOXING]
+
+cd "$(dirname "$0")/.." || exit 1
+
+CXX=${CXX:-c++}
+BUILD=${TMPDIR:-/tmp}/xpvm-tests
+mkdir -p "$BUILD"
+
+status=0
+
+if command -v python3 >/dev/null; then
+    python3 src/parser/generateParser.py --check || status=1
+fi
+
+for test in tests/*Test.cpp; do
+    name=$(basename "$test" .cpp)
+
+    if ! "$CXX" -std=c++17 -O1 -pthread "$@" "$test" -o "$BUILD/$name"; then
+        echo "$name: BUILD FAILED"
+        status=1
+        continue
+    fi
+
+    "$BUILD/$name" || status=1
+done
+
+exit $status
@@ -0,0 +1,150 @@
+/**
+ * XPVM::execStream: empty input has a value, and memory stays flat however
+ * many forms are streamed (nothing is kept per form once it has run).
+ */
+#include <sys/resource.h>
+
+#include <algorithm>
+#include <functional>
+#include <sstream>
+#include <thread>
+
+#include "test.h"
+
+static void writeAll(int fd, const std::string &data)
+{
+    for (size_t written = 0; written < data.size();)
+    {
+        auto count = write(fd, data.data() + written, data.size() - written);
+
+        if (count <= 0)
+        {
+            return;
+        }
+
+        written += count;
+    }
+}
+
+/**
+ * Runs the program `writeProgram` writes to a pipe, in a child process.
+ * The output is the result and the peak RSS in KB.
+ */
+static Outcome runStream(std::function<void(int)> writeProgram)
+{
+    return runForked([&]()
+                     {
+        int fds[2];
+        pipe(fds);
+
+        std::thread writer([&]()
+                           {
+            writeProgram(fds[1]);
+            close(fds[1]); });
+
+        // The result is printed before its VM is destroyed.
+        std::stringstream result;
+
+        {
+            XPVM vm;
+            result << vm.execStream(fds[0]);
+        }
+
+        writer.join();
+
+        struct rusage usage;
+        getrusage(RUSAGE_SELF, &usage);
+
+        std::cout << result.str() << "\n"
+                  << std::dec << usage.ru_maxrss << "\n"; });
+}
+
+static Outcome runStream(const std::string &program)
+{
+    return runStream([&](int fd)
+                     { writeAll(fd, program); });
+}
+
+static long peakRss(const Outcome &outcome)
+{
+    auto end = outcome.output.find_last_not_of('\n');
+    auto start = outcome.output.find_last_of('\n', end);
+
+    return std::stol(outcome.output.substr(start + 1, end - start));
+}
+
+/**
+ * Runs `forms` top-level forms, the i-th one `form(i)`. They are
+ * generated as they're written, so only the VM's memory grows with them.
+ */
+static Outcome runForms(int forms, std::string (*form)(int))
+{
+    return runStream([=](int fd)
+                     {
+        for (auto i = 0; i < forms; i++)
+        {
+            writeAll(fd, form(i));
+        } });
+}
+
+/**
+ * A distinct string literal per form.
+ */
+static std::string distinctLiteral(int i)
+{
+    return "(+ \"a string literal which is only used once: " + std::to_string(i) + "\" \"\")\n";
+}
+
+/**
+ * Calls which are inlined, of functions whose names and parameters are
+ * from a fixed set, but rarely the same pair twice.
+ */
+static std::string inlinedCalls(int i)
+{
+    auto f = "f" + std::to_string(i % 97);
+    auto x = "x" + std::to_string(i / 97 % 1000);
+
+    return "(begin (def " + f + " (" + x + ") (begin (var t (* " + x + " 2)) (+ t 1))) (" + f + " (" + f + " 1)))\n";
+}
+
+/**
+ * Checks that 4x the forms run in the same memory.
+ */
+static void checkFlat(const char *name, std::string (*form)(int))
+{
+    auto small = runForms(25000, form);
+    auto large = runForms(100000, form);
+
+    CHECK(small.status == 0 && large.status == 0, name << ": streaming failed: " << small << ", " << large);
+
+    if (small.status == 0 && large.status == 0)
+    {
+        auto growth = peakRss(large) - peakRss(small);
+        CHECK(growth < 4096, name << ": peak RSS grew by " << growth << " KB from 25000 to 100000 forms");
+    }
+}
+
+int main()
+{
+    for (auto empty : {"", "   \n\t", "// only a comment\n", "/* and */ // comments"})
+    {
+        auto outcome = runStream(empty);
+        CHECK(outcome.status == 0 && outcome.output.find("XPValue (BOOLEAN): false\n") == 0,
+              "empty input \"" << empty << "\": " << outcome);
+    }
+
+    // Nothing is printed for the forms, only the last one's value.
+    auto last = runStream("(var x 1)\n(+ x 41)\n");
+    CHECK(last.status == 0 && last.output.find("XPValue (NUMBER): 42\n") == 0 &&
+              std::count(last.output.begin(), last.output.end(), '\n') == 2,
+          "last form's value: " << last);
+
+    // Interning the literals took 18 MB more.
+    checkFlat("distinct literals", distinctLiteral);
+
+    // Interning a name per inlined function and parameter took 17 MB
+    // more.
+    checkFlat("inlined calls", inlinedCalls);
+
+    return testResult("streamTest");
+}
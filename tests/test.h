@@ -0,0 +1,118 @@
+/**
+ * Helpers for the tests under tests/. Each test is a program which prints
+ * its failed checks and returns nonzero if there were any; tests/run.sh
+ * builds and runs them all.
+ */
+#ifndef __test_h
+#define __test_h
+
+#include <sys/wait.h>
+#include <unistd.h>
+
+#include <iostream>
+#include <string>
+
+#include "../src/vm/xp.h"
+
+static int failures = 0;
+
+#define CHECK(condition, message)                                                \
+    do                                                                           \
+    {                                                                            \
+        if (!(condition))                                                        \
+        {                                                                        \
+            std::cerr << __FILE__ << ":" << __LINE__ << ": " << message << "\n"; \
+            failures++;                                                          \
+        }                                                                        \
+    } while (false)
+
+/**
+ * Exit status and output (stdout and stderr) of a child process.
+ */
+struct Outcome
+{
+    int status;
+    std::string output;
+
+    bool operator==(const Outcome &other) const
+    {
+        return status == other.status && output == other.output;
+    }
+};
+
+inline std::ostream &operator<<(std::ostream &os, const Outcome &outcome)
+{
+    return os << "status " << outcome.status << ", output \"" << outcome.output << "\"";
+}
+
+/**
+ * Runs `f` in a child process, so that a fatal error (DIE exits) is an
+ * outcome like any other.
+ */
+template <typename F>
+Outcome runForked(F f)
+{
+    int fds[2];
+
+    if (pipe(fds) == -1)
+    {
+        DIE << "runForked: pipe failed";
+    }
+
+    std::cout.flush();
+    std::cerr.flush();
+
+    auto pid = fork();
+
+    if (pid == 0)
+    {
+        close(fds[0]);
+        dup2(fds[1], STDOUT_FILENO);
+        dup2(fds[1], STDERR_FILENO);
+        f();
+        std::cout.flush();
+        std::cerr.flush();
+        _exit(0);
+    }
+
+    close(fds[1]);
+
+    Outcome outcome{0, ""};
+    char buffer[4096];
+    ssize_t count;
+
+    while ((count = read(fds[0], buffer, sizeof(buffer))) > 0)
+    {
+        outcome.output.append(buffer, count);
+    }
+
+    close(fds[0]);
+
+    int status;
+    waitpid(pid, &status, 0);
+    outcome.status = WIFEXITED(status) ? WEXITSTATUS(status) : 128 + WTERMSIG(status);
+
+    return outcome;
+}
+
+/**
+ * Compiles and runs `program` in a new VM, in a child process, after
+ * `configure(compiler)`; the output ends with the result.
+ */
+template <typename F>
+Outcome runProgram(const std::string &program, F configure)
+{
+    return runForked([&]()
+                     {
+        XPVM vm;
+        configure(vm.getCompiler());
+        std::cout << vm.run(vm.compile(program)) << "\n"; });
+}
+
+inline int testResult(const char *name)
+{
+    std::cout << name << ": " << (failures == 0 ? "OK" : "FAILED") << "\n";
+    return failures == 0 ? 0 : 1;
+}
+
+#endif
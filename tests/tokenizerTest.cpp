@@ -0,0 +1,115 @@
+/**
+ * The hand-written scanner (Tokenizer::scanToken_) returns the same
+ * tokens, locations and errors as the regex rules generated from
+ * XPGrammar.bnf, on the files of tests/corpus and on random inputs.
+ *
+ *   tokenizerTest [corpus directory, tests/corpus by default]
+ */
+#include <dirent.h>
+
+#include <fstream>
+#include <random>
+#include <sstream>
+
+#include "test.h"
+
+using namespace syntax;
+
+/**
+ * The tokens of `source`, one per line, ending with EOF or the error.
+ */
+static std::string tokenize(const std::string &source, bool regexRules)
+{
+    Tokenizer tokenizer;
+    tokenizer.regexRules = regexRules;
+    tokenizer.initString(source);
+
+    std::stringstream ss;
+
+    try
+    {
+        for (;;)
+        {
+            auto token = tokenizer.getNextToken();
+
+            ss << (int)token.type << " " << token.startOffset << "-" << token.endOffset << " "
+               << token.startLine << ":" << token.startColumn << "-"
+               << token.endLine << ":" << token.endColumn << " "
+               << tokenizer.text(token) << "\n";
+
+            if (token.type == TokenType::__EOF)
+            {
+                break;
+            }
+        }
+    }
+    catch (std::runtime_error *error)
+    {
+        ss << "error: " << error->what();
+        delete error;
+    }
+
+    return ss.str();
+}
+
+static void checkSame(const std::string &name, const std::string &source)
+{
+    // Syntax errors are expected; the tokenizer also prints them.
+    std::stringstream errors;
+    auto cerr = std::cerr.rdbuf(errors.rdbuf());
+
+    auto scanned = tokenize(source, false);
+    auto matched = tokenize(source, true);
+
+    std::cerr.rdbuf(cerr);
+
+    CHECK(scanned == matched, name << "\n--- scanner:\n"
+                                   << scanned << "\n--- regex rules:\n"
+                                   << matched);
+}
+
+int main(int argc, char const *argv[])
+{
+    std::string corpus = argc > 1 ? argv[1] : "tests/corpus";
+
+    auto files = 0;
+
+    if (auto dir = opendir(corpus.c_str()))
+    {
+        while (auto entry = readdir(dir))
+        {
+            std::string name = entry->d_name;
+
+            if (name.size() > 3 && name.compare(name.size() - 3, 3, ".xp") == 0)
+            {
+                std::ifstream file(corpus + "/" + name);
+                std::stringstream ss;
+                ss << file.rdbuf();
+                checkSame(name, ss.str());
+                files++;
+            }
+        }
+
+        closedir(dir);
+    }
+
+    // Random inputs, mostly of the characters which start or end tokens.
+    const std::string alphabet = "()\"/*  \n\r\t\v09az_-+=!<>;#.\x80\xff";
+    std::mt19937 random(2024);
+
+    for (auto i = 0; i < 20000; i++)
+    {
+        std::string source(random() % 64, ' ');
+
+        for (auto &c : source)
+        {
+            c = alphabet[random() % alphabet.size()];
+        }
+
+        checkSame("random input: \"" + source + "\"", source);
+    }
+
+    CHECK(files > 0, "no .xp files in " << corpus);
+
+    return testResult("tokenizerTest");
+}